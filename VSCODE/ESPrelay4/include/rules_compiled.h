@@ -0,0 +1,112 @@
+#pragma once
+// Règles simples compilées: rulesDoc est traduit une seule fois (rebuildRuntimeFromRules)
+// en table POD; la boucle évalue des masques d'entrées, sans JSON ni strcmp.
+// Sans dépendance Arduino: aussi compilé par le test natif (test/test_rules).
+#include <stdint.h>
+#include <string.h>
+#include <ArduinoJson.h>
+
+enum RuleOp : uint8_t {
+  RULE_NONE = 0,
+  RULE_FOLLOW,
+  RULE_AND,
+  RULE_OR,
+  RULE_XOR,
+  RULE_TOGGLE_RISE,
+  RULE_PULSE_RISE
+};
+
+static const uint8_t RULE_NO_INPUT = 0xFF;
+
+struct CompiledRule {
+  uint8_t op;        // RuleOp
+  uint8_t in;        // index 0-based (FOLLOW/TOGGLE/PULSE), RULE_NO_INPUT si hors plage
+  bool invert;
+  uint16_t inMask;   // AND/OR/XOR: bits des entrées combinées
+  uint32_t onDelay;
+  uint32_t offDelay;
+  uint32_t pulseMs;
+};
+
+static inline RuleOp ruleOpFromText(const char* op) {
+  if(strcmp(op, "NONE")==0) return RULE_NONE;
+  if(strcmp(op, "FOLLOW")==0) return RULE_FOLLOW;
+  if(strcmp(op, "AND")==0) return RULE_AND;
+  if(strcmp(op, "OR")==0) return RULE_OR;
+  if(strcmp(op, "XOR")==0) return RULE_XOR;
+  if(strcmp(op, "TOGGLE_RISE")==0) return RULE_TOGGLE_RISE;
+  if(strcmp(op, "PULSE_RISE")==0) return RULE_PULSE_RISE;
+  return RULE_NONE;
+}
+
+static inline uint8_t ruleInputIndex(int n, int inputCount) {
+  if(n < 1 || n > inputCount) return RULE_NO_INPUT;
+  return (uint8_t)(n - 1);
+}
+
+static inline void compileRule(JsonObject r, CompiledRule &out, int inputCount) {
+  out = CompiledRule();
+  out.in = RULE_NO_INPUT;
+  JsonObject expr = r["expr"].as<JsonObject>();
+  const uint32_t rulePulseMs = r["pulseMs"] | 200;
+  out.op = ruleOpFromText(expr["op"] | "FOLLOW");
+  out.invert = r["invert"] | false;
+  out.onDelay = r["onDelay"] | 0;
+  out.offDelay = r["offDelay"] | 0;
+
+  switch(out.op){
+    case RULE_FOLLOW:
+    case RULE_TOGGLE_RISE:
+      out.in = ruleInputIndex(expr["in"] | 1, inputCount);
+      break;
+    case RULE_PULSE_RISE:
+      out.in = ruleInputIndex(expr["in"] | 1, inputCount);
+      out.pulseMs = expr["pulseMs"] | rulePulseMs;
+      if(out.pulseMs == 0) out.pulseMs = 1;
+      break;
+    case RULE_AND:
+    case RULE_OR:
+    case RULE_XOR: {
+      JsonArray ins = expr["ins"].as<JsonArray>();
+      if(!ins || ins.size()==0){ out.op = RULE_NONE; break; }
+      for(JsonVariant v : ins){
+        uint8_t idx = ruleInputIndex((int)v, inputCount);
+        if(idx == RULE_NO_INPUT){
+          // entrée hors plage = toujours false: AND ne peut plus être vrai
+          if(out.op == RULE_AND){ out.op = RULE_NONE; out.inMask = 0; break; }
+          continue;
+        }
+        // XOR: une entrée répétée s'annule (b ^ b), comme l'évaluation JSON
+        if(out.op == RULE_XOR) out.inMask ^= (uint16_t)(1u << idx);
+        else out.inMask |= (uint16_t)(1u << idx);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+// Expression seule (sans invert ni délais). cur/rise: masques des entrées combinées
+// et de leurs fronts montants; toggle/pulseUntil: état du relais évalué.
+static inline bool ruleEvalExpr(const CompiledRule &r, uint16_t cur, uint16_t rise, uint32_t now,
+                                bool &toggle, uint32_t &pulseUntil) {
+  switch(r.op){
+    case RULE_FOLLOW:
+      return (r.in != RULE_NO_INPUT) && ((cur >> r.in) & 1u);
+    case RULE_AND:
+      return (cur & r.inMask) == r.inMask;
+    case RULE_OR:
+      return (cur & r.inMask) != 0;
+    case RULE_XOR:
+      return (__builtin_popcount((unsigned)(cur & r.inMask)) & 1) != 0;
+    case RULE_TOGGLE_RISE:
+      if(r.in != RULE_NO_INPUT && ((rise >> r.in) & 1u)) toggle = !toggle;
+      return toggle;
+    case RULE_PULSE_RISE:
+      if(r.in != RULE_NO_INPUT && ((rise >> r.in) & 1u)) pulseUntil = now + r.pulseMs;
+      return now < pulseUntil;
+    default:
+      return false;
+  }
+}
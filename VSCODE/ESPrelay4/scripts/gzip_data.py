@@ -0,0 +1,30 @@
+Import("env")
+import gzip
+import os
+import shutil
+
+# Pré-compresse data/ avant la construction de l'image LittleFS:
+# le firmware sert <fichier>.gz (Content-Encoding: gzip) quand il existe.
+GZIP_EXT = (".html", ".json", ".js", ".css", ".svg")
+
+
+def gzip_data(source, target, env):
+    data_dir = env.subst("$PROJECT_DATA_DIR")
+    if not os.path.isdir(data_dir):
+        return
+    for name in sorted(os.listdir(data_dir)):
+        if not name.endswith(GZIP_EXT):
+            continue
+        src = os.path.join(data_dir, name)
+        dst = src + ".gz"
+        if os.path.exists(dst) and os.path.getmtime(dst) >= os.path.getmtime(src):
+            continue
+        # mtime=0: sortie reproductible, donc ETag stable entre deux builds identiques
+        with open(src, "rb") as f_in, open(dst, "wb") as raw:
+            with gzip.GzipFile(filename="", mode="wb", compresslevel=9, fileobj=raw, mtime=0) as f_out:
+                shutil.copyfileobj(f_in, f_out)
+        print("[gzip] %s: %u -> %u bytes" % (name, os.path.getsize(src), os.path.getsize(dst)))
+
+
+fs_name = env.GetProjectOption("board_build.filesystem", "spiffs")
+env.AddPreAction("$BUILD_DIR/%s.bin" % fs_name, gzip_data)
@@ -37,7 +37,10 @@
 #include <cstring>
 #include <OneWire.h>
 #include <DallasTemperature.h>
-#include <DHT.h>
+#include <esp_timer.h>
+#include <driver/gpio.h>
+#include <esp_heap_caps.h>
+#include "rules_compiled.h"
 
 #ifndef RXD0
 #define RXD0 44
@@ -71,6 +74,9 @@ static const int PIN_MODEM_NET = 16;     // NETLIGHT output from modem
 // A7670 HW design guide: PWRKEY low pulse >=50 ms, UART ready ~11.2 s
 static const uint32_t MODEM_PWRKEY_ON_PULSE_MS = 80;
 static const uint32_t MODEM_BOOT_WAIT_MS = 12000;
+static const uint32_t GSM_RETRY_MS = 10000;        // pause après un échec avant de reprendre
+static const uint32_t GSM_REG_TIMEOUT_MS = 60000;  // attente d'enregistrement réseau
+static const uint32_t GSM_HEALTH_MS = 5000;        // une sonde santé par période une fois connecté
 
 // GPRS credentials (used as defaults if MQTT GSM fields are empty)
 static const char GPRS_DEFAULT_APN[] = "iot.1nce.net";
@@ -81,7 +87,7 @@ static const char SIM_PIN[] = "";
 // MQTT keepalive in seconds (default 30 min for low GSM traffic)
 static const uint16_t MQTT_KEEPALIVE_SECONDS = 1800;
 static const uint16_t MQTT_SOCKET_TIMEOUT_SECONDS = 1;
-static const uint32_t MQTT_STARTUP_GRACE_MS = 15000;
+static const uint32_t MQTT_STARTUP_GRACE_MS = 2000;
 
 // I2C (PCA9538)
 static const int I2C_SDA = 8;     
@@ -94,6 +100,11 @@ static const uint8_t MAX_RELAYS = PCA_MAX_MODULES * RELAYS_PER_MODULE;
 static const uint8_t MAX_INPUTS = PCA_MAX_MODULES * INPUTS_PER_MODULE;
 static const uint8_t SHUTTER_MAX = MAX_RELAYS / 2;
 static const uint8_t TEMP_MAX_SENSORS = 8;
+// PCA9538 INT (open-drain, actif bas) par module, -1 = non câblé -> polling à chaque loop.
+// Plusieurs modules peuvent partager la même broche (wired-OR).
+static const int PIN_PCA_INT[PCA_MAX_MODULES] = {-1, -1, -1, -1};
+static const uint32_t PCA_INT_FALLBACK_POLL_MS = 1000; // santé / INT manquée
+static const uint32_t PCA_ABSENT_PROBE_MS = 2000;      // sondage des adresses absentes / modules muets
 
 // W5500 (SPI)
 static const int PIN_W5500_CS = 10;
@@ -119,6 +130,99 @@ EthernetServerCompat server(80);
 static WiFiServer wifiServer(80);
 static DNSServer wifiDns;
 
+// ================== HTTP connexions (non bloquantes) ==================
+// W5500: 8 sockets, dont 1 MQTT et 1 en écoute -> 6 connexions HTTP simultanées.
+static const uint8_t HTTP_MAX_CONN = 6;
+static const uint16_t HTTP_REQ_BUF = 1536;  // ligne de requête + en-têtes, parsés sur place
+static const int HTTP_MAX_BODY = 32768;
+static const uint32_t HTTP_IDLE_TIMEOUT_MS = 3000;  // requête incomplète
+static const uint32_t HTTP_SEND_TIMEOUT_MS = 4000;  // aucun progrès en émission
+static const uint32_t HTTP_CLOSE_WAIT_MS = 200;     // laisse le client fermer en premier
+static const uint32_t HTTP_KEEPALIVE_IDLE_MS = 5000; // attente de la requête suivante
+static const uint8_t HTTP_KEEPALIVE_MAX_REQ = 32;    // requêtes max par connexion
+static const size_t HTTP_TX_CHUNK = 1024;
+
+enum HttpConnState : uint8_t { HC_FREE, HC_HEADERS, HC_BODY, HC_SEND, HC_CLOSING, HC_STREAM };
+
+struct HttpConn {
+  HttpConnState st = HC_FREE;
+  bool fromWifi = false;
+  EthernetClient eth;
+  WiFiClient wifi;
+  uint32_t lastIoMs = 0;
+
+  // requête: un seul buffer, méthode/chemin/en-têtes utiles = vues (terminées par '\0') dedans
+  char reqBuf[HTTP_REQ_BUF];
+  uint16_t reqLen = 0;
+  uint16_t lineStart = 0;
+  bool gotRequestLine = false;
+  const char* method = "";
+  const char* path = "";
+  const char* query = "";
+  const char* authHeader = "";
+  const char* contentType = "";
+  const char* checksumSha256 = "";
+  const char* ifNoneMatch = "";
+  bool acceptGzip = false;
+  int contentLen = 0;
+  String body;
+
+  // réponse: en-têtes/JSON en RAM, puis fichier éventuel par blocs
+  String out;
+  size_t outOff = 0;
+  File file;
+  uint8_t fileBuf[512];
+  uint16_t fileLen = 0;
+  uint16_t fileOff = 0;
+  bool rebootAfterSend = false;
+  bool stream = false; // /api/events: reste ouverte après l'envoi
+  // /api/history: blocs de l'historique envoyés un par un (chunked)
+  bool hist = false;
+  bool histFirst = true;
+  uint16_t histMask = 0;
+  uint32_t histSeq = 0;
+  uint32_t histFromDs = 0;
+  uint32_t histToDs = 0;
+  bool keepAlive = false;
+  uint8_t requests = 0; // réponses déjà servies sur cette connexion
+
+  Client& client() { return fromWifi ? (Client&)wifi : (Client&)eth; }
+};
+
+static HttpConn httpConns[HTTP_MAX_CONN];
+// Réponse en cours: keep-alive ou close (décidé par httpDispatch, lu par sendText/sendFile)
+static bool httpKeepAliveReply = false;
+
+static void httpAddConnectionHeader(String& hdr) {
+  if (httpKeepAliveReply) hdr += "Connection: keep-alive\r\nKeep-Alive: timeout=5\r\n";
+  else hdr += "Connection: close\r\n";
+}
+
+// Client qui accumule la réponse d'une route; la machine à états la pousse
+// ensuite vers le socket par morceaux, sans bloquer la boucle.
+class HttpResponseWriter final : public Client {
+public:
+  explicit HttpResponseWriter(String& out) : out_(out) {}
+  int connect(IPAddress, uint16_t) override { return 0; }
+  int connect(const char*, uint16_t) override { return 0; }
+  size_t write(uint8_t b) override { out_ += (char)b; return 1; }
+  size_t write(const uint8_t* buf, size_t size) override {
+    out_.concat((const char*)buf, size);
+    return size;
+  }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int read(uint8_t*, size_t) override { return -1; }
+  int peek() override { return -1; }
+  void flush() override {}
+  void stop() override {}
+  uint8_t connected() override { return 1; }
+  operator bool() override { return true; }
+
+private:
+  String& out_;
+};
+
 // BLE (read-only state JSON)
 static NimBLEServer* bleServer = nullptr;
 static NimBLECharacteristic* bleStateChar = nullptr;
@@ -133,8 +237,7 @@ static bool bleEnabled = true;
 
 static void buildStateJson(String &out);
 static void buildStateJsonBle(String &out);
-static bool saveBleCfg();
-static bool loadBleCfg();
+static bool saveConfigStore();
 static bool clientWriteAll(Client& c, const uint8_t* data, size_t len, uint32_t timeoutMs = 1500);
 static bool clientWriteString(Client& c, const String& s, uint32_t timeoutMs = 1500);
 static String mqttDeviceId();
@@ -234,6 +337,9 @@ struct MqttConfig {
   String apn;
   String gsmUser;
   String gsmPass;
+  bool stateBulk;
+  bool gsmBulkOnly;
+  uint16_t gsmBudgetMb;
 };
 
 static MqttConfig mqttCfg = {
@@ -253,15 +359,87 @@ static MqttConfig mqttCfg = {
   true,                    // retain: publier les etats avec le flag retain
   String(GPRS_DEFAULT_APN),   // apn: APN data pour connexion GSM
   String(GPRS_DEFAULT_USER),  // gsmUser: user APN (GPRS)
-  String(GPRS_DEFAULT_PASS)   // gsmPass: mot de passe APN (GPRS)
+  String(GPRS_DEFAULT_PASS),  // gsmPass: mot de passe APN (GPRS)
+  true,                    // stateBulk: publier aussi l'etat groupe <base>/state
+  false,                   // gsmBulkOnly: sur GSM, seulement <base>/state (pas de topics par entite)
+  0                        // gsmBudgetMb: budget data mensuel de la SIM en Mo (0 = pas de politique adaptative)
+};
+
+// Octets MQTT par transport: total TCP (CONNECT, PUBLISH, PING...) et PUBLISH par famille de topics.
+enum MqttFamily : uint8_t { MF_STATE, MF_IO, MF_TELEMETRY, MF_ACK, MF_DISCOVERY, MF_CMD, MF_SYS, MF_COUNT };
+static const char* const MQTT_FAMILY_NAMES[MF_COUNT] = {"state", "io", "telemetry", "ack", "discovery", "cmd", "sys"};
+
+struct MqttTraffic {
+  uint64_t tx;
+  uint64_t rx;
+  uint64_t famTx[MF_COUNT];
+  uint64_t famRx[MF_COUNT];
+  uint32_t msgTx;
+  uint32_t msgRx;
+  uint32_t lastRxMs;    // dernier octet reçu (sonde de santé du lien)
+};
+static MqttTraffic mqttTrafficEth = {};
+static MqttTraffic mqttTrafficGsm = {};
+
+// Consommation GSM du mois calendaire (horloge réseau du modem), persistée dans /gsm_usage.json.
+struct GsmUsage {
+  uint32_t month;       // AAAAMM, 0 = horloge réseau pas encore lue
+  uint64_t bytes;
+  uint64_t savedBytes;
+  uint32_t savedMs;
+};
+static GsmUsage gsmUsage = {};
+
+// Client transparent qui compte les octets échangés par PubSubClient.
+class MqttCountingClient final : public Client {
+public:
+  MqttCountingClient(Client& inner, MqttTraffic& t, uint64_t* billed = nullptr)
+    : in_(inner), t_(t), billed_(billed) {}
+  int connect(IPAddress ip, uint16_t port) override { return in_.connect(ip, port); }
+  int connect(const char* host, uint16_t port) override { return in_.connect(host, port); }
+  size_t write(uint8_t b) override { return countTx(in_.write(b)); }
+  size_t write(const uint8_t* buf, size_t size) override { return countTx(in_.write(buf, size)); }
+  int available() override { return in_.available(); }
+  int read() override {
+    const int c = in_.read();
+    if (c >= 0) countRx(1);
+    return c;
+  }
+  int read(uint8_t* buf, size_t size) override {
+    const int n = in_.read(buf, size);
+    if (n > 0) countRx((size_t)n);
+    return n;
+  }
+  int peek() override { return in_.peek(); }
+  void flush() override { in_.flush(); }
+  void stop() override { in_.stop(); }
+  uint8_t connected() override { return in_.connected(); }
+  operator bool() override { return (bool)in_; }
+
+private:
+  size_t countTx(size_t n) {
+    t_.tx += n;
+    if (billed_) *billed_ += n;
+    return n;
+  }
+  void countRx(size_t n) {
+    t_.rx += n;
+    t_.lastRxMs = millis();
+    if (billed_) *billed_ += n;
+  }
+  Client& in_;
+  MqttTraffic& t_;
+  uint64_t* billed_;
 };
 
 static EthernetClient mqttEth;
 static HardwareSerial& SerialAT = Serial1;
 static TinyGsm modem(SerialAT);
 static TinyGsmClient mqttGsm(modem);
-static PubSubClient mqttClientEth(mqttEth);
-static PubSubClient mqttClientGsm(mqttGsm);
+static MqttCountingClient mqttEthCounted(mqttEth, mqttTrafficEth);
+static MqttCountingClient mqttGsmCounted(mqttGsm, mqttTrafficGsm, &gsmUsage.bytes);
+static PubSubClient mqttClientEth(mqttEthCounted);
+static PubSubClient mqttClientGsm(mqttGsmCounted);
 static uint32_t mqttLastConnectEthMs = 0;
 static uint32_t mqttLastConnectGsmMs = 0;
 static uint32_t mqttLastEthFailMs = 0;
@@ -270,6 +448,8 @@ static bool mqttEthAuthBlocked = false;
 static bool mqttStartupGraceLogged = false;
 static bool mqttAnnouncedEth = false;
 static bool mqttAnnouncedGsm = false;
+static uint32_t mqttDiscHash = 0; // empreinte de la dernière discovery publiée (0 = à republier)
+static uint32_t mqttDiscEvictions = 0; // configs discovery perdues avant émission (évincées, rejetées, file vidée)
 static bool mqttDisabledWarned = false;
 static volatile bool mqttFastCommandPending = false;
 static uint32_t mqttFastModeUntilMs = 0;
@@ -279,7 +459,25 @@ static bool modemPowerKickDone = false;
 static bool simPinChecked = false;
 static bool gsmNetworkReady = false;
 static bool gsmDataReady = false;
-static uint32_t gsmLastTryMs = 0;
+enum GsmStage : uint8_t {
+  GS_IDLE, GS_UART, GS_PROBE, GS_PWRKEY, GS_BOOT, GS_AUTOBAUD, GS_INIT,
+  GS_SIM, GS_SIM_PIN, GS_CCID, GS_REG, GS_PDP, GS_IP, GS_READY, GS_BACKOFF
+};
+struct GsmLink {
+  uint8_t stage;
+  uint8_t step;           // sous-étape: index de séquence AT, candidat autobaud, sonde
+  uint8_t tries;
+  bool atBusy;            // une commande AT attend sa réponse
+  uint32_t stageMs;       // entrée dans l'étape courante
+  uint32_t waitUntilMs;   // rien à faire avant cette échéance
+  uint32_t atDeadlineMs;
+  const char* atExpect;   // ligne finale attendue (URC) à la place de OK, ou nullptr
+  char cmd[96];
+  char line[128];
+  uint8_t lineLen;
+  char info[96];          // première ligne utile de la réponse
+};
+static GsmLink gsmLink = {};
 static uint32_t gsmLastDebugMs = 0;
 static bool gsmLastNetConnected = false;
 static bool gsmLastDataConnected = false;
@@ -308,18 +506,42 @@ static DeviceAddress tempAddr[TEMP_MAX_SENSORS];
 static float tempC[TEMP_MAX_SENSORS];
 static float lastTempPub[TEMP_MAX_SENSORS];
 static uint8_t tempCount = 0;
-static uint32_t lastTempReadMs = 0;
+
+static const uint8_t TEMP_DEFAULT_RES = 12;        // bits (9..12)
+static const uint16_t TEMP_DEFAULT_INTERVAL_S = 5;
+
+// Réglage persistant par capteur, repéré par son adresse 1-Wire (/config.bin)
+struct TempSensorCfg {
+  DeviceAddress addr;
+  uint8_t res;
+  uint16_t intervalS;
+};
+static TempSensorCfg tempCfg[TEMP_MAX_SENSORS];
+static uint8_t tempCfgCount = 0;
+
+struct TempSensorRt {
+  uint8_t res;
+  uint16_t intervalS;
+  uint32_t nextDueMs;
+  uint32_t lastOkMs;
+  uint32_t crcErr;   // scratchpad reçu mais CRC faux: valeur précédente gardée
+  uint32_t missed;   // pas de réponse (reset sans présence ou bus à 0xFF)
+};
+static TempSensorRt tempRt[TEMP_MAX_SENSORS];
+static bool tempParasite = false;
+
 
 static uint8_t shuttersLimit();
 
-static DHT dht(PIN_DHT, DHT22);
 static bool dhtPresent = false;
 static float dhtTempC = NAN;
 static float lastDhtPub = NAN;
 static float dhtHum = NAN;
 static float lastDhtHumPub = NAN;
 static bool dhtCheckDone = false;
-static uint32_t dhtNextProbeMs = 0;
+static uint32_t dhtReadOk = 0;
+static uint32_t dhtChecksumErr = 0;
+static uint32_t dhtMissed = 0;  // trame absente ou incomplète
 
 
 struct AuthConfig {
@@ -353,10 +575,18 @@ bool relayFromSimple[MAX_RELAYS] = {0};
 bool relayFromShutter[MAX_RELAYS] = {0};
 
 uint8_t pcaOutCache[PCA_MAX_MODULES] = {0};
+uint8_t pcaOutWritten[PCA_MAX_MODULES] = {0};   // dernière valeur REG_OUTPUT écrite avec succès
+bool pcaOutDirty[PCA_MAX_MODULES] = {false};    // écriture à (re)faire
+static const uint32_t PCA_OUTPUT_REFRESH_MS = 5000;
+static uint32_t pcaLastRefreshMs = 0;
+static uint8_t pcaRefreshNext = 0;
 bool pcaPresent[PCA_MAX_MODULES] = {false};
 bool pcaAlive[PCA_MAX_MODULES] = {false};
 uint8_t pcaFailCount[PCA_MAX_MODULES] = {0};
 uint32_t pcaLastOkMs[PCA_MAX_MODULES] = {0};
+static uint32_t pcaLastPollMs[PCA_MAX_MODULES] = {0};
+static volatile uint8_t pcaIntPending = 0; // bit m = INT reçue pour le module m
+static portMUX_TYPE pcaIntMux = portMUX_INITIALIZER_UNLOCKED;
 uint8_t pcaCount = 0;
 uint8_t totalRelays = 4;
 uint8_t totalInputs = 4;
@@ -379,14 +609,192 @@ uint32_t pendingDeadlineMs[MAX_RELAYS] = {0};
 // Réservation des relais par volet
 bool reservedByShutter[MAX_RELAYS] = {false};
 
+// Evaluation événementielle: la logique ne tourne que si une entrée, une commande
+// ou un timer a bougé (plus un balayage complet lent par sécurité)
+static const uint32_t CONTROL_FULL_EVAL_MS = 1000;
+static bool controlDirty = true;
+static uint32_t controlLastFullEvalMs = 0;
+
+static void controlMarkDirty() {
+  controlDirty = true;
+}
+
+// ===============================================================
+// Tâche contrôle (cœur 1) <-> tâche réseau (cœur 0)
+// ===============================================================
+// La tâche contrôle possède l'I2C et l'état E/S (entrées, relais, overrides, volets).
+// Le réseau ne l'écrit jamais directement: il poste des commandes dans une file,
+// et lit un instantané publié par la tâche contrôle (seqlock, sans verrou).
+static const uint32_t CONTROL_PERIOD_MS = 2;
+static const uint8_t CONTROL_TASK_CORE = 1;
+static const uint8_t NET_TASK_CORE = 0;
+static const UBaseType_t CONTROL_TASK_PRIO = configMAX_PRIORITIES - 4; // au-dessus du réseau
+static const UBaseType_t NET_TASK_PRIO = 1;
+static const uint8_t CONTROL_QUEUE_LEN = 16;
+
+enum ControlCmdType : uint8_t { CC_VIN, CC_OVERRIDE, CC_SHUTTER };
+static const int8_t CC_TOGGLE = 2; // valeur spéciale pour CC_VIN / CC_OVERRIDE
+
+struct ControlCmd {
+  uint8_t type;
+  uint8_t index;  // 0-based
+  int8_t value;   // CC_VIN: 0/1/CC_TOGGLE, CC_OVERRIDE: -1/0/1/CC_TOGGLE, CC_SHUTTER: ManualCmd
+  uint8_t ack;    // slot d'acquittement ou CONTROL_NO_ACK
+  uint8_t ackGen; // génération du slot au moment de l'envoi
+};
+
+// Acquittements: la tâche contrôle tamponne le slot une fois le cycle des sorties
+// terminé; la tâche réseau le lit puis libère le slot. Un seul mot 32 bits (écriture
+// atomique): génération (8) | écriture PCA réussie (1) | micros & 0x7FFFFF (23).
+// La génération écarte le tampon d'une commande restée en file après le timeout de
+// son slot, qui sinon acquitterait le nouveau propriétaire avant son application.
+static const uint8_t CONTROL_ACK_SLOTS = 8;
+static const uint8_t CONTROL_NO_ACK = 0xFF;
+static const uint32_t CONTROL_ACK_US_MASK = 0x7FFFFFu;
+static const uint32_t CONTROL_ACK_OK = 0x800000u;
+static volatile uint32_t controlAckWord[CONTROL_ACK_SLOTS]; // 0 = pas encore appliquée
+static uint8_t controlAckGen[CONTROL_ACK_SLOTS];            // écrit par la tâche réseau seule
+
+static QueueHandle_t controlQueue = nullptr;
+// Seule la reconfiguration (règles/volets) prend ce verrou côté réseau.
+static SemaphoreHandle_t controlMutex = nullptr;
+
+static bool controlPost(uint8_t type, uint8_t index, int8_t value, uint8_t ack = CONTROL_NO_ACK) {
+  if (!controlQueue) return false;
+  ControlCmd c = {type, index, value, ack, ack < CONTROL_ACK_SLOTS ? controlAckGen[ack] : (uint8_t)0};
+  return xQueueSend(controlQueue, &c, 0) == pdTRUE;
+}
+
+static void controlLock() {
+  if (controlMutex) xSemaphoreTake(controlMutex, portMAX_DELAY);
+}
+
+static void controlUnlock() {
+  if (controlMutex) xSemaphoreGive(controlMutex);
+}
+
+// Instantané de l'état E/S, bits indexés 0-based.
+struct IoSnapshot {
+  uint32_t version;  // incrémenté à chaque changement publié
+  uint16_t inputs;
+  uint16_t virtualInputs;
+  uint16_t relays;
+  uint16_t reserved;
+  uint8_t pcaOk;     // bit m = module m a répondu < 5 s
+  uint8_t pcaFail[PCA_MAX_MODULES];
+  int8_t overrideRelay[MAX_RELAYS];
+  uint8_t shutterMove[SHUTTER_MAX];
+  uint32_t shutterCooldownUntilMs[SHUTTER_MAX];
+};
+
+static IoSnapshot ioSnap;
+static volatile uint32_t ioSnapSeq = 0; // impair = écriture en cours
+
+static void ioSnapshotRead(IoSnapshot& out) {
+  for (;;) {
+    const uint32_t s1 = __atomic_load_n(&ioSnapSeq, __ATOMIC_ACQUIRE);
+    if (s1 & 1u) continue;
+    memcpy(&out, (const void*)&ioSnap, sizeof(out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&ioSnapSeq, __ATOMIC_RELAXED) == s1) return;
+  }
+}
+
+static inline bool snapBit(uint16_t mask, int i) {
+  return (mask >> i) & 1u;
+}
+
 // ===================== Règles JSON en RAM ======================
 JsonDocument rulesDoc;
 
+// ===============================================================
+// Métriques: durée des étapes (esp_timer, µs 64 bits), I2C, heap
+// ===============================================================
+// Chaque étape n'est mesurée que par une seule tâche (contrôle ou réseau). Les étapes
+// contrôle sont enregistrées sous controlLock(): la tâche réseau les copie (sumUs
+// 64 bits) et remet leur fenêtre à zéro via metricStageCopy, sous le même verrou.
+enum MetricStage : uint8_t {
+  MS_CONTROL_PERIOD,  // écart réel entre deux cycles de contrôle
+  MS_CONTROL,         // controlStep complet
+  MS_PCA_READ,        // pcaReadInputs
+  MS_RULES,           // evalSimpleRules
+  MS_PCA_WRITE,       // pcaRefreshOutputs
+  MS_NET,             // netStep complet
+  MS_HTTP,            // handleHttp
+  MS_GSM,             // gsmStep
+  MS_MQTT,            // mqttLoop
+  MS_SENSORS,         // tempTick + dhtTick + histTick
+  MS_COUNT
+};
+static const char* const METRIC_STAGE_NAMES[MS_COUNT] = {
+  "control_period", "control", "pca_read", "rules", "pca_write",
+  "net", "http", "gsm", "mqtt", "sensors"
+};
+// bornes hautes des seaux (µs); le dernier seau est +Inf
+static const uint32_t METRIC_BUCKET_US[] = {50, 200, 1000, 5000, 20000, 100000, 1000000};
+static const uint8_t METRIC_BUCKETS = sizeof(METRIC_BUCKET_US) / sizeof(METRIC_BUCKET_US[0]);
+
+struct StageStat {
+  uint32_t count;
+  uint32_t minUs;
+  uint32_t maxUs;
+  uint32_t winMaxUs;  // max depuis la dernière publication <base>/diag
+  uint64_t sumUs;
+  uint32_t bucket[METRIC_BUCKETS + 1];  // non cumulés
+};
+static StageStat stageStats[MS_COUNT];
+
+struct I2cStats {
+  uint32_t ops[2];       // [0]=lecture, [1]=écriture
+  uint32_t retries[2];   // tentatives supplémentaires
+  uint32_t failures[2];  // échec après 3 tentatives
+};
+static I2cStats i2cStats;
+
+static inline int64_t metricStart() {
+  return esp_timer_get_time();
+}
+
+static void metricRecordUs(MetricStage s, uint32_t us) {
+  StageStat& st = stageStats[s];
+  if (st.count == 0 || us < st.minUs) st.minUs = us;
+  if (us > st.maxUs) st.maxUs = us;
+  if (us > st.winMaxUs) st.winMaxUs = us;
+  st.count++;
+  st.sumUs += us;
+  uint8_t b = 0;
+  while (b < METRIC_BUCKETS && us > METRIC_BUCKET_US[b]) b++;
+  st.bucket[b]++;
+}
+
+// esp_timer plutôt que le compteur de cycles 32 bits (rebouclé après ~17 s à 240 MHz):
+// une étape réseau peut bloquer plus longtemps (upload OTA, restauration, connexion
+// TinyGSM/PubSubClient) et ce sont justement ces blocages qu'il faut voir.
+static inline uint32_t metricElapsedUs(int64_t startUs) {
+  const int64_t us = esp_timer_get_time() - startUs;
+  return us > (int64_t)UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+static inline void metricStop(MetricStage s, int64_t startUs) {
+  metricRecordUs(s, metricElapsedUs(startUs));
+}
+
+// Lecture depuis la tâche réseau; resetWin ouvre une nouvelle fenêtre winMaxUs
+static void metricStageCopy(MetricStage s, StageStat& out, bool resetWin) {
+  const bool ctl = s < MS_NET;
+  if (ctl) controlLock();
+  out = stageStats[s];
+  if (resetWin) stageStats[s].winMaxUs = 0;
+  if (ctl) controlUnlock();
+}
+
 // ===============================================================
 // I2C helpers (STOP entre write et read => évite i2cWriteReadNonStop)
 // ===============================================================
 static bool i2cReadReg8(uint8_t addr, uint8_t reg, uint8_t &val) {
+  i2cStats.ops[0]++;
   for(int attempt=0; attempt<3; attempt++){
+    if (attempt) i2cStats.retries[0]++;
     Wire.beginTransmission(addr);
     Wire.write(reg);
     if (Wire.endTransmission(true) != 0) { delay(2); continue; } // STOP
@@ -394,24 +802,68 @@ static bool i2cReadReg8(uint8_t addr, uint8_t reg, uint8_t &val) {
     val = Wire.read();
     return true;
   }
+  i2cStats.failures[0]++;
   return false;
 }
 
 static bool i2cWriteReg8(uint8_t addr, uint8_t reg, uint8_t val) {
+  i2cStats.ops[1]++;
   for(int attempt=0; attempt<3; attempt++){
+    if (attempt) i2cStats.retries[1]++;
     Wire.beginTransmission(addr);
     Wire.write(reg);
     Wire.write(val);
     if (Wire.endTransmission(true) == 0) return true; // STOP
     delay(2);
   }
+  i2cStats.failures[1]++;
   return false;
 }
 
 // ===============================================================
 // LittleFS helpers
 // ===============================================================
-static String readFile(const char* path) {
+// Les fichiers de config sont écrits dans "<path>.tmp" puis renommés (remplacement
+// atomique sous LittleFS), avec un pied "\n#crc32 xxxxxxxx\n" vérifié à la lecture.
+// Une coupure pendant l'écriture laisse donc l'ancienne version intacte.
+static const size_t CFG_FOOTER_LEN = 17;
+static const char CFG_FOOTER_TAG[] = "\n#crc32 ";
+
+static uint32_t crc32Buf(const uint8_t* p, size_t n) {
+  uint32_t c = 0xFFFFFFFFu;
+  for (size_t i = 0; i < n; i++) {
+    c ^= (uint8_t)p[i];
+    for (uint8_t b = 0; b < 8; b++) c = (c >> 1) ^ (0xEDB88320u & (0u - (c & 1u)));
+  }
+  return ~c;
+}
+
+static bool cfgHasFooter(const uint8_t* p, size_t n) {
+  return n >= CFG_FOOTER_LEN && memcmp(p + n - CFG_FOOTER_LEN, CFG_FOOTER_TAG, sizeof(CFG_FOOTER_TAG) - 1) == 0;
+}
+
+static bool cfgFooterOk(const uint8_t* p, size_t n) {
+  if (!cfgHasFooter(p, n)) return false;
+  char hex[9];
+  memcpy(hex, p + n - 9, 8);
+  hex[8] = 0;
+  return crc32Buf(p, n - CFG_FOOTER_LEN) == (uint32_t)strtoul(hex, nullptr, 16);
+}
+
+static bool cfgHasFooter(const String& s) {
+  return cfgHasFooter((const uint8_t*)s.c_str(), s.length());
+}
+
+// Retire le pied s'il est valide; false si le contenu ne correspond pas au CRC.
+// Un fichier sans pied (écrit par un ancien firmware) est accepté tel quel.
+static bool cfgStripFooter(String& s) {
+  if (!cfgHasFooter(s)) return true;
+  if (!cfgFooterOk((const uint8_t*)s.c_str(), s.length())) return false;
+  s.remove(s.length() - CFG_FOOTER_LEN);
+  return true;
+}
+
+static String readFileRaw(const char* path) {
   if (!LittleFS.exists(path)) return "";
   File f = LittleFS.open(path, "r");
   if(!f) return "";
@@ -420,12 +872,124 @@ static String readFile(const char* path) {
   return s;
 }
 
-static bool writeFile(const char* path, const String& data) {
-  File f = LittleFS.open(path, "w");
+static String readFile(const char* path) {
+  String s = readFileRaw(path);
+  if (s.length() > 0) {
+    if (cfgStripFooter(s)) return s;
+    Serial.printf("[FS] %s: CRC mismatch\n", path);
+  }
+  // coupure entre la fin du .tmp et le rename: le .tmp complet (pied valide) fait foi
+  char tmp[48];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  String t = readFileRaw(tmp);
+  if (cfgHasFooter(t) && cfgStripFooter(t)) {
+    Serial.printf("[FS] %s: recovered from %s\n", path, tmp);
+    LittleFS.rename(tmp, path);
+    return t;
+  }
+  return "";
+}
+
+// Même taille et même pied (CRC) que le fichier en place: rien à écrire.
+static bool cfgSameOnFlash(const char* path, size_t size, const char* footer) {
+  if (!LittleFS.exists(path)) return false;
+  File f = LittleFS.open(path, "r");
+  if (!f) return false;
+  bool same = false;
+  if (f.size() == size && f.seek(size - CFG_FOOTER_LEN)) {
+    char cur[CFG_FOOTER_LEN];
+    same = f.readBytes(cur, CFG_FOOTER_LEN) == CFG_FOOTER_LEN && memcmp(cur, footer, CFG_FOOTER_LEN) == 0;
+  }
+  f.close();
+  return same;
+}
+
+// Variante binaire de readFile (pied obligatoire): tampon malloc() à libérer par
+// l'appelant, taille utile dans len; nullptr si absent ou corrompu.
+static uint8_t* readFileBin(const char* path, size_t& len) {
+  char tmp[48];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  const char* cand[2] = {path, tmp};
+  for (uint8_t i = 0; i < 2; i++) {
+    if (!LittleFS.exists(cand[i])) continue;
+    File f = LittleFS.open(cand[i], "r");
+    if (!f) continue;
+    const size_t n = f.size();
+    uint8_t* buf = (n >= CFG_FOOTER_LEN) ? (uint8_t*)malloc(n) : nullptr;
+    const bool got = buf && (size_t)f.read(buf, n) == n;
+    f.close();
+    if (got && cfgFooterOk(buf, n)) {
+      if (i == 1) {
+        Serial.printf("[FS] %s: recovered from %s\n", path, tmp);
+        LittleFS.rename(tmp, path);
+      }
+      len = n - CFG_FOOTER_LEN;
+      return buf;
+    }
+    free(buf);
+    Serial.printf("[FS] %s: CRC mismatch\n", cand[i]);
+  }
+  return nullptr;
+}
+
+static bool writeFileBin(const char* path, const uint8_t* data, size_t len) {
+  char footer[CFG_FOOTER_LEN + 1];
+  snprintf(footer, sizeof(footer), "%s%08lx\n", CFG_FOOTER_TAG, (unsigned long)crc32Buf(data, len));
+  const size_t total = len + CFG_FOOTER_LEN;
+  if (cfgSameOnFlash(path, total, footer)) return true; // contenu identique: pas d'effacement flash
+  char tmp[48];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  File f = LittleFS.open(tmp, "w");
   if(!f) return false;
-  f.print(data);
+  size_t w = f.write(data, len);
+  w += f.write((const uint8_t*)footer, CFG_FOOTER_LEN);
   f.close();
-  return true;
+  if (w != total) {
+    LittleFS.remove(tmp);
+    return false;
+  }
+  return LittleFS.rename(tmp, path);
+}
+
+static bool writeFile(const char* path, const String& data) {
+  return writeFileBin(path, (const uint8_t*)data.c_str(), data.length());
+}
+
+// Écritures différées: les bascules répétées (Wi-Fi/BLE via MQTT, empreinte discovery)
+// ne réécrivent la flash qu'une fois le calme revenu (2 s après la dernière demande,
+// 10 s au plus). Les routes HTTP gardent une écriture immédiate pour rapporter l'erreur.
+enum CfgSaveSlot : uint8_t { CS_CONFIG, CS_MQTT_DISC, CS_COUNT };
+static const uint32_t CFG_SAVE_DEBOUNCE_MS = 2000;
+static const uint32_t CFG_SAVE_MAX_DELAY_MS = 10000;
+
+struct CfgPendingSave {
+  bool dirty;
+  uint32_t firstMs;
+  uint32_t lastMs;
+};
+static CfgPendingSave cfgPending[CS_COUNT] = {};
+
+static bool saveMqttDiscHash();
+static bool (*const CFG_SAVERS[CS_COUNT])() = {saveConfigStore, saveMqttDiscHash};
+static const char* const CFG_SAVE_NAMES[CS_COUNT] = {"config", "mqtt_disc"};
+
+static void cfgSaveLater(CfgSaveSlot slot) {
+  CfgPendingSave& p = cfgPending[slot];
+  const uint32_t now = millis();
+  if (!p.dirty) p.firstMs = now;
+  p.dirty = true;
+  p.lastMs = now;
+}
+
+static void cfgFlushTick(bool force = false) {
+  const uint32_t now = millis();
+  for (uint8_t i = 0; i < CS_COUNT; i++) {
+    CfgPendingSave& p = cfgPending[i];
+    if (!p.dirty) continue;
+    if (!force && now - p.lastMs < CFG_SAVE_DEBOUNCE_MS && now - p.firstMs < CFG_SAVE_MAX_DELAY_MS) continue;
+    p.dirty = false;
+    if (!CFG_SAVERS[i]()) Serial.printf("[FS] deferred save %s failed\n", CFG_SAVE_NAMES[i]);
+  }
 }
 
 // ===============================================================
@@ -453,43 +1017,19 @@ static void wifiCfgToJson(String &out) {
   serializeJsonPretty(doc, out);
 }
 
-static bool saveWifiCfg(){
-  String out;
-  wifiCfgToJson(out);
-  return writeFile("/wifi.json", out);
-}
-
-static bool loadWifiCfg(){
+// Ancien /wifi.json, lu une seule fois pour migrer vers /config.bin
+static void wifiCfgFromLegacyJson(){
   String s = readFile("/wifi.json");
-  if(s.length() == 0){
-    wifiCfg.enabled = true;
-    wifiCfg.ssid = defaultWifiSsid();
-    wifiCfg.pass = String(WIFI_DEFAULT_PASS);
-    saveWifiCfg();
-    Serial.println("[WIFI] created default /wifi.json");
-    return true;
-  }
-  static JsonDocument doc;
-  doc.clear();
+  if(s.length() == 0) return;
+  JsonDocument doc;
   auto err = deserializeJson(doc, s);
   if(err){
     Serial.printf("[WIFI] JSON parse error -> keep default (%s)\n", err.c_str());
-    wifiCfg.enabled = true;
-    wifiCfg.ssid = defaultWifiSsid();
-    wifiCfg.pass = String(WIFI_DEFAULT_PASS);
-    return false;
+    return;
   }
-  String defSsid = defaultWifiSsid();
   wifiCfg.enabled = (doc["enabled"] | 1) ? true : false;
-  wifiCfg.ssid = String((const char*)(doc["ssid"] | defSsid.c_str()));
+  wifiCfg.ssid = String((const char*)(doc["ssid"] | ""));
   wifiCfg.pass = String((const char*)(doc["pass"] | WIFI_DEFAULT_PASS));
-  if(wifiCfg.ssid.length() == 0){
-    wifiCfg.ssid = defSsid;
-  }
-  if(wifiCfg.pass.length() < 8){
-    wifiCfg.pass = String(WIFI_DEFAULT_PASS);
-  }
-  return true;
 }
 
 static void startWifiAp(){
@@ -531,38 +1071,17 @@ static void applyWifiCfg(){
   updateWifiState(true);
 }
 
-// BLE config (LittleFS)
-static void bleCfgToJson(String &out){
-  static JsonDocument doc;
-  doc.clear();
-  doc["enabled"] = bleEnabled ? 1 : 0;
-  serializeJsonPretty(doc, out);
-}
-
-static bool saveBleCfg(){
-  String out;
-  bleCfgToJson(out);
-  return writeFile("/ble.json", out);
-}
-
-static bool loadBleCfg(){
+// Ancien /ble.json (migration vers /config.bin)
+static void bleCfgFromLegacyJson(){
   String s = readFile("/ble.json");
-  if(s.length() == 0){
-    bleEnabled = true;
-    saveBleCfg();
-    Serial.println("[BLE] created default /ble.json");
-    return true;
-  }
-  static JsonDocument doc;
-  doc.clear();
+  if(s.length() == 0) return;
+  JsonDocument doc;
   auto err = deserializeJson(doc, s);
   if(err){
     Serial.printf("[BLE] JSON parse error -> keep default (%s)\n", err.c_str());
-    bleEnabled = true;
-    return false;
+    return;
   }
   bleEnabled = (doc["enabled"] | 1) ? true : false;
-  return true;
 }
 
 class BleServerCallbacks : public NimBLEServerCallbacks {
@@ -654,38 +1173,18 @@ static void setBleEnabled(bool en){
   }
 }
 
-// Auth config (LittleFS)
-static void authCfgToJson(String &out){
-  static JsonDocument doc;
-  doc.clear();
-  doc["user"] = authCfg.user;
-  doc["pass"] = authCfg.pass;
-  serializeJsonPretty(doc, out);
-}
-
-static bool saveAuthCfg(){
-  String out;
-  authCfgToJson(out);
-  return writeFile("/auth.json", out);
-}
-
-static bool loadAuthCfg(){
+// Ancien /auth.json (migration vers /config.bin)
+static void authCfgFromLegacyJson(){
   String s = readFile("/auth.json");
-  if(s.length() == 0){
-    saveAuthCfg();
-    Serial.println("[AUTH] created default /auth.json");
-    return true;
-  }
-  static JsonDocument doc;
-  doc.clear();
+  if(s.length() == 0) return;
+  JsonDocument doc;
   auto err = deserializeJson(doc, s);
   if(err){
     Serial.printf("[AUTH] JSON parse error -> keep default (%s)\n", err.c_str());
-    return false;
+    return;
   }
   authCfg.user = String((const char*)(doc["user"] | "admin"));
   authCfg.pass = String((const char*)(doc["pass"] | "admin"));
-  return true;
 }
 
 static bool factoryResetHeld(){
@@ -729,12 +1228,16 @@ static void logFactoryPinState(){
 
 static void doFactoryReset(){
   Serial.println("[FACTORY] button held 10s -> reset config");
-  const char* files[] = {"/net.json", "/mqtt.json", "/rules.json", "/auth.json", "/wifi.json", "/ble.json"};
+  const char* files[] = {"/config.bin", "/rules.bin",
+                         "/net.json", "/mqtt.json", "/rules.json", "/auth.json", "/wifi.json", "/ble.json"};
   for(size_t i=0;i<sizeof(files)/sizeof(files[0]);i++){
     if(LittleFS.exists(files[i])){
       LittleFS.remove(files[i]);
       Serial.printf("[FACTORY] removed %s\n", files[i]);
     }
+    char tmp[48];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", files[i]);
+    if(LittleFS.exists(tmp)) LittleFS.remove(tmp);
   }
   delay(200);
   ESP.restart();
@@ -796,25 +1299,15 @@ static void netCfgToJson(String &out) {
   serializeJsonPretty(doc, out);
 }
 
-static bool saveNetCfg() {
-  String out;
-  netCfgToJson(out);
-  return writeFile("/net.json", out);
-}
-
-static bool loadNetCfg() {
+// Ancien /net.json (migration vers /config.bin)
+static void netCfgFromLegacyJson() {
   String s = readFile("/net.json");
-  if (s.length() == 0) {
-    saveNetCfg();
-    Serial.println("[NET] created default /net.json");
-    return true;
-  }
-  static JsonDocument doc;
-  doc.clear();
+  if (s.length() == 0) return;
+  JsonDocument doc;
   auto err = deserializeJson(doc, s);
   if (err) {
     Serial.printf("[NET] JSON parse error -> keep default (%s)\n", err.c_str());
-    return false;
+    return;
   }
   const char* mode = doc["mode"] | "static";
   netCfg.dhcp = (strcmp(mode, "dhcp") == 0);
@@ -839,8 +1332,6 @@ static bool loadNetCfg() {
       Serial.println("[NET] invalid static IP fields -> keep default");
     }
   }
-  Serial.println("[NET] loaded /net.json");
-  return true;
 }
 
 static void applyNetCfg() {
@@ -854,43 +1345,103 @@ static void applyNetCfg() {
 }
 
 // Streaming file (évite page HTML tronquée)
-static void sendFile(Client& client, const char* path, const char* contentType) {
-  File f = LittleFS.open(path, "r");
+// ETag fort = empreinte FNV-1a du fichier servi, calculée une fois puis gardée
+// en cache (une OTA FS redémarre la carte, donc vide le cache).
+struct FileEtag {
+  String path;
+  uint32_t size = 0;
+  uint32_t hash = 0;
+};
+static const uint8_t FILE_ETAG_CACHE = 6;
+static FileEtag fileEtags[FILE_ETAG_CACHE];
+static uint8_t fileEtagNext = 0;
+
+static String fileEtag(const String& path, File& f) {
+  const uint32_t size = (uint32_t)f.size();
+  uint32_t hash = 0;
+  bool found = false;
+  for (uint8_t i = 0; i < FILE_ETAG_CACHE; i++) {
+    if (fileEtags[i].path == path && fileEtags[i].size == size) {
+      hash = fileEtags[i].hash;
+      found = true;
+      break;
+    }
+  }
+  if (!found) {
+    hash = 2166136261u;
+    uint8_t buf[512];
+    while (f.available()) {
+      int n = f.read(buf, sizeof(buf));
+      if (n <= 0) break;
+      for (int i = 0; i < n; i++) {
+        hash ^= buf[i];
+        hash *= 16777619u;
+      }
+    }
+    f.seek(0);
+    FileEtag& e = fileEtags[fileEtagNext];
+    fileEtagNext = (uint8_t)((fileEtagNext + 1) % FILE_ETAG_CACHE);
+    e.path = path;
+    e.size = size;
+    e.hash = hash;
+  }
+  char tag[12];
+  snprintf(tag, sizeof(tag), "\"%08lx\"", (unsigned long)hash);
+  return String(tag);
+}
+
+// En-têtes dans la réponse; le contenu est envoyé par blocs depuis hc.file.
+// Sert <path>.gz (produit au build par scripts/gzip_data.py) si présent.
+static void sendFile(HttpConn& hc, Client& client, const char* path, const char* contentType) {
+  const String gzPath = String(path) + ".gz";
+  const bool hasGz = LittleFS.exists(gzPath);
+  bool gz = false;
+  File f;
+  if (hasGz && (hc.acceptGzip || !LittleFS.exists(path))) {
+    f = LittleFS.open(gzPath, "r");
+    gz = (bool)f;
+  }
+  if (!f) f = LittleFS.open(path, "r");
   if (!f) {
     String body = String("File not found: ") + path + "\n";
     String hdr = "HTTP/1.1 404 Not Found\r\n";
     hdr += "Content-Type: text/plain; charset=utf-8\r\n";
-    hdr += "Connection: close\r\n";
+    httpAddConnectionHeader(hdr);
     hdr += "Content-Length: " + String(body.length()) + "\r\n\r\n";
     clientWriteString(client, hdr, 4000);
     clientWriteString(client, body, 4000);
     return;
   }
 
+  const String etag = fileEtag(gz ? gzPath : String(path), f);
+  if (hc.ifNoneMatch[0] && (strstr(hc.ifNoneMatch, etag.c_str()) || strcmp(hc.ifNoneMatch, "*") == 0)) {
+    f.close();
+    String hdr = "HTTP/1.1 304 Not Modified\r\n";
+    hdr += "ETag: " + etag + "\r\n";
+    hdr += "Cache-Control: no-cache\r\n";
+    if (hasGz) hdr += "Vary: Accept-Encoding\r\n";
+    httpAddConnectionHeader(hdr);
+    hdr += "\r\n";
+    clientWriteString(client, hdr, 4000);
+    return;
+  }
+
   size_t size = f.size();
   String hdr = "HTTP/1.1 200 OK\r\n";
   hdr += "Content-Type: ";
   hdr += contentType;
   hdr += "\r\n";
+  if (gz) hdr += "Content-Encoding: gzip\r\n";
+  if (hasGz) hdr += "Vary: Accept-Encoding\r\n";
+  hdr += "ETag: " + etag + "\r\n";
+  hdr += "Cache-Control: no-cache\r\n"; // revalidation à chaque chargement -> 304 si inchangé
   hdr += "Content-Length: " + String((unsigned)size) + "\r\n";
-  hdr += "Connection: close\r\n\r\n";
-  if (!clientWriteString(client, hdr, 4000)) {
-    f.close();
-    return;
-  }
-
-  uint8_t buf[512];
-  while (f.available()) {
-    int n = f.read(buf, sizeof(buf));
-    if (n <= 0) break;
-    if (!clientWriteAll(client, buf, (size_t)n, 4000)) {
-      break;
-    }
-    delay(0);
-  }
-  f.close();
-  client.flush();
-  delay(5);
+  httpAddConnectionHeader(hdr);
+  hdr += "\r\n";
+  clientWriteString(client, hdr, 4000);
+  hc.file = f;
+  hc.fileLen = 0;
+  hc.fileOff = 0;
 }
 
 // ===============================================================
@@ -922,6 +1473,8 @@ static void pcaScanAndInit() {
     pcaFailCount[m] = 0;
     pcaLastOkMs[m] = 0;
     if (pcaInitModule(addr, pcaOutCache[m])) {
+      pcaOutWritten[m] = pcaOutCache[m];
+      pcaOutDirty[m] = false;
       pcaPresent[m] = true;
       pcaAlive[m] = true;
       pcaLastOkMs[m] = millis();
@@ -942,28 +1495,97 @@ static void pcaScanAndInit() {
   }
 }
 
-static void pcaReadInputs() {
+static void IRAM_ATTR pcaIntIsr(void* arg) {
+  portENTER_CRITICAL_ISR(&pcaIntMux);
+  pcaIntPending |= (uint8_t)(uintptr_t)arg;
+  portEXIT_CRITICAL_ISR(&pcaIntMux);
+}
+
+static bool pcaUsesInt(uint8_t m) {
+  return PIN_PCA_INT[m] >= 0;
+}
+
+static void pcaSetupInterrupts() {
+  uint8_t all = 0;
   for (uint8_t m = 0; m < PCA_MAX_MODULES; m++) {
-    uint8_t base = m * INPUTS_PER_MODULE;
-    uint8_t in = 0;
-    if (!pcaPresent[m]) {
-      // try to recover: probe read even if not marked present
-      if(!i2cReadReg8(PCA_BASE_ADDR + m, REG_INPUT, in)){
-        pcaFailCount[m] = (pcaFailCount[m] < 255) ? (uint8_t)(pcaFailCount[m] + 1) : 255;
-        if(pcaFailCount[m] >= 3) pcaAlive[m] = false;
-        continue;
-      }
-      pcaPresent[m] = true;
-    } else if(!i2cReadReg8(PCA_BASE_ADDR + m, REG_INPUT, in)){
+    const int pin = PIN_PCA_INT[m];
+    if (pin < 0) continue;
+    bool attached = false;
+    for (uint8_t k = 0; k < m; k++) {
+      if (PIN_PCA_INT[k] == pin) attached = true;
+    }
+    if (attached) continue;
+    uint8_t mask = 0;
+    for (uint8_t k = m; k < PCA_MAX_MODULES; k++) {
+      if (PIN_PCA_INT[k] == pin) mask |= (uint8_t)(1u << k);
+    }
+    pinMode(pin, INPUT_PULLUP);
+    attachInterruptArg(digitalPinToInterrupt(pin), pcaIntIsr, (void*)(uintptr_t)mask, FALLING);
+    Serial.printf("[PCA9538] INT on GPIO%d modules=0x%X\n", pin, mask);
+    all |= mask;
+  }
+  // première lecture immédiate pour partir d'un état connu
+  portENTER_CRITICAL(&pcaIntMux);
+  pcaIntPending |= all;
+  portEXIT_CRITICAL(&pcaIntMux);
+}
+
+static void pcaReadModuleInputs(uint8_t m) {
+  uint8_t base = m * INPUTS_PER_MODULE;
+  uint8_t in = 0;
+  if (!pcaPresent[m]) {
+    // try to recover: probe read even if not marked present
+    if(!i2cReadReg8(PCA_BASE_ADDR + m, REG_INPUT, in)){
       pcaFailCount[m] = (pcaFailCount[m] < 255) ? (uint8_t)(pcaFailCount[m] + 1) : 255;
       if(pcaFailCount[m] >= 3) pcaAlive[m] = false;
-      continue;
+      return;
     }
-    pcaFailCount[m] = 0;
-    pcaAlive[m] = true;
-    pcaLastOkMs[m] = millis();
-    for(uint8_t i=0;i<INPUTS_PER_MODULE;i++){
-      rawInputs[base + i] = (in >> (4+i)) & 0x1; // IO4..IO7
+    pcaPresent[m] = true;
+    pcaOutDirty[m] = true; // module (ré)apparu: réappliquer ses sorties
+  } else if(!i2cReadReg8(PCA_BASE_ADDR + m, REG_INPUT, in)){
+    pcaFailCount[m] = (pcaFailCount[m] < 255) ? (uint8_t)(pcaFailCount[m] + 1) : 255;
+    if(pcaFailCount[m] >= 3) pcaAlive[m] = false;
+    return;
+  }
+  if(!pcaAlive[m]) pcaOutDirty[m] = true; // retour après pertes: état inconnu
+  pcaFailCount[m] = 0;
+  pcaAlive[m] = true;
+  pcaLastOkMs[m] = millis();
+  for(uint8_t i=0;i<INPUTS_PER_MODULE;i++){
+    rawInputs[base + i] = (in >> (4+i)) & 0x1; // IO4..IO7
+  }
+}
+
+static void pcaReadInputs() {
+  const uint32_t now = millis();
+  portENTER_CRITICAL(&pcaIntMux);
+  const uint8_t pending = pcaIntPending;
+  pcaIntPending = 0;
+  portEXIT_CRITICAL(&pcaIntMux);
+
+  for (uint8_t m = 0; m < PCA_MAX_MODULES; m++) {
+    bool due = true;
+    if (!pcaPresent[m] || pcaFailCount[m] >= 3) {
+      // adresse absente ou module muet: sonder rarement (3 essais + delay(2) dans
+      // i2cReadReg8, jusqu'au timeout Wire si le bus est bloqué)
+      due = (pcaLastPollMs[m] == 0) || (now - pcaLastPollMs[m] >= PCA_ABSENT_PROBE_MS);
+    } else if (pcaUsesInt(m)) {
+      // INT: lire seulement le module signalé, + poll lent de santé; relire après un échec
+      due = ((pending >> m) & 1u) || pcaFailCount[m] > 0 ||
+            (now - pcaLastPollMs[m] >= PCA_INT_FALLBACK_POLL_MS);
+    }
+    if (!due) continue;
+    pcaLastPollMs[m] = now;
+    pcaReadModuleInputs(m);
+  }
+
+  // ligne partagée encore basse: un autre module attend d'être lu
+  for (uint8_t m = 0; m < PCA_MAX_MODULES; m++) {
+    if (!pcaUsesInt(m) || !pcaPresent[m]) continue;
+    if (digitalRead(PIN_PCA_INT[m]) == LOW) {
+      portENTER_CRITICAL(&pcaIntMux);
+      pcaIntPending |= (uint8_t)(1u << m);
+      portEXIT_CRITICAL(&pcaIntMux);
     }
   }
 }
@@ -993,7 +1615,46 @@ static void pcaApplyRelays() {
       if(v) nibble |= (1u << i);
     }
     pcaOutCache[m] = (pcaOutCache[m] & 0xF0) | (nibble & 0x0F);
-    i2cWriteReg8(PCA_BASE_ADDR + m, REG_OUTPUT, pcaOutCache[m]);
+    if (pcaOutCache[m] == pcaOutWritten[m] && !pcaOutDirty[m]) continue;
+    if (i2cWriteReg8(PCA_BASE_ADDR + m, REG_OUTPUT, pcaOutCache[m])) {
+      pcaOutWritten[m] = pcaOutCache[m];
+      pcaOutDirty[m] = false;
+    } else {
+      pcaOutDirty[m] = true; // retenter au prochain passage
+    }
+  }
+}
+
+// Vérification lente (un module par période): relit CFG/OUTPUT et réécrit
+// si le module a été réinitialisé (brown-out) ou si une écriture a été perdue.
+static void pcaRefreshOutputs() {
+  const uint32_t now = millis();
+  bool retry = false;
+  for (uint8_t m = 0; m < PCA_MAX_MODULES; m++) {
+    if (pcaPresent[m] && pcaAlive[m] && pcaOutDirty[m]) retry = true;
+  }
+  if (retry) pcaApplyRelays();
+  if (now - pcaLastRefreshMs < PCA_OUTPUT_REFRESH_MS) return;
+  pcaLastRefreshMs = now;
+
+  for (uint8_t n = 0; n < PCA_MAX_MODULES; n++) {
+    const uint8_t m = pcaRefreshNext;
+    pcaRefreshNext = (uint8_t)((pcaRefreshNext + 1) % PCA_MAX_MODULES);
+    if (!pcaPresent[m] || !pcaAlive[m]) continue;
+
+    const uint8_t addr = PCA_BASE_ADDR + m;
+    uint8_t cfg = 0;
+    uint8_t out = 0;
+    if (i2cReadReg8(addr, REG_CFG, cfg) && cfg != 0xF0) {
+      Serial.printf("[PCA9538] 0x%02X config lost (cfg=0x%02X) -> re-init\n", addr, cfg);
+      i2cWriteReg8(addr, REG_POL, 0xF0);
+      i2cWriteReg8(addr, REG_CFG, 0xF0);
+      pcaOutDirty[m] = true;
+    } else if (!i2cReadReg8(addr, REG_OUTPUT, out) || (out & 0x0F) != (pcaOutWritten[m] & 0x0F)) {
+      pcaOutDirty[m] = true;
+    }
+    if (pcaOutDirty[m]) pcaApplyRelays();
+    break;
   }
 }
 
@@ -1020,25 +1681,44 @@ static void setDefaultRules() {
   rulesDoc["shutters"].to<JsonArray>(); // vide par défaut
 }
 
+// Règles stockées en MessagePack: même arbre que le JSON de l'API, sans le texte
+// indenté à écrire ni à reparser au boot.
+static const char* RULES_PATH = "/rules.bin";
+
 static bool saveRulesToFS(const JsonDocument& doc) {
-  String out;
-  serializeJsonPretty(doc, out);
-  return writeFile("/rules.json", out);
+  const size_t n = measureMsgPack(doc);
+  uint8_t* buf = (uint8_t*)malloc(n + 1);
+  if(!buf) return false;
+  const bool ok = serializeMsgPack(doc, buf, n) == n && writeFileBin(RULES_PATH, buf, n);
+  free(buf);
+  return ok;
 }
 
 static bool loadRulesFromFS() {
-  String s = readFile("/rules.json");
-  if(s.length() == 0){
-    setDefaultRules();
-    saveRulesToFS(rulesDoc);
-    Serial.println("[RULES] created default /rules.json");
-    return true;
-  }
-
+  size_t n = 0;
+  uint8_t* bin = readFileBin(RULES_PATH, n);
+  DeserializationError err;
   rulesDoc.clear();
-  auto err = deserializeJson(rulesDoc, s);
+  if(bin){
+    err = deserializeMsgPack(rulesDoc, bin, n);
+    free(bin);
+  } else {
+    // premier boot après mise à jour: reprise de l'ancien /rules.json
+    String s = readFile("/rules.json");
+    if(s.length() == 0){
+      setDefaultRules();
+      saveRulesToFS(rulesDoc);
+      Serial.println("[RULES] created default /rules.bin");
+      return true;
+    }
+    err = deserializeJson(rulesDoc, s);
+    if(!err && saveRulesToFS(rulesDoc)){
+      LittleFS.remove("/rules.json");
+      Serial.println("[RULES] migrated /rules.json -> /rules.bin");
+    }
+  }
   if(err){
-    Serial.printf("[RULES] JSON parse error -> default (%s)\n", err.c_str());
+    Serial.printf("[RULES] parse error -> default (%s)\n", err.c_str());
     setDefaultRules();
     saveRulesToFS(rulesDoc);
     return false;
@@ -1075,7 +1755,7 @@ static bool loadRulesFromFS() {
   }
   if(!rulesDoc["version"].is<int>()) rulesDoc["version"] = 2;
 
-  Serial.println("[RULES] loaded /rules.json");
+  Serial.println("[RULES] loaded /rules.bin");
   return true;
 }
 
@@ -1112,6 +1792,9 @@ struct ShutterRuntime {
 
   // API manual command
   ManualCmd manual = MC_NONE;
+
+  // réveil de la logique à la fin du dead-time
+  bool cooldownWake = false;
 };
 
 ShutterCfg shCfg[SHUTTER_MAX];
@@ -1142,15 +1825,35 @@ static String mqttDesiredTransport() {
   return normalizeMqttTransport(mqttCfg.transport);
 }
 
-static const uint32_t MQTT_ETH_RETRY_AFTER_FAIL_MS = 30000;
+// Reconnexion Ethernet: 1 s puis x2 à chaque échec jusqu'à 30 s; immédiate au retour du lien.
+static const uint32_t MQTT_ETH_RETRY_MIN_MS = 1000;
+static const uint32_t MQTT_ETH_RETRY_MAX_MS = 30000;
 static const uint32_t MQTT_ETH_RETRY_AFTER_AUTH_FAIL_MS = 300000;
+static uint32_t mqttEthRetryMs = MQTT_ETH_RETRY_MIN_MS;
+
+struct MqttLinkHealth {
+  bool link;
+  uint32_t linkPollMs;
+  uint32_t pingSentMs;   // PINGREQ en attente (0 = aucun)
+  uint32_t rttMs;        // dernier aller-retour PINGREQ/PINGRESP
+  uint32_t rttMaxMs;
+  uint32_t drops;        // sessions fermées par la sonde
+  uint32_t failovers;    // bascules ETH -> GSM
+};
+static MqttLinkHealth mqttEthHealth = {};
+
+// Mode auto: tant que la session Ethernet est saine, le GSM garde sa session (commandes,
+// disponibilité) mais ne publie ni états ni télémesure.
+static bool mqttGsmStandby() {
+  return mqttDesiredTransport() == "auto" && mqttEthHealth.link && mqttClientEth.connected();
+}
 
 static bool mqttShouldTryEthernetNow() {
   if (Ethernet.linkStatus() != LinkON) return false;
   if (mqttLastEthFailMs == 0) return true;
   const uint32_t age = millis() - mqttLastEthFailMs;
   if (mqttEthAuthBlocked) return age >= MQTT_ETH_RETRY_AFTER_AUTH_FAIL_MS;
-  return age >= MQTT_ETH_RETRY_AFTER_FAIL_MS;
+  return age >= mqttEthRetryMs;
 }
 
 static bool mqttHasDedicatedGsmBroker();
@@ -1254,7 +1957,6 @@ static void gsmMarkDown() {
 }
 
 static bool modemStatusIsOn();
-static bool gsmEnsureData();
 
 static void modemDriveExpectedPins() {
   if (PIN_MODEM_EN >= 0) {
@@ -1345,30 +2047,16 @@ static void gsmDebug1nce(const char* reason, bool force = false) {
     return;
   }
 
-  const bool net = modem.isNetworkConnected();
-  const bool data = modem.isGprsConnected();
-  const int csq = modem.getSignalQuality();
-  const int dbm = gsmRssiToDbm(csq);
-  String op = modem.getOperator();
-  op.trim();
-  String ip = modemIpToString();
-  String apn = gsmLastApn;
-  gsmLastNetConnected = net;
-  gsmLastDataConnected = data;
-  gsmLastCsq = csq;
-  gsmLastDbm = dbm;
-  gsmLastOperator = op;
-  gsmLastIp = ip;
-
+  // Valeurs tenues à jour par gsmStep(): aucun échange AT ici.
   Serial.printf("[GSM][1NCE] %s net=%d data=%d csq=%d dbm=%d op=%s apn=%s ip=%s net_pin=%d status_pin=%d\n",
                 reason,
-                net ? 1 : 0,
-                data ? 1 : 0,
-                csq,
-                dbm,
-                op.length() ? op.c_str() : "-",
-                apn.c_str(),
-                ip.length() ? ip.c_str() : "-",
+                gsmLastNetConnected ? 1 : 0,
+                gsmLastDataConnected ? 1 : 0,
+                gsmLastCsq,
+                gsmLastDbm,
+                gsmLastOperator.length() ? gsmLastOperator.c_str() : "-",
+                gsmLastApn.c_str(),
+                gsmLastIp.length() ? gsmLastIp.c_str() : "-",
                 netPin,
                 statusPin);
 }
@@ -1378,194 +2066,530 @@ static bool modemStatusIsOn() {
   return digitalRead(PIN_MODEM_STATUS) == HIGH;
 }
 
-static void modemPowerKick() {
-  if (PIN_MODEM_PWRKEY < 0) return;
-  // Keep line released high by default, then send active-low pulse.
-  modemDriveExpectedPins();
-  pinMode(PIN_MODEM_PWRKEY, OUTPUT);
-  digitalWrite(PIN_MODEM_PWRKEY, LOW);
-  delay(MODEM_PWRKEY_ON_PULSE_MS);
-  digitalWrite(PIN_MODEM_PWRKEY, HIGH);
-  Serial.printf("[GSM] PWRKEY pulse %lums\n", (unsigned long)MODEM_PWRKEY_ON_PULSE_MS);
-}
-
-static bool modemProbeAtBaud(uint32_t baud, int rxPin, int txPin, String &rxDump) {
-  rxDump = "";
-  SerialAT.end();
-  SerialAT.begin(baud, SERIAL_8N1, rxPin, txPin);
-  delay(80);
-  while (SerialAT.available()) SerialAT.read();
+// ==== GSM: budget data mensuel ====
+// Plus le budget de la SIM est consommé, plus le GSM se limite: bandes mortes de
+// température élargies, état groupé moins fréquent, puis plus de topics par entité.
+static const uint32_t GSM_USAGE_SAVE_BYTES = 32768;   // écriture flash au plus tous les 32 Ko...
+static const uint32_t GSM_USAGE_SAVE_MS = 900000;     // ...ou toutes les 15 min si ça a bougé
+static const uint8_t GSM_DEADBAND_X[4] = {1, 2, 5, 10};  // bande morte temp/hum x N
+static const uint8_t GSM_INTERVAL_X[4] = {1, 5, 15, 60}; // intervalle mini temp-seul / diagnostic x N
+static uint8_t gsmBudgetLevelLast = 0;
 
-  SerialAT.print("AT\r\n");
-  const uint32_t t0 = millis();
-  while (millis() - t0 < 800) {
-    while (SerialAT.available()) {
-      char c = (char)SerialAT.read();
-      if (rxDump.length() < 180) rxDump += c;
-    }
-    if (rxDump.indexOf("OK") >= 0) return true;
-    delay(2);
-  }
-  return false;
+static bool saveGsmUsage() {
+  char out[64];
+  snprintf(out, sizeof(out), "{\"month\":%lu,\"bytes\":%llu}",
+           (unsigned long)gsmUsage.month, (unsigned long long)gsmUsage.bytes);
+  gsmUsage.savedBytes = gsmUsage.bytes;
+  gsmUsage.savedMs = millis();
+  return writeFile("/gsm_usage.json", String(out));
 }
 
-static bool modemProbeAutoBaud() {
-  const uint32_t bauds[] = {115200, 9600, 57600, 38400, 19200};
-  const int candidates[2][2] = {
-    {MODEM_RX, MODEM_TX},
-    {MODEM_TX, MODEM_RX}
-  };
+static void loadGsmUsage() {
+  String s = readFile("/gsm_usage.json");
+  if (s.length() == 0) return;
+  JsonDocument doc;
+  if (deserializeJson(doc, s)) return;
+  gsmUsage.month = doc["month"] | 0u;
+  gsmUsage.bytes = doc["bytes"] | (uint64_t)0;
+  gsmUsage.savedBytes = gsmUsage.bytes;
+}
 
-  for (size_t c = 0; c < 2; c++) {
-    const int rxPin = candidates[c][0];
-    const int txPin = candidates[c][1];
-    for (size_t i = 0; i < (sizeof(bauds) / sizeof(bauds[0])); i++) {
-      String rx;
-      if (modemProbeAtBaud(bauds[i], rxPin, txPin, rx)) {
-        modemUartBaud = bauds[i];
-        modemUartRxPin = rxPin;
-        modemUartTxPin = txPin;
-        modemSerialReady = true;
-        Serial.printf("[GSM] AT detected at %lu bps (RX=%d TX=%d)\n",
-                      (unsigned long)bauds[i], rxPin, txPin);
-        return true;
-      }
-      if (rx.length() > 0) {
-        rx.replace("\r", "\\r");
-        rx.replace("\n", "\\n");
-        Serial.printf("[GSM] probe %lu bps (RX=%d TX=%d) rx=%s\n",
-                      (unsigned long)bauds[i], rxPin, txPin, rx.c_str());
-      }
-    }
+// Appelé quand l'horloge réseau est lue: nouveau mois = compteur remis à zéro.
+static void gsmUsageSetMonth(uint32_t month) {
+  if (month == gsmUsage.month) return;
+  if (gsmUsage.month != 0) {
+    Serial.printf("[GSM] data month %lu: %llu bytes -> reset\n",
+                  (unsigned long)gsmUsage.month, (unsigned long long)gsmUsage.bytes);
+    gsmUsage.bytes = 0;
   }
-  return false;
+  gsmUsage.month = month;
+  saveGsmUsage();
 }
 
-static bool gsmEnsureData() {
-  if (gsmDataReady && modem.isGprsConnected()) return true;
-  const uint32_t now = millis();
-  if (gsmLastTryMs != 0 && (now - gsmLastTryMs < 10000)) return false;
-  gsmLastTryMs = now;
-  gsmDebug1nce("check", false);
+static uint64_t gsmBudgetBytes() {
+  return (uint64_t)mqttCfg.gsmBudgetMb * 1024ull * 1024ull;
+}
 
-  modemDriveExpectedPins();
+// 0: normal, 1: >=50 %, 2: >=75 % (plus de topics par entité), 3: >=90 %
+static uint8_t gsmBudgetLevel() {
+  const uint64_t budget = gsmBudgetBytes();
+  if (budget == 0) return 0;
+  const uint64_t used = gsmUsage.bytes * 100ull;
+  if (used >= budget * 90ull) return 3;
+  if (used >= budget * 75ull) return 2;
+  if (used >= budget * 50ull) return 1;
+  return 0;
+}
 
-  if (!modemSerialReady) {
-    Serial.println("[GSM] wait");
-    // Set GSM module baud rate and UART pins
-    SerialAT.begin(modemUartBaud, SERIAL_8N1, modemUartRxPin, modemUartTxPin);
-    modemSerialReady = true;
-    delay(500);
+static void gsmUsageTick() {
+  if (gsmUsage.bytes != gsmUsage.savedBytes &&
+      (gsmUsage.bytes - gsmUsage.savedBytes >= GSM_USAGE_SAVE_BYTES ||
+       millis() - gsmUsage.savedMs >= GSM_USAGE_SAVE_MS)) {
+    saveGsmUsage();
   }
+  const uint8_t lvl = gsmBudgetLevel();
+  if (lvl != gsmBudgetLevelLast) {
+    Serial.printf("[GSM] data budget %llu/%u MB -> level %u\n",
+                  (unsigned long long)(gsmUsage.bytes >> 20), (unsigned)mqttCfg.gsmBudgetMb, (unsigned)lvl);
+    gsmBudgetLevelLast = lvl;
+  }
+}
 
-  if (!modemReady) {
-    if (!modem.testAT()) {
-      if (!modemPowerKickDone && PIN_MODEM_PWRKEY >= 0) {
-        modemPowerKick();
-        modemPowerKickDone = true;
-        delay(MODEM_BOOT_WAIT_MS);
-      }
-      if (PIN_MODEM_STATUS >= 0) {
-        Serial.printf("[GSM] STATUS pin=%d\n", modemStatusIsOn() ? 1 : 0);
-      }
-  
-      if (!modem.testAT()) {
-        Serial.println("[GSM] no AT response");
-        gsmMarkDown();
-        gsmDebug1nce("no_at", true);
-        return false;
-      }
+// ==== GSM bring-up (non-blocking AT state machine) ====
+// Mise sous tension, détection AT, init, SIM, enregistrement réseau et PDP avancent par
+// petites commandes AT: gsmStep() rend la main tant que la réponse UART n'est pas arrivée
+// et que l'échéance n'est pas atteinte. Aucun delay(): un boot Ethernet-only ne dépend plus du modem.
+
+enum GsmAtResult : uint8_t { GA_PENDING, GA_OK, GA_ERROR, GA_TIMEOUT };
+
+static const char* gsmStageName(uint8_t stage) {
+  static const char* const names[] = {
+    "idle", "uart", "probe", "pwrkey", "boot", "autobaud", "init",
+    "sim", "sim_pin", "ccid", "register", "pdp", "ip", "ready", "backoff"
+  };
+  return (stage < sizeof(names) / sizeof(names[0])) ? names[stage] : "?";
+}
+
+static void gsmEnter(uint8_t stage, uint32_t delayMs = 0) {
+  gsmLink.stage = stage;
+  gsmLink.step = 0;
+  gsmLink.tries = 0;
+  gsmLink.atBusy = false;
+  gsmLink.stageMs = millis();
+  gsmLink.waitUntilMs = gsmLink.stageMs + delayMs;
+}
+
+static void gsmReset() {
+  gsmMarkDown();
+  modemReady = false;
+  modemPowerKickDone = false;
+  simPinChecked = false;
+  modemUartBaud = MODEM_UART_BAUD;
+  modemUartRxPin = MODEM_RX;
+  modemUartTxPin = MODEM_TX;
+  if (modemSerialReady) {
+    SerialAT.end();
+    modemSerialReady = false;
+  }
+  gsmEnter(GS_IDLE);
+}
+
+// Uniquement hors GS_READY: une fois les sockets ouverts, l'UART appartient à TinyGSM.
+static void gsmAtSend(const char* cmd, uint32_t timeoutMs, const char* expect = nullptr) {
+  while (SerialAT.available()) SerialAT.read();
+  if (cmd != gsmLink.cmd) snprintf(gsmLink.cmd, sizeof(gsmLink.cmd), "%s", cmd);
+  gsmLink.lineLen = 0;
+  gsmLink.info[0] = 0;
+  gsmLink.atExpect = expect;
+  gsmLink.atDeadlineMs = millis() + timeoutMs;
+  gsmLink.atBusy = true;
+  SerialAT.print(gsmLink.cmd);
+  SerialAT.print("\r\n");
+}
+
+static uint8_t gsmAtPoll() {
+  while (SerialAT.available()) {
+    const char c = (char)SerialAT.read();
+    if (c == '\r') continue;
+    if (c != '\n') {
+      if (gsmLink.lineLen < sizeof(gsmLink.line) - 1) gsmLink.line[gsmLink.lineLen++] = c;
+      continue;
     }
+    gsmLink.line[gsmLink.lineLen] = 0;
+    const char* ln = gsmLink.line;
+    const bool empty = (gsmLink.lineLen == 0);
+    gsmLink.lineLen = 0;
+    if (empty || strcmp(ln, gsmLink.cmd) == 0) continue; // ligne vide ou écho
+    if (gsmLink.atExpect && strncmp(ln, gsmLink.atExpect, strlen(gsmLink.atExpect)) == 0) {
+      snprintf(gsmLink.info, sizeof(gsmLink.info), "%s", ln);
+      gsmLink.atBusy = false;
+      return GA_OK;
+    }
+    if (strcmp(ln, "OK") == 0) {
+      if (gsmLink.atExpect) continue; // le résultat arrive ensuite en URC
+      gsmLink.atBusy = false;
+      return GA_OK;
+    }
+    if (strcmp(ln, "ERROR") == 0 || strncmp(ln, "+CME ERROR", 10) == 0) {
+      if (!gsmLink.info[0]) snprintf(gsmLink.info, sizeof(gsmLink.info), "%s", ln);
+      gsmLink.atBusy = false;
+      return GA_ERROR;
+    }
+    if (!gsmLink.info[0]) snprintf(gsmLink.info, sizeof(gsmLink.info), "%s", ln);
+  }
+  if ((int32_t)(millis() - gsmLink.atDeadlineMs) >= 0) {
+    gsmLink.atBusy = false;
+    return GA_TIMEOUT;
+  }
+  return GA_PENDING;
+}
 
-    // Restart takes quite some time; init() is faster.
-    Serial.println("[GSM] Initializing modem...");
-    if (!modem.init()) {
-      Serial.println("[GSM] modem init failed");
+// Valeur après "+XXX: " dans la réponse capturée.
+static const char* gsmInfoValue() {
+  const char* v = strchr(gsmLink.info, ':');
+  if (!v) return gsmLink.info;
+  v++;
+  while (*v == ' ') v++;
+  return v;
+}
+
+static void gsmFail(const char* msg, const char* reason) {
+  Serial.printf("[GSM] %s (stage=%s)\n", msg, gsmStageName(gsmLink.stage));
+  gsmMarkDown();
+  gsmDebug1nce(reason, true);
+  gsmEnter(GS_BACKOFF, GSM_RETRY_MS);
+}
+
+static void gsmStep() {
+  if (!mqttTransportAllowsGsm()) {
+    if (gsmLink.stage != GS_IDLE) {
       gsmMarkDown();
-      gsmDebug1nce("modem_init_fail", true);
-      return false;
+      gsmEnter(GS_IDLE);
     }
-    String modemInfo = modem.getModemName();
-    modemInfo.trim();
-    Serial.printf("[GSM] Modem Name: %s\n", modemInfo.length() ? modemInfo.c_str() : "-");
+    return;
+  }
+  if (gsmLink.stage == GS_IDLE) gsmEnter(GS_UART);
+
+  const uint32_t now = millis();
+  if ((int32_t)(now - gsmLink.waitUntilMs) < 0) return;
 
-    modemPowerKickDone = false;
-    modemReady = true;
-    Serial.println("[GSM] modem ready");
+  uint8_t r = GA_PENDING;
+  if (gsmLink.atBusy) {
+    r = gsmAtPoll();
+    if (r == GA_PENDING) return;
   }
 
-  if (!simPinChecked) {
-    simPinChecked = true;
-    int simStatus = modem.getSimStatus();
-    Serial.printf("[GSM] SIM status=%d\n", simStatus);
+  switch (gsmLink.stage) {
+    case GS_UART:
+      modemDriveExpectedPins();
+      if (!modemSerialReady) {
+        Serial.println("[GSM] wait");
+        SerialAT.begin(modemUartBaud, SERIAL_8N1, modemUartRxPin, modemUartTxPin);
+        modemSerialReady = true;
+      }
+      gsmLastApn = gsmEffectiveApn();
+      gsmEnter(GS_PROBE, 100);
+      return;
 
-    // Unlock SIM card with a PIN if needed
-    if (strlen(SIM_PIN) > 0 && simStatus != 3) {
-      Serial.println("[GSM] Unlocking sim card...");
-      if (!modem.simUnlock(SIM_PIN)) {
-        Serial.println("[GSM] SIM unlock failed");
-        gsmMarkDown();
-        gsmDebug1nce("sim_unlock_fail", true);
-        return false;
+    case GS_PROBE:
+      if (r == GA_OK) {
+        gsmEnter(GS_INIT);
+        return;
       }
-      delay(300);
-      simStatus = modem.getSimStatus();
-      Serial.printf("[GSM] SIM status=%d\n", simStatus);
-    }
+      if (r == GA_PENDING || ++gsmLink.tries < 3) {
+        gsmAtSend("AT", 500);
+        return;
+      }
+      if (!modemPowerKickDone && PIN_MODEM_PWRKEY >= 0) {
+        gsmEnter(GS_PWRKEY);
+        return;
+      }
+      gsmFail("no AT response", "no_at");
+      return;
+
+    case GS_PWRKEY:
+      // Impulsion active basse sur PWRKEY, relâchée à l'échéance suivante.
+      if (gsmLink.step == 0) {
+        modemDriveExpectedPins();
+        digitalWrite(PIN_MODEM_PWRKEY, LOW);
+        gsmLink.step = 1;
+        gsmLink.waitUntilMs = now + MODEM_PWRKEY_ON_PULSE_MS;
+        return;
+      }
+      digitalWrite(PIN_MODEM_PWRKEY, HIGH);
+      modemPowerKickDone = true;
+      Serial.printf("[GSM] PWRKEY pulse %lums\n", (unsigned long)MODEM_PWRKEY_ON_PULSE_MS);
+      gsmEnter(GS_BOOT, 1000);
+      return;
 
-    String ccid = modem.getSimCCID();
-    ccid.trim();
-    gsmLastCcid = ccid;
-    Serial.printf("[GSM] SIM CCID=%s\n", ccid.length() ? ccid.c_str() : "-");
+    case GS_BOOT:
+      // Sonde AT chaque seconde: on avance dès que l'UART répond, sans attendre les 12 s.
+      if (r == GA_OK) {
+        Serial.printf("[GSM] AT up %lums after PWRKEY\n", (unsigned long)(now - gsmLink.stageMs));
+        gsmEnter(GS_INIT);
+        return;
+      }
+      if (r != GA_PENDING) {
+        if (now - gsmLink.stageMs >= MODEM_BOOT_WAIT_MS) {
+          if (PIN_MODEM_STATUS >= 0) {
+            Serial.printf("[GSM] STATUS pin=%d\n", modemStatusIsOn() ? 1 : 0);
+          }
+          gsmEnter(GS_AUTOBAUD);
+          return;
+        }
+        gsmLink.waitUntilMs = now + 500;
+        return;
+      }
+      gsmAtSend("AT", 500);
+      return;
 
-    if (simStatus != 3) {
-      Serial.println("[GSM] SIM not ready");
+    case GS_AUTOBAUD: {
+      static const uint32_t bauds[] = {115200, 9600, 57600, 38400, 19200};
+      const uint8_t nb = sizeof(bauds) / sizeof(bauds[0]);
+      const uint8_t c = gsmLink.step;
+      const int rxPin = (c < nb) ? MODEM_RX : MODEM_TX;
+      const int txPin = (c < nb) ? MODEM_TX : MODEM_RX;
+      if (r == GA_OK) {
+        modemUartBaud = bauds[c % nb];
+        modemUartRxPin = rxPin;
+        modemUartTxPin = txPin;
+        Serial.printf("[GSM] AT detected at %lu bps (RX=%d TX=%d)\n",
+                      (unsigned long)modemUartBaud, rxPin, txPin);
+        gsmEnter(GS_INIT);
+        return;
+      }
+      if (r != GA_PENDING) {
+        gsmLink.step++;
+        gsmLink.tries = 0;
+        return;
+      }
+      if (c >= 2 * nb) {
+        SerialAT.end();
+        modemSerialReady = false; // rouvert à la config par défaut au prochain essai
+        gsmFail("no AT response", "no_at");
+        return;
+      }
+      if (gsmLink.tries == 0) {
+        SerialAT.end();
+        SerialAT.begin(bauds[c % nb], SERIAL_8N1, rxPin, txPin);
+        gsmLink.tries = 1;
+        gsmLink.waitUntilMs = now + 80;
+        return;
+      }
+      gsmAtSend("AT", 800);
+      return;
     }
-  }
 
-  if (!modem.isNetworkConnected()) {
-    if (!modem.waitForNetwork(10000)) {
-      Serial.println("[GSM] network not ready");
-      gsmMarkDown();
-      gsmDebug1nce("network_wait_fail", true);
-      return false;
+    case GS_INIT: {
+      // Équivalent de modem.init() (SIM7600) découpé en commandes unitaires.
+      static const char* const seq[] = {"ATE0", "AT+CMEE=2", "AT+CTZR=0", "AT+CTZU=1", "AT+CGMM"};
+      const uint8_t n = sizeof(seq) / sizeof(seq[0]);
+      if (r == GA_PENDING) {
+        if (gsmLink.step == 0) Serial.println("[GSM] Initializing modem...");
+        gsmAtSend(seq[gsmLink.step], 2000);
+        return;
+      }
+      if (gsmLink.step == 0 && r != GA_OK) {
+        gsmFail("modem init failed", "modem_init_fail");
+        return;
+      }
+      if (gsmLink.step == n - 1) {
+        Serial.printf("[GSM] Modem Name: %s\n",
+                      (r == GA_OK && gsmLink.info[0]) ? gsmLink.info : "-");
+      }
+      if (++gsmLink.step < n) return;
+      modemPowerKickDone = false;
+      modemReady = true;
+      Serial.println("[GSM] modem ready");
+      gsmEnter(simPinChecked ? GS_REG : GS_SIM);
+      simPinChecked = true;
+      return;
     }
-  }
 
-  gsmNetworkReady = modem.isNetworkConnected();
-  if (!gsmNetworkReady) {
-    Serial.println("[GSM] network attach failed");
-    gsmDataReady = false;
-    gsmDebug1nce("network_attach_fail", true);
-    return false;
-  }
+    case GS_SIM:
+      // step=1: déverrouillage déjà tenté, ne pas reboucler sur un PIN refusé.
+      if (r == GA_PENDING) {
+        gsmAtSend("AT+CPIN?", 1000);
+        return;
+      }
+      Serial.printf("[GSM] SIM status=%s\n", gsmLink.info[0] ? gsmInfoValue() : "-");
+      if (r == GA_OK && strstr(gsmLink.info, "READY")) {
+        gsmEnter(GS_CCID);
+        return;
+      }
+      if (r == GA_OK && strstr(gsmLink.info, "SIM PIN") && strlen(SIM_PIN) > 0 && gsmLink.step == 0) {
+        gsmEnter(GS_SIM_PIN);
+        return;
+      }
+      if (++gsmLink.tries < 10) {
+        gsmLink.waitUntilMs = now + 1000;
+        return;
+      }
+      Serial.println("[GSM] SIM not ready");
+      gsmEnter(GS_CCID);
+      return;
 
-  String apn = gsmEffectiveApn();
-  String gprsUser = gsmEffectiveUser();
-  String gprsPass = gsmEffectivePass();
-  if (!modem.isGprsConnected()) {
-    if (!modem.gprsConnect(apn.c_str(), gprsUser.c_str(), gprsPass.c_str())) {
-      Serial.println("[GSM] gprs connect failed");
-      gsmDataReady = false;
-      gsmDebug1nce("gprs_fail", true);
-      return false;
-    }
-  }
+    case GS_SIM_PIN:
+      if (r == GA_PENDING) {
+        Serial.println("[GSM] Unlocking sim card...");
+        snprintf(gsmLink.cmd, sizeof(gsmLink.cmd), "AT+CPIN=\"%s\"", SIM_PIN);
+        gsmAtSend(gsmLink.cmd, 5000);
+        return;
+      }
+      if (r != GA_OK) {
+        gsmFail("SIM unlock failed", "sim_unlock_fail");
+        return;
+      }
+      gsmEnter(GS_SIM, 300);
+      gsmLink.step = 1;
+      return;
+
+    case GS_CCID:
+      if (r == GA_PENDING) {
+        gsmAtSend("AT+CICCID", 1000);
+        return;
+      }
+      gsmLastCcid = (r == GA_OK) ? String(gsmInfoValue()) : String("");
+      gsmLastCcid.trim();
+      Serial.printf("[GSM] SIM CCID=%s\n", gsmLastCcid.length() ? gsmLastCcid.c_str() : "-");
+      gsmEnter(GS_REG);
+      return;
+
+    case GS_REG:
+      // Alterne état d'enregistrement et niveau de signal, une commande par seconde.
+      if (r == GA_PENDING) {
+        gsmAtSend((gsmLink.step & 1) ? "AT+CSQ" : "AT+CGREG?", 1000);
+        return;
+      }
+      if (r == GA_TIMEOUT && ++gsmLink.tries >= 3) {
+        modemReady = false;
+        gsmFail("no AT response", "no_at");
+        return;
+      }
+      if (r == GA_OK && (gsmLink.step & 1)) {
+        gsmLastCsq = atoi(gsmInfoValue());
+        gsmLastDbm = gsmRssiToDbm(gsmLastCsq);
+      } else if (r == GA_OK) {
+        const char* comma = strchr(gsmLink.info, ',');
+        const int stat = comma ? atoi(comma + 1) : -1;
+        if (stat == 1 || stat == 5) {
+          gsmNetworkReady = true;
+          gsmLastNetConnected = true;
+          Serial.printf("[GSM] network registered (%s) after %lums\n",
+                        stat == 5 ? "roaming" : "home", (unsigned long)(now - gsmLink.stageMs));
+          gsmEnter(GS_PDP);
+          return;
+        }
+      }
+      if (now - gsmLink.stageMs >= GSM_REG_TIMEOUT_MS) {
+        gsmFail("network not ready", "network_wait_fail");
+        return;
+      }
+      gsmLink.step++;
+      gsmLink.waitUntilMs = now + 500;
+      return;
+
+    case GS_PDP:
+      // Équivalent de modem.gprsConnect() (SIM7600): contexte PDP puis pile TCP du modem.
+      if (r == GA_PENDING) {
+        switch (gsmLink.step) {
+          case 0: gsmAtSend("AT+NETCLOSE", 3000, "+NETCLOSE:"); return;
+          case 1:
+            snprintf(gsmLink.cmd, sizeof(gsmLink.cmd), "AT+CGDCONT=1,\"IP\",\"%s\"", gsmEffectiveApn().c_str());
+            gsmAtSend(gsmLink.cmd, 1000);
+            return;
+          case 2: {
+            const String user = gsmEffectiveUser();
+            if (user.length() == 0) {
+              gsmAtSend("AT+CGAUTH=1,0", 1000);
+            } else {
+              snprintf(gsmLink.cmd, sizeof(gsmLink.cmd), "AT+CGAUTH=1,1,\"%s\",\"%s\"",
+                       gsmEffectivePass().c_str(), user.c_str());
+              gsmAtSend(gsmLink.cmd, 1000);
+            }
+            return;
+          }
+          case 3: gsmAtSend("AT+CGACT=1,1", 60000); return;
+          case 4: gsmAtSend("AT+CIPMODE=0", 1000); return;
+          case 5: gsmAtSend("AT+CIPSENDMODE=0", 1000); return;
+          case 6: gsmAtSend("AT+CIPCCFG=10,0,0,0,1,0,75000", 1000); return;
+          case 7: gsmAtSend("AT+CIPTIMEOUT=75000,15000,15000", 1000); return;
+          default: gsmAtSend("AT+NETOPEN", 75000, "+NETOPEN:"); return;
+        }
+      }
+      if ((gsmLink.step == 1 || gsmLink.step == 3) && r != GA_OK) {
+        gsmFail("gprs connect failed", "gprs_fail");
+        return;
+      }
+      if (gsmLink.step >= 8) {
+        if (r != GA_OK || atoi(gsmInfoValue()) != 0) {
+          gsmFail("gprs connect failed", "gprs_fail");
+          return;
+        }
+        gsmEnter(GS_IP);
+        return;
+      }
+      gsmLink.step++;
+      return;
 
-  gsmDataReady = modem.isGprsConnected();
-  if (gsmDataReady) {
-    String ip = modemIpToString();
-    Serial.printf("[GSM] data connected ip=%s\n", ip.c_str());
-    gsmDebug1nce("connect_ok", true);
+    case GS_IP:
+      if (r == GA_PENDING) {
+        gsmAtSend("AT+IPADDR", 1000);
+        return;
+      }
+      if (r != GA_OK || strncmp(gsmLink.info, "+IPADDR:", 8) != 0) {
+        gsmFail("gprs connect failed", "gprs_fail");
+        return;
+      }
+      gsmLastIp = gsmInfoValue();
+      gsmDataReady = true;
+      gsmLastDataConnected = true;
+      Serial.printf("[GSM] data connected ip=%s\n", gsmLastIp.c_str());
+      gsmDebug1nce("connect_ok", true);
+      gsmEnter(GS_READY, GSM_HEALTH_MS);
+      return;
+
+    case GS_READY:
+      // Sockets MQTT actifs: l'UART passe par TinyGSM (URC de données). Une seule sonde
+      // courte par période, en rotation, pour rafraîchir le cache lu par gsmDebug1nce().
+      gsmLink.waitUntilMs = now + GSM_HEALTH_MS;
+      switch (gsmLink.step++ % 5) {
+        case 0: {
+          const int csq = modem.getSignalQuality();
+          gsmLastCsq = csq;
+          gsmLastDbm = gsmRssiToDbm(csq);
+          return;
+        }
+        case 1:
+          gsmLastNetConnected = modem.isNetworkConnected();
+          if (!gsmLastNetConnected) {
+            Serial.println("[GSM] network lost");
+            gsmMarkDown();
+            gsmEnter(GS_REG);
+          }
+          return;
+        case 2:
+          gsmLastDataConnected = modem.isGprsConnected();
+          if (!gsmLastDataConnected) {
+            Serial.println("[GSM] data link lost");
+            gsmDataReady = false;
+            gsmEnter(GS_PDP);
+            return;
+          }
+          gsmLastIp = modemIpToString();
+          return;
+        case 3: {
+          String op = modem.getOperator();
+          op.trim();
+          gsmLastOperator = op;
+          return;
+        }
+        default: {
+          // mois courant pour le budget data (horloge réseau, CTZU=1)
+          int y = 0, mo = 0, d = 0, hh = 0, mi = 0, ss = 0;
+          float tz = 0;
+          if (modem.getNetworkTime(&y, &mo, &d, &hh, &mi, &ss, &tz) && y >= 2024 && mo >= 1 && mo <= 12) {
+            gsmUsageSetMonth((uint32_t)(y * 100 + mo));
+          }
+          return;
+        }
+      }
+
+    case GS_BACKOFF:
+      gsmEnter(modemReady ? GS_REG : GS_UART);
+      return;
+
+    default:
+      gsmEnter(GS_UART);
+      return;
   }
-  return gsmDataReady;
 }
 
 static String mqttCurrentIpForTransport(const String& transport) {
   if (transport == "gsm") {
     if (!mqttTransportAllowsGsm()) return "";
     if (!modemSerialReady || !modemReady || !gsmDataReady) return "";
-    return modemIpToString();
+    return gsmLastIp;
   }
   return Ethernet.localIP().toString();
 }
@@ -1576,6 +2600,19 @@ static String mqttCurrentIp() {
   return mqttCurrentIpForTransport("ethernet");
 }
 
+static void mqttTrafficToJson(JsonObject o, const MqttTraffic& t) {
+  o["tx"] = t.tx;
+  o["rx"] = t.rx;
+  o["msg_tx"] = t.msgTx;
+  o["msg_rx"] = t.msgRx;
+  JsonObject fam = o["families"].to<JsonObject>();
+  for (uint8_t f = 0; f < MF_COUNT; f++) {
+    JsonArray a = fam[MQTT_FAMILY_NAMES[f]].to<JsonArray>();
+    a.add(t.famTx[f]);
+    a.add(t.famRx[f]);
+  }
+}
+
 static void mqttCfgToJson(String &out) {
   static JsonDocument doc;
   doc.clear();
@@ -1598,6 +2635,9 @@ static void mqttCfgToJson(String &out) {
   doc["apn"] = mqttCfg.apn;
   doc["gsm_user"] = mqttCfg.gsmUser;
   doc["gsm_pass"] = mqttCfg.gsmPass;
+  doc["state_bulk"] = mqttCfg.stateBulk ? 1 : 0;
+  doc["gsm_bulk_only"] = mqttCfg.gsmBulkOnly ? 1 : 0;
+  doc["gsm_budget_mb"] = mqttCfg.gsmBudgetMb;
   const bool ethConn = mqttEthConnectedSafe();
   const bool gsmConn = mqttGsmConnectedSafe();
   doc["connected"] = (ethConn || gsmConn) ? 1 : 0;
@@ -1614,31 +2654,35 @@ static void mqttCfgToJson(String &out) {
   doc["gsm_ip"] = mqttCurrentIpForTransport("gsm");
   doc["gsm_network"] = gsmNetworkReady ? 1 : 0;
   doc["gsm_data"] = gsmDataReady ? 1 : 0;
+  doc["gsm_stage"] = gsmStageName(gsmLink.stage);
+  doc["gsm_standby"] = (gsmConn && mqttGsmStandby()) ? 1 : 0;
+  JsonObject health = doc["eth_health"].to<JsonObject>();
+  health["link"] = mqttEthHealth.link ? 1 : 0;
+  health["rtt_ms"] = mqttEthHealth.rttMs;
+  health["rtt_max_ms"] = mqttEthHealth.rttMaxMs;
+  health["drops"] = mqttEthHealth.drops;
+  health["failovers"] = mqttEthHealth.failovers;
+  health["retry_ms"] = mqttEthRetryMs;
+  JsonObject traffic = doc["traffic"].to<JsonObject>();
+  mqttTrafficToJson(traffic["eth"].to<JsonObject>(), mqttTrafficEth);
+  mqttTrafficToJson(traffic["gsm"].to<JsonObject>(), mqttTrafficGsm);
+  JsonObject usage = doc["gsm_usage"].to<JsonObject>();
+  usage["month"] = gsmUsage.month;
+  usage["bytes"] = gsmUsage.bytes;
+  usage["budget_bytes"] = gsmBudgetBytes();
+  usage["level"] = gsmBudgetLevel();
   serializeJsonPretty(doc, out);
 }
 
-static bool saveMqttCfg() {
-  String out;
-  mqttCfgToJson(out);
-  return writeFile("/mqtt.json", out);
-}
-
-static bool loadMqttCfg() {
+// Ancien /mqtt.json (migration vers /config.bin)
+static void mqttCfgFromLegacyJson() {
   String s = readFile("/mqtt.json");
-  if (s.length() == 0) {
-    if (saveMqttCfg()) {
-      Serial.println("[MQTT] created default /mqtt.json");
-      return true;
-    }
-    Serial.println("[MQTT] failed to create default /mqtt.json");
-    return false;
-  }
-  static JsonDocument doc;
-  doc.clear();
+  if (s.length() == 0) return;
+  JsonDocument doc;
   auto err = deserializeJson(doc, s);
   if (err) {
     Serial.printf("[MQTT] JSON parse error -> keep default (%s)\n", err.c_str());
-    return false;
+    return;
   }
   mqttCfg.enabled = (doc["enabled"] | 0) ? true : false;
   mqttCfg.transport = normalizeMqttTransport(String((const char*)(doc["transport"] | "auto")));
@@ -1669,35 +2713,562 @@ static bool loadMqttCfg() {
   mqttCfg.apn = String((const char*)(doc["apn"] | GPRS_DEFAULT_APN));
   mqttCfg.gsmUser = String((const char*)(doc["gsm_user"] | GPRS_DEFAULT_USER));
   mqttCfg.gsmPass = String((const char*)(doc["gsm_pass"] | GPRS_DEFAULT_PASS));
+  mqttCfg.stateBulk = (doc["state_bulk"] | 1) ? true : false;
+  mqttCfg.gsmBulkOnly = (doc["gsm_bulk_only"] | 0) ? true : false;
+  mqttCfg.gsmBudgetMb = (uint16_t)(doc["gsm_budget_mb"] | 0);
+}
+
+// ===============================================================
+// Config store (LittleFS /config.bin)
+// ===============================================================
+// Wi-Fi, BLE, auth, réseau et MQTT dans un seul blob binaire versionné, lu d'un
+// bloc au boot sans JsonDocument. Enregistrements TLV (tag u8, longueur u16 LE,
+// valeur): un tag inconnu est ignoré, un tag absent garde la valeur par défaut.
+// Le JSON ne sert plus qu'aux API et à /api/backup.
+static const char* CFG_STORE_PATH = "/config.bin";
+static const uint32_t CFG_STORE_MAGIC = 0x31435245; // "ERC1"
+static const uint16_t CFG_STORE_SCHEMA = 1;
+static const size_t CFG_STORE_HDR = 6;
+
+// Valeurs figées: ne jamais renuméroter, seulement ajouter.
+enum CfgTag : uint8_t {
+  CT_WIFI_ENABLED = 0x10, CT_WIFI_SSID, CT_WIFI_PASS,
+  CT_BLE_ENABLED = 0x18,
+  CT_AUTH_USER = 0x20, CT_AUTH_PASS,
+  CT_NET_DHCP = 0x28, CT_NET_IP, CT_NET_GW, CT_NET_SN, CT_NET_DNS,
+  CT_TEMP_SENSOR = 0x2E, // répété: adresse[8], résolution, intervalle_s u16
+  CT_MQTT_ENABLED = 0x30, CT_MQTT_TRANSPORT, CT_MQTT_HOST, CT_MQTT_PORT, CT_MQTT_USER, CT_MQTT_PASS,
+  CT_MQTT_GSM_HOST, CT_MQTT_GSM_PORT, CT_MQTT_GSM_USER, CT_MQTT_GSM_PASS,
+  CT_MQTT_CLIENT_ID, CT_MQTT_BASE, CT_MQTT_DISC_PREFIX, CT_MQTT_RETAIN,
+  CT_GSM_APN, CT_GSM_USER, CT_GSM_PASS,
+  CT_MQTT_STATE_BULK, CT_MQTT_GSM_BULK_ONLY, CT_MQTT_GSM_BUDGET_MB
+};
+
+// buf == nullptr: simple mesure de la taille
+struct CfgBlobWriter {
+  uint8_t* buf;
+  size_t len;
+
+  void put(uint8_t tag, const void* v, size_t n) {
+    if (buf) {
+      buf[len] = tag;
+      buf[len + 1] = (uint8_t)n;
+      buf[len + 2] = (uint8_t)(n >> 8);
+      if (n) memcpy(buf + len + 3, v, n);
+    }
+    len += 3 + n;
+  }
+  void u8(uint8_t tag, uint8_t v) { put(tag, &v, 1); }
+  void u16(uint8_t tag, uint16_t v) {
+    const uint8_t b[2] = {(uint8_t)v, (uint8_t)(v >> 8)};
+    put(tag, b, 2);
+  }
+  void str(uint8_t tag, const String& v) { put(tag, v.c_str(), v.length()); }
+  void ip(uint8_t tag, const IPAddress& a) {
+    const uint8_t b[4] = {a[0], a[1], a[2], a[3]};
+    put(tag, b, 4);
+  }
+};
+
+static void cfgStoreEncode(CfgBlobWriter& w) {
+  if (w.buf) {
+    memcpy(w.buf, &CFG_STORE_MAGIC, 4);
+    w.buf[4] = (uint8_t)CFG_STORE_SCHEMA;
+    w.buf[5] = (uint8_t)(CFG_STORE_SCHEMA >> 8);
+  }
+  w.len = CFG_STORE_HDR;
+  w.u8(CT_WIFI_ENABLED, wifiCfg.enabled);
+  w.str(CT_WIFI_SSID, wifiCfg.ssid);
+  w.str(CT_WIFI_PASS, wifiCfg.pass);
+  w.u8(CT_BLE_ENABLED, bleEnabled);
+  w.str(CT_AUTH_USER, authCfg.user);
+  w.str(CT_AUTH_PASS, authCfg.pass);
+  w.u8(CT_NET_DHCP, netCfg.dhcp);
+  w.ip(CT_NET_IP, netCfg.ip);
+  w.ip(CT_NET_GW, netCfg.gw);
+  w.ip(CT_NET_SN, netCfg.sn);
+  w.ip(CT_NET_DNS, netCfg.dns);
+  w.u8(CT_MQTT_ENABLED, mqttCfg.enabled);
+  w.str(CT_MQTT_TRANSPORT, mqttCfg.transport);
+  w.str(CT_MQTT_HOST, mqttCfg.host);
+  w.u16(CT_MQTT_PORT, mqttCfg.port);
+  w.str(CT_MQTT_USER, mqttCfg.user);
+  w.str(CT_MQTT_PASS, mqttCfg.pass);
+  w.str(CT_MQTT_GSM_HOST, mqttCfg.gsmMqttHost);
+  w.u16(CT_MQTT_GSM_PORT, mqttCfg.gsmMqttPort);
+  w.str(CT_MQTT_GSM_USER, mqttCfg.gsmMqttUser);
+  w.str(CT_MQTT_GSM_PASS, mqttCfg.gsmMqttPass);
+  w.str(CT_MQTT_CLIENT_ID, mqttCfg.clientId);
+  w.str(CT_MQTT_BASE, mqttCfg.base);
+  w.str(CT_MQTT_DISC_PREFIX, mqttCfg.discoveryPrefix);
+  w.u8(CT_MQTT_RETAIN, mqttCfg.retain);
+  w.str(CT_GSM_APN, mqttCfg.apn);
+  w.str(CT_GSM_USER, mqttCfg.gsmUser);
+  w.str(CT_GSM_PASS, mqttCfg.gsmPass);
+  w.u8(CT_MQTT_STATE_BULK, mqttCfg.stateBulk);
+  w.u8(CT_MQTT_GSM_BULK_ONLY, mqttCfg.gsmBulkOnly);
+  w.u16(CT_MQTT_GSM_BUDGET_MB, mqttCfg.gsmBudgetMb);
+  for (uint8_t i = 0; i < tempCfgCount; i++) {
+    uint8_t rec[11];
+    memcpy(rec, tempCfg[i].addr, 8);
+    rec[8] = tempCfg[i].res;
+    rec[9] = (uint8_t)tempCfg[i].intervalS;
+    rec[10] = (uint8_t)(tempCfg[i].intervalS >> 8);
+    w.put(CT_TEMP_SENSOR, rec, sizeof(rec));
+  }
+}
+
+static bool cfgStoreDecode(const uint8_t* p, size_t n) {
+  uint32_t magic = 0;
+  if (n < CFG_STORE_HDR) return false;
+  memcpy(&magic, p, 4);
+  if (magic != CFG_STORE_MAGIC) return false;
+  const uint16_t schema = (uint16_t)(p[4] | (p[5] << 8));
+  if (schema > CFG_STORE_SCHEMA) {
+    Serial.printf("[CFG] schema %u newer than %u -> unknown fields ignored\n", schema, CFG_STORE_SCHEMA);
+  }
+  size_t off = CFG_STORE_HDR;
+  while (off + 3 <= n) {
+    const uint8_t tag = p[off];
+    const size_t len = (size_t)(p[off + 1] | (p[off + 2] << 8));
+    off += 3;
+    if (off + len > n) return false;
+    const uint8_t* v = p + off;
+    off += len;
+    String sv;
+    if (tag != CT_NET_IP && tag != CT_NET_GW && tag != CT_NET_SN && tag != CT_NET_DNS && tag != CT_TEMP_SENSOR) {
+      sv.concat((const char*)v, len);
+    }
+    const bool bv = len >= 1 && v[0] != 0;
+    const uint16_t wv = (len >= 2) ? (uint16_t)(v[0] | (v[1] << 8)) : 0;
+    const IPAddress av = (len == 4) ? IPAddress(v[0], v[1], v[2], v[3]) : IPAddress();
+    switch (tag) {
+      case CT_WIFI_ENABLED: wifiCfg.enabled = bv; break;
+      case CT_WIFI_SSID: wifiCfg.ssid = sv; break;
+      case CT_WIFI_PASS: wifiCfg.pass = sv; break;
+      case CT_BLE_ENABLED: bleEnabled = bv; break;
+      case CT_AUTH_USER: authCfg.user = sv; break;
+      case CT_AUTH_PASS: authCfg.pass = sv; break;
+      case CT_NET_DHCP: netCfg.dhcp = bv; break;
+      case CT_NET_IP: if (len == 4) netCfg.ip = av; break;
+      case CT_NET_GW: if (len == 4) netCfg.gw = av; break;
+      case CT_NET_SN: if (len == 4) netCfg.sn = av; break;
+      case CT_NET_DNS: if (len == 4) netCfg.dns = av; break;
+      case CT_MQTT_ENABLED: mqttCfg.enabled = bv; break;
+      case CT_MQTT_TRANSPORT: mqttCfg.transport = sv; break;
+      case CT_MQTT_HOST: mqttCfg.host = sv; break;
+      case CT_MQTT_PORT: mqttCfg.port = wv; break;
+      case CT_MQTT_USER: mqttCfg.user = sv; break;
+      case CT_MQTT_PASS: mqttCfg.pass = sv; break;
+      case CT_MQTT_GSM_HOST: mqttCfg.gsmMqttHost = sv; break;
+      case CT_MQTT_GSM_PORT: mqttCfg.gsmMqttPort = wv; break;
+      case CT_MQTT_GSM_USER: mqttCfg.gsmMqttUser = sv; break;
+      case CT_MQTT_GSM_PASS: mqttCfg.gsmMqttPass = sv; break;
+      case CT_MQTT_CLIENT_ID: mqttCfg.clientId = sv; break;
+      case CT_MQTT_BASE: mqttCfg.base = sv; break;
+      case CT_MQTT_DISC_PREFIX: mqttCfg.discoveryPrefix = sv; break;
+      case CT_MQTT_RETAIN: mqttCfg.retain = bv; break;
+      case CT_GSM_APN: mqttCfg.apn = sv; break;
+      case CT_GSM_USER: mqttCfg.gsmUser = sv; break;
+      case CT_GSM_PASS: mqttCfg.gsmPass = sv; break;
+      case CT_MQTT_STATE_BULK: mqttCfg.stateBulk = bv; break;
+      case CT_MQTT_GSM_BULK_ONLY: mqttCfg.gsmBulkOnly = bv; break;
+      case CT_MQTT_GSM_BUDGET_MB: mqttCfg.gsmBudgetMb = wv; break;
+      case CT_TEMP_SENSOR:
+        if (len == 11 && tempCfgCount < TEMP_MAX_SENSORS) {
+          TempSensorCfg& t = tempCfg[tempCfgCount++];
+          memcpy(t.addr, v, 8);
+          t.res = v[8];
+          t.intervalS = (uint16_t)(v[9] | (v[10] << 8));
+        }
+        break;
+      default: break;
+    }
+  }
+  return off == n;
+}
+
+// Règles communes au blob et à la migration JSON
+static void cfgStoreNormalize() {
+  if (wifiCfg.ssid.length() == 0) wifiCfg.ssid = defaultWifiSsid();
+  if (wifiCfg.pass.length() < 8) wifiCfg.pass = String(WIFI_DEFAULT_PASS);
+  mqttCfg.transport = normalizeMqttTransport(mqttCfg.transport);
+  mqttCfg.base = normalizeBaseTopic(mqttCfg.base);
   mqttCfg.host.trim();
   mqttCfg.gsmMqttHost.trim();
   mqttCfg.apn.trim();
   if (mqttCfg.gsmMqttHost.length() > 0 && mqttCfg.gsmMqttPort == 0) {
     mqttCfg.gsmMqttPort = 1883;
   }
+}
+
+static bool saveConfigStore() {
+  CfgBlobWriter w = {nullptr, 0};
+  cfgStoreEncode(w);
+  const size_t n = w.len;
+  w.buf = (uint8_t*)malloc(n);
+  if (!w.buf) return false;
+  cfgStoreEncode(w);
+  const bool ok = writeFileBin(CFG_STORE_PATH, w.buf, n);
+  free(w.buf);
+  return ok;
+}
+
+static void loadConfigStore() {
+  size_t n = 0;
+  uint8_t* bin = readFileBin(CFG_STORE_PATH, n);
+  const bool ok = bin && cfgStoreDecode(bin, n);
+  free(bin);
+  if (!ok) {
+    // premier boot après mise à jour (ou blob illisible): reprise des anciens JSON
+    wifiCfgFromLegacyJson();
+    bleCfgFromLegacyJson();
+    authCfgFromLegacyJson();
+    netCfgFromLegacyJson();
+    mqttCfgFromLegacyJson();
+  }
+  cfgStoreNormalize();
+  if (ok) {
+    Serial.printf("[CFG] loaded %s (%u bytes)\n", CFG_STORE_PATH, (unsigned)n);
+    return;
+  }
+  if (!saveConfigStore()) {
+    Serial.printf("[CFG] failed to write %s\n", CFG_STORE_PATH);
+    return;
+  }
+  const char* legacy[] = {"/wifi.json", "/ble.json", "/auth.json", "/net.json", "/mqtt.json"};
+  for (size_t i = 0; i < sizeof(legacy) / sizeof(legacy[0]); i++) {
+    if (LittleFS.exists(legacy[i])) LittleFS.remove(legacy[i]);
+  }
+  Serial.printf("[CFG] created %s\n", CFG_STORE_PATH);
+}
+
+// ================== MQTT: file d'émission ==================
+// Une file bornée par transport: une seule entrée par topic (la dernière valeur
+// gagne), vidée par priorité puis ancienneté, au rythme d'un seau à jetons.
+// Les publications ne bloquent plus la boucle et l'état final est envoyé dès
+// que le lien revient.
+enum MqttPrio : uint8_t { MP_ACK = 0, MP_STATE = 1, MP_TELEMETRY = 2, MP_DISCOVERY = 3 };
+
+static const uint16_t MQTT_OUTBOX_ETH_SLOTS = 256; // ~105 topics d'état (16 relais) + ~100 discovery
+static const uint16_t MQTT_OUTBOX_GSM_SLOTS = 128; // pas de discovery sur GSM
+static const uint8_t MQTT_OUTBOX_DRAIN_MAX = 8;     // publications max par passage de boucle
+
+struct MqttOutSlot {
+  String topic;       // vide = libre
+  String payload;
+  uint32_t seq = 0;   // ordre d'arrivée (conservé si la valeur est remplacée)
+  MqttPrio prio = MP_STATE;
+  bool retain = false;
+};
+
+struct MqttOutbox {
+  MqttOutSlot* slots;
+  uint16_t cap;
+  uint16_t count = 0;
+  uint32_t seq = 0;
+  uint32_t drops = 0;
+  // seau à jetons
+  float tokens = 0;
+  float ratePerS;
+  float burst;
+  uint32_t lastRefillMs = 0;
+};
+
+static MqttOutSlot mqttOutEthSlots[MQTT_OUTBOX_ETH_SLOTS];
+static MqttOutSlot mqttOutGsmSlots[MQTT_OUTBOX_GSM_SLOTS];
+static MqttOutbox mqttOutEth;
+static MqttOutbox mqttOutGsm;
+
+static void mqttOutboxInit() {
+  mqttOutEth.slots = mqttOutEthSlots; mqttOutEth.cap = MQTT_OUTBOX_ETH_SLOTS;
+  mqttOutGsm.slots = mqttOutGsmSlots; mqttOutGsm.cap = MQTT_OUTBOX_GSM_SLOTS;
+  mqttOutEth.ratePerS = 50.0f; mqttOutEth.burst = 20.0f;
+  mqttOutGsm.ratePerS = 4.0f;  mqttOutGsm.burst = 8.0f;
+  mqttOutEth.tokens = mqttOutEth.burst;
+  mqttOutGsm.tokens = mqttOutGsm.burst;
+}
+
+// Rend aussi la mémoire: sinon chaque slot garde sa capacité maximale (rafale de
+// discovery) et la file occupe des dizaines de Ko même vide.
+static void mqttOutSlotFree(MqttOutSlot& sl) {
+  sl.topic = String();
+  sl.payload = String();
+}
+
+static void mqttOutboxClear(MqttOutbox& ob) {
+  for (uint16_t i = 0; i < ob.cap; i++) {
+    MqttOutSlot& sl = ob.slots[i];
+    if (sl.topic.length() && sl.prio == MP_DISCOVERY) mqttDiscEvictions++;
+    mqttOutSlotFree(sl);
+  }
+  ob.count = 0;
+}
+
+static bool mqttOutboxHolds(const MqttOutbox& ob, MqttPrio prio) {
+  for (uint16_t i = 0; i < ob.cap; i++) {
+    if (ob.slots[i].topic.length() && ob.slots[i].prio == prio) return true;
+  }
+  return false;
+}
+
+// false si rejeté (file pleine de messages plus prioritaires)
+static bool mqttOutboxPut(MqttOutbox& ob, const char* topic, const char* payload, bool retain, MqttPrio prio) {
+  int freeIdx = -1;
+  int victim = -1;
+  for (uint16_t i = 0; i < ob.cap; i++) {
+    MqttOutSlot& sl = ob.slots[i];
+    if (sl.topic.length() == 0) {
+      if (freeIdx < 0) freeIdx = i;
+      continue;
+    }
+    if (prio != MP_ACK && strcmp(sl.topic.c_str(), topic) == 0) { // chaque acquittement compte
+      sl.payload = payload;
+      sl.retain = retain;
+      if (prio < sl.prio) sl.prio = prio;
+      return true;
+    }
+    if (sl.prio > prio && (victim < 0 || sl.prio > ob.slots[victim].prio ||
+        (sl.prio == ob.slots[victim].prio && sl.seq > ob.slots[victim].seq))) {
+      victim = i;
+    }
+  }
+  if (freeIdx < 0) {
+    ob.drops++;
+    if (victim < 0) {
+      if (prio == MP_DISCOVERY) mqttDiscEvictions++; // rejetée: discovery à refaire
+      return false;
+    }
+    if (ob.slots[victim].prio == MP_DISCOVERY) mqttDiscEvictions++; // sera republié
+    freeIdx = victim;
+    ob.count--;
+  }
+  MqttOutSlot& sl = ob.slots[freeIdx];
+  sl.topic = topic;
+  sl.payload = payload;
+  sl.retain = retain;
+  sl.prio = prio;
+  sl.seq = ob.seq++;
+  ob.count++;
   return true;
 }
 
-static void mqttPublishToClient(PubSubClient &client, const String& topic, const String& payload, bool retain) {
-  if (&client == &mqttClientGsm) {
-    if (!mqttGsmConnectedSafe()) return;
-  } else {
-    if (!mqttEthConnectedSafe()) return;
+static uint8_t mqttTopicFamily(const char* topic);
+static uint32_t fnv1a(uint32_t h, const char* p, size_t n);
+static const char* mqttStatusTopic();
+
+// ================== MQTT: dernier état publié par broker ==================
+// Empreinte (topic -> payload) de ce que chaque broker a reçu en retenu pendant la
+// session en cours. Une republication identique est écartée: lors de la bascule
+// veille -> actif du GSM (session GSM restée ouverte), seul le delta part. Si le GSM
+// vise le même broker que l'Ethernet, la vue est partagée. Toute nouvelle session
+// (clean session, broker peut-être redémarré sans persistance) repart d'une vue vide.
+static const uint16_t MQTT_VIEW_SLOTS = 256;        // > nb de topics d'état (~170 à 16 relais)
+
+struct MqttView {
+  uint32_t topic[MQTT_VIEW_SLOTS];   // empreinte du topic, 0 = libre
+  uint32_t value[MQTT_VIEW_SLOTS];
+  uint32_t setMs[MQTT_VIEW_SLOTS];   // écriture dans le socket, 0 = valeur inconnue
+  uint16_t count;
+  uint32_t ackedMs;                  // écrit avant cet instant = reçu (PINGRESP qui suit)
+};
+static MqttView mqttViewEth = {};
+static MqttView mqttViewGsm = {};
+
+static MqttView& mqttViewFor(const PubSubClient& client) {
+  if (&client == &mqttClientEth) return mqttViewEth;
+  const bool sameBroker = strcmp(mqttHostForTransport("gsm"), mqttCfg.host.c_str()) == 0 &&
+                          mqttPortForTransport("gsm") == mqttCfg.port;
+  return sameBroker ? mqttViewEth : mqttViewGsm;
+}
+
+static void mqttViewClear(MqttView& v) {
+  memset(v.topic, 0, sizeof(v.topic));
+  v.count = 0;
+  v.ackedMs = millis();
+}
+
+static int mqttViewFind(const MqttView& v, uint32_t th) {
+  for (uint16_t i = 0, k = th % MQTT_VIEW_SLOTS; i < MQTT_VIEW_SLOTS; i++, k = (k + 1) % MQTT_VIEW_SLOTS) {
+    if (v.topic[k] == th || v.topic[k] == 0) return k;
+  }
+  return -1;
+}
+
+static uint32_t mqttViewTopicHash(const char* topic) {
+  const uint32_t h = fnv1a(2166136261u, topic, strlen(topic));
+  return h ? h : 1;
+}
+
+static bool mqttViewHas(const MqttView& v, const char* topic, const char* payload) {
+  const int k = mqttViewFind(v, mqttViewTopicHash(topic));
+  return k >= 0 && v.topic[k] != 0 && v.setMs[k] != 0 && v.value[k] == fnv1a(2166136261u, payload, strlen(payload));
+}
+
+static void mqttViewSet(MqttView& v, const char* topic, const char* payload) {
+  const uint32_t th = mqttViewTopicHash(topic);
+  const int k = mqttViewFind(v, th);
+  if (k < 0) return; // table pleine: republié à chaque fois, sans erreur
+  if (v.topic[k] == 0) {
+    if (v.count >= MQTT_VIEW_SLOTS - 1) return; // garde une case libre pour arrêter les sondes
+    v.topic[k] = th;
+    v.count++;
+  }
+  v.value[k] = fnv1a(2166136261u, payload, strlen(payload));
+  v.setMs[k] = millis() | 1u;
+}
+
+// Session perdue: ce qui était encore dans le tampon TCP (W5500) n'a peut-être jamais
+// atteint le broker. Les valeurs écrites après le dernier PINGRESP redeviennent inconnues.
+static void mqttViewForgetUnacked(MqttView& v) {
+  for (uint16_t k = 0; k < MQTT_VIEW_SLOTS; k++) {
+    if (v.topic[k] != 0 && v.setMs[k] != 0 && (int32_t)(v.setMs[k] - v.ackedMs) >= 0) v.setMs[k] = 0;
+  }
+}
+
+// Appelé à chaque nouvelle session: rien n'est supposé sur le broker. Seule exception,
+// le GSM qui partage la vue d'une session Ethernet encore ouverte (même broker, pas
+// redémarré): sa connexion en veille ne doit pas effacer ce que l'Ethernet a publié.
+static void mqttViewOnConnect(const PubSubClient& client) {
+  MqttView& v = mqttViewFor(client);
+  if (&client == &mqttClientGsm && &v == &mqttViewEth && mqttClientEth.connected()) return;
+  mqttViewClear(v);
+}
+
+// ================== MQTT: santé du lien Ethernet ==================
+// PHY W5500 lu toutes les 250 ms, et PINGREQ brut dès 1 s sans rien recevoir: la
+// réponse (PINGRESP, lue par PubSubClient) est vue par le client compteur. Sans
+// réponse en 3 s, ou lien PHY tombé, la session est fermée: le GSM prend le relais.
+static const uint32_t MQTT_LINK_POLL_MS = 250;
+static const uint32_t MQTT_ETH_PROBE_IDLE_MS = 1000;
+static const uint32_t MQTT_ETH_PROBE_DEAD_MS = 3000;
+
+static void mqttEthDrop(const char* reason) {
+  Serial.printf("[MQTT][ETH] session lost (%s)\n", reason);
+  mqttEth.stop();
+  mqttEthHealth.pingSentMs = 0;
+  mqttEthHealth.drops++;
+  mqttLastEthFailMs = millis();
+}
+
+static void mqttEthProbe() {
+  MqttLinkHealth& h = mqttEthHealth;
+  const uint32_t now = millis();
+  if (now - h.linkPollMs >= MQTT_LINK_POLL_MS) {
+    h.linkPollMs = now;
+    const bool link = Ethernet.linkStatus() == LinkON;
+    if (link != h.link) {
+      Serial.printf("[MQTT][ETH] link %s\n", link ? "up" : "down");
+      h.link = link;
+      if (link) {
+        mqttLastEthFailMs = 0; // reconnexion immédiate
+        mqttLastConnectEthMs = 0;
+        mqttEthRetryMs = MQTT_ETH_RETRY_MIN_MS;
+      }
+    }
+  }
+  if (!mqttClientEth.connected()) {
+    h.pingSentMs = 0;
+    return;
+  }
+  if (!h.link) {
+    mqttEthDrop("link down");
+    return;
+  }
+  if (h.pingSentMs != 0) {
+    if ((int32_t)(mqttTrafficEth.lastRxMs - h.pingSentMs) >= 0) {
+      mqttViewEth.ackedMs = h.pingSentMs; // TCP ordonné: tout ce qui précède le PINGREQ est reçu
+      h.rttMs = mqttTrafficEth.lastRxMs - h.pingSentMs;
+      if (h.rttMs > h.rttMaxMs) h.rttMaxMs = h.rttMs;
+      h.pingSentMs = 0;
+    } else if (now - h.pingSentMs >= MQTT_ETH_PROBE_DEAD_MS) {
+      mqttEthDrop("no PINGRESP");
+    }
+    return;
+  }
+  if (now - mqttTrafficEth.lastRxMs >= MQTT_ETH_PROBE_IDLE_MS) {
+    static const uint8_t pingreq[2] = {0xC0, 0x00};
+    if (mqttEthCounted.write(pingreq, sizeof(pingreq)) == sizeof(pingreq)) h.pingSentMs = now;
+    else mqttEthDrop("write failed");
   }
-  client.publish(topic.c_str(), payload.c_str(), retain);
 }
 
-static void mqttPublishToTransport(const String& transport, const String& topic, const String& payload, bool retain) {
-  mqttPublishToClient(*mqttClientForTransport(transport), topic, payload, retain);
+static void mqttOutboxDropTopic(MqttOutbox& ob, const char* topic) {
+  for (uint16_t i = 0; i < ob.cap; i++) {
+    MqttOutSlot& sl = ob.slots[i];
+    if (sl.topic.length() == 0 || sl.prio == MP_ACK || strcmp(sl.topic.c_str(), topic) != 0) continue;
+    mqttOutSlotFree(sl);
+    ob.count--;
+    return;
+  }
 }
 
-static void mqttPublish(const String& topic, const String& payload, bool retain) {
-  mqttPublishToClient(mqttClientEth, topic, payload, retain);
-  mqttPublishToClient(mqttClientGsm, topic, payload, retain);
+// Taille d'un paquet PUBLISH (en-tête fixe + longueur variable + topic + payload)
+static uint32_t mqttPublishLen(size_t topicLen, size_t payloadLen, uint8_t qos) {
+  const uint32_t rem = 2 + (uint32_t)topicLen + (uint32_t)payloadLen + (qos ? 2 : 0);
+  return 1 + (rem < 128 ? 1 : (rem < 16384 ? 2 : 3)) + rem;
 }
 
-static void mqttPublishEthernetOnly(const String& topic, const String& payload, bool retain) {
-  mqttPublishToClient(mqttClientEth, topic, payload, retain);
+static void mqttOutboxDrain(MqttOutbox& ob, PubSubClient& client, bool connected) {
+  MqttTraffic& tr = (&client == &mqttClientGsm) ? mqttTrafficGsm : mqttTrafficEth;
+  const uint32_t now = millis();
+  ob.tokens = min(ob.burst, ob.tokens + (float)(now - ob.lastRefillMs) * ob.ratePerS / 1000.0f);
+  ob.lastRefillMs = now;
+  if (!connected) return;
+  for (uint8_t n = 0; n < MQTT_OUTBOX_DRAIN_MAX && ob.count > 0 && ob.tokens >= 1.0f; n++) {
+    int best = -1;
+    for (uint16_t i = 0; i < ob.cap; i++) {
+      const MqttOutSlot& sl = ob.slots[i];
+      if (sl.topic.length() == 0) continue;
+      if (best < 0 || sl.prio < ob.slots[best].prio ||
+          (sl.prio == ob.slots[best].prio && sl.seq < ob.slots[best].seq)) {
+        best = i;
+      }
+    }
+    if (best < 0) break;
+    MqttOutSlot& sl = ob.slots[best];
+    if (!client.publish(sl.topic.c_str(), sl.payload.c_str(), sl.retain)) break; // réessayé au prochain passage
+    ob.tokens -= 1.0f;
+    tr.famTx[mqttTopicFamily(sl.topic.c_str())] += mqttPublishLen(sl.topic.length(), sl.payload.length(), 0);
+    tr.msgTx++;
+    if (sl.retain && sl.prio != MP_ACK) mqttViewSet(mqttViewFor(client), sl.topic.c_str(), sl.payload.c_str());
+    mqttOutSlotFree(sl);
+    ob.count--;
+  }
+}
+
+static void mqttPublishToClient(PubSubClient &client, const char* topic, const char* payload, bool retain, MqttPrio prio = MP_STATE) {
+  if (!topic[0]) return;
+  const bool gsm = (&client == &mqttClientGsm);
+  if (gsm ? !mqttTransportAllowsGsm() : !mqttTransportAllowsEthernet()) return;
+  MqttOutbox& ob = gsm ? mqttOutGsm : mqttOutEth;
+  // le statut est exclu: le broker le passe lui-même à offline (LWT)
+  const bool status = strcmp(topic, mqttStatusTopic()) == 0;
+  if (gsm && prio != MP_ACK && !status && mqttGsmStandby()) return;
+  if (retain && prio != MP_ACK && !status && mqttViewHas(mqttViewFor(client), topic, payload)) {
+    mqttOutboxDropTopic(ob, topic); // une valeur intermédiaire en file ne doit pas passer après
+    return;
+  }
+  mqttOutboxPut(ob, topic, payload, retain, prio);
+}
+
+static void mqttPublishToTransport(const String& transport, const char* topic, const char* payload, bool retain, MqttPrio prio = MP_STATE) {
+  mqttPublishToClient(*mqttClientForTransport(transport), topic, payload, retain, prio);
+}
+
+// Topics par entité sur GSM: non en mode gsm_bulk_only ou budget data consommé à 75 %
+static bool mqttGsmEntityTopics() {
+  return !mqttCfg.gsmBulkOnly && gsmBudgetLevel() < 2;
+}
+
+// États par entité: Ethernet toujours, GSM selon mqttGsmEntityTopics()
+static void mqttPublishEntity(const char* topic, const char* payload, bool retain, MqttPrio prio = MP_STATE) {
+  mqttPublishToClient(mqttClientEth, topic, payload, retain, prio);
+  if (mqttGsmEntityTopics()) mqttPublishToClient(mqttClientGsm, topic, payload, retain, prio);
+}
+
+static void mqttPublishEthernetOnly(const char* topic, const char* payload, bool retain, MqttPrio prio = MP_STATE) {
+  mqttPublishToClient(mqttClientEth, topic, payload, retain, prio);
 }
 
 static const char* relayModeText(int8_t mode) {
@@ -1750,6 +3321,157 @@ static String mqttNodeId() {
   return mqttDeviceId();
 }
 
+// ================== MQTT: table des topics ==================
+// Tous les topics par canal sont rendus une seule fois dans une arène contiguë,
+// reconstruite quand la base ou le nombre de modules/sondes change.
+static const size_t MQTT_TOPIC_SUFFIX_MAX = 24; // plus long suffixe: "/shutter/NN/state"
+
+struct MqttTopics {
+  char* arena = nullptr;
+  size_t cap = 0;
+  size_t used = 0;
+  // clé de construction
+  bool built = false;
+  String keyBase;
+  uint8_t keyInputs = 0;
+  uint8_t keyRelays = 0;
+  uint8_t keyTemps = 0;
+
+  const char* base = "";
+  uint16_t baseLen = 0;
+  const char* status = "";
+  const char* state = "";
+  const char* ack = "";
+  const char* traffic = "";
+  const char* diag = "";
+  const char* netIp = "";
+  const char* gsmIccid = "";
+  const char* wifiApState = "";
+  const char* wifiApSet = "";
+  const char* bleState = "";
+  const char* bleSet = "";
+  const char* dhtTemp = "";
+  const char* dhtHum = "";
+  const char* inputState[MAX_INPUTS];
+  const char* vinState[MAX_INPUTS];
+  const char* vinSet[MAX_INPUTS];
+  const char* relayState[MAX_RELAYS];
+  const char* relayMode[MAX_RELAYS];
+  const char* relaySet[MAX_RELAYS];
+  const char* relayAuto[MAX_RELAYS];
+  const char* rule[MAX_RELAYS];
+  const char* shutterState[SHUTTER_MAX];
+  const char* shutterSet[SHUTTER_MAX];
+  const char* tempState[TEMP_MAX_SENSORS];
+};
+
+static MqttTopics mqttTopics;
+
+static const char* mqttTopicPut(const char* fmt, int n) {
+  MqttTopics& t = mqttTopics;
+  char* dst = t.arena + t.used;
+  int len = snprintf(dst, t.cap - t.used, fmt, t.base, n);
+  if (len < 0 || (size_t)len >= t.cap - t.used) len = (int)(t.cap - t.used) - 1;
+  t.used += (size_t)len + 1;
+  return dst;
+}
+
+static void mqttTopicsBuild() {
+  MqttTopics& t = mqttTopics;
+  const String base = mqttBaseTopic();
+  const int shutters = shuttersLimit();
+  const size_t entries = 13 + (size_t)totalInputs * 3 + (size_t)totalRelays * 5 + (size_t)shutters * 2 + tempCount;
+  const size_t need = base.length() + 1 + entries * (base.length() + MQTT_TOPIC_SUFFIX_MAX + 1);
+  if (need > t.cap) {
+    char* a = (char*)realloc(t.arena, need);
+    if (!a) {
+      // pas de pointeur pendant: les canaux non construits restent des topics vides (ignorés)
+      for (int i = t.keyInputs; i < MAX_INPUTS; i++) t.inputState[i] = t.vinState[i] = t.vinSet[i] = "";
+      for (int i = t.keyRelays; i < MAX_RELAYS; i++) t.relayState[i] = t.relayMode[i] = t.relaySet[i] = t.relayAuto[i] = t.rule[i] = "";
+      for (int s = t.keyRelays / 2; s < SHUTTER_MAX; s++) t.shutterState[s] = t.shutterSet[s] = "";
+      for (int i = t.keyTemps; i < TEMP_MAX_SENSORS; i++) t.tempState[i] = "";
+      Serial.println("[MQTT] topic table alloc failed");
+      return;
+    }
+    t.arena = a;
+    t.cap = need;
+  }
+  t.used = 0;
+  memcpy(t.arena, base.c_str(), base.length() + 1);
+  t.base = t.arena;
+  t.baseLen = (uint16_t)base.length();
+  t.used = base.length() + 1;
+
+  t.status = mqttTopicPut("%s/status", 0);
+  t.state = mqttTopicPut("%s/state", 0);
+  t.ack = mqttTopicPut("%s/ack", 0);
+  t.traffic = mqttTopicPut("%s/traffic", 0);
+  t.diag = mqttTopicPut("%s/diag", 0);
+  t.netIp = mqttTopicPut("%s/net/ip", 0);
+  t.gsmIccid = mqttTopicPut("%s/gsm/iccid", 0);
+  t.wifiApState = mqttTopicPut("%s/wifi/ap/state", 0);
+  t.wifiApSet = mqttTopicPut("%s/wifi/ap/set", 0);
+  t.bleState = mqttTopicPut("%s/ble/state", 0);
+  t.bleSet = mqttTopicPut("%s/ble/set", 0);
+  t.dhtTemp = mqttTopicPut("%s/temp/dht/state", 0);
+  t.dhtHum = mqttTopicPut("%s/hum/dht/state", 0);
+  for (int i = 0; i < totalInputs; i++) {
+    t.inputState[i] = mqttTopicPut("%s/input/%d/state", i + 1);
+    t.vinState[i] = mqttTopicPut("%s/vin/%d/state", i + 1);
+    t.vinSet[i] = mqttTopicPut("%s/vin/%d/set", i + 1);
+  }
+  for (int i = 0; i < totalRelays; i++) {
+    t.relayState[i] = mqttTopicPut("%s/relay/%d/state", i + 1);
+    t.relayMode[i] = mqttTopicPut("%s/relay/%d/mode", i + 1);
+    t.relaySet[i] = mqttTopicPut("%s/relay/%d/set", i + 1);
+    t.relayAuto[i] = mqttTopicPut("%s/relay/%d/auto", i + 1);
+    t.rule[i] = mqttTopicPut("%s/rule/relay/%d", i + 1);
+  }
+  for (int s = 0; s < shutters; s++) {
+    t.shutterState[s] = mqttTopicPut("%s/shutter/%d/state", s + 1);
+    t.shutterSet[s] = mqttTopicPut("%s/shutter/%d/set", s + 1);
+  }
+  for (int i = 0; i < tempCount; i++) {
+    t.tempState[i] = mqttTopicPut("%s/temp/%d/state", i + 1);
+  }
+
+  t.keyBase = mqttCfg.base;
+  t.keyInputs = totalInputs;
+  t.keyRelays = totalRelays;
+  t.keyTemps = tempCount;
+  t.built = true;
+  Serial.printf("[MQTT] topic table: %u topics, %u bytes (%s)\n",
+                (unsigned)entries, (unsigned)t.used, t.base);
+}
+
+// Table à jour (comparaison sans allocation; reconstruction rare)
+static const MqttTopics& mqttTopicsGet() {
+  MqttTopics& t = mqttTopics;
+  if (!t.built || t.keyInputs != totalInputs || t.keyRelays != totalRelays ||
+      t.keyTemps != tempCount || t.keyBase != mqttCfg.base) {
+    mqttTopicsBuild();
+  }
+  return t;
+}
+
+static const char* mqttStatusTopic() {
+  return mqttTopicsGet().status;
+}
+
+static uint8_t mqttTopicFamily(const char* topic) {
+  const MqttTopics& tp = mqttTopicsGet();
+  if (strncmp(topic, tp.base, tp.baseLen) != 0 || topic[tp.baseLen] != '/') return MF_DISCOVERY;
+  const char* r = topic + tp.baseLen + 1;
+  const size_t n = strlen(r);
+  if (n >= 4 && strcmp(r + n - 4, "/set") == 0) return MF_CMD;
+  if (strcmp(r, "state") == 0) return MF_STATE;
+  if (strcmp(r, "ack") == 0) return MF_ACK;
+  if (strncmp(r, "input/", 6) == 0 || strncmp(r, "vin/", 4) == 0 ||
+      strncmp(r, "relay/", 6) == 0 || strncmp(r, "shutter/", 8) == 0) return MF_IO;
+  if (strncmp(r, "temp/", 5) == 0 || strncmp(r, "hum/", 4) == 0 || strncmp(r, "rule/", 5) == 0) return MF_TELEMETRY;
+  return MF_SYS;
+}
+
 static String tempAddrToString(const DeviceAddress &a){
   char buf[17];
   snprintf(buf, sizeof(buf), "%02X%02X%02X%02X%02X%02X%02X%02X",
@@ -1788,6 +3510,501 @@ static uint8_t scanOneWireTempBus() {
   return found;
 }
 
+static bool tempAddrFromString(const char* s, DeviceAddress& out) {
+  if (!s || strlen(s) != 16) return false;
+  for (uint8_t i = 0; i < 8; i++) {
+    char hex[3] = {s[i * 2], s[i * 2 + 1], 0};
+    char* end = nullptr;
+    out[i] = (uint8_t)strtoul(hex, &end, 16);
+    if (end != hex + 2) return false;
+  }
+  return true;
+}
+
+static int tempCfgFind(const DeviceAddress& a) {
+  for (uint8_t i = 0; i < tempCfgCount; i++) {
+    if (memcmp(tempCfg[i].addr, a, sizeof(DeviceAddress)) == 0) return i;
+  }
+  return -1;
+}
+
+// ---- DS18B20: conversions planifiées ----
+// Cycle en deux phases sans attente active: lancement de la conversion (skip ROM
+// quand tout le lot est dû ou en alimentation parasite, sinon un capteur adressé
+// par passage), attente du temps propre à la résolution, puis lecture d'un seul
+// scratchpad par passage avec contrôle CRC. Chaque transaction dure ~1-3 ms.
+enum TempPhase : uint8_t { TPH_IDLE, TPH_CONVERT, TPH_WAIT, TPH_READ };
+static TempPhase tempPhase = TPH_IDLE;
+static uint8_t tempBatch = 0;  // capteurs du cycle en cours (masque)
+static uint8_t tempCursor = 0;
+static uint32_t tempPhaseMs = 0;
+static uint16_t tempWaitMs = 0;
+
+static uint16_t ds18ConvMs(uint8_t res) {
+  return (uint16_t)(750 >> (12 - res)); // 94 / 188 / 375 / 750 ms
+}
+
+static bool ds18ReadScratch(const uint8_t* addr, uint8_t* sp) {
+  if (!oneWire.reset()) return false;
+  oneWire.select(addr);
+  oneWire.write(0xBE);
+  oneWire.read_bytes(sp, 9);
+  return true;
+}
+
+static float ds18Celsius(const uint8_t* addr, const uint8_t* sp) {
+  int16_t raw = (int16_t)((sp[1] << 8) | sp[0]);
+  if (addr[0] == 0x10) {
+    // DS18S20: pas de 0,5 °C affiné par COUNT_REMAIN, en 1/16 °C
+    raw = (int16_t)(((raw & 0xFFFE) << 3) + 12 - sp[6]);
+  } else {
+    const uint8_t r = (sp[4] >> 5) & 0x03; // 0 = 9 bits .. 3 = 12 bits
+    raw &= (int16_t)~((1 << (3 - r)) - 1); // bits indéfinis en basse résolution
+  }
+  return raw / 16.0f;
+}
+
+// Écrit la résolution dans le scratchpad (sans copie EEPROM: pas d'usure, réappliqué
+// à chaque boot). En cas d'échec on attend 750 ms comme en 12 bits.
+static void ds18ApplyResolution(uint8_t i) {
+  TempSensorRt& rt = tempRt[i];
+  if (tempAddr[i][0] == 0x10) {
+    rt.res = 12; // DS18S20: résolution fixe, conversion 750 ms
+    return;
+  }
+  uint8_t sp[9];
+  if (!ds18ReadScratch(tempAddr[i], sp) || OneWire::crc8(sp, 8) != sp[8]) {
+    Serial.printf("[TEMP] %s: scratchpad unreadable, keep 12-bit timing\n", tempAddrToString(tempAddr[i]).c_str());
+    rt.res = 12;
+    return;
+  }
+  const uint8_t cfg = (uint8_t)(((rt.res - 9) << 5) | 0x1F);
+  if (sp[4] == cfg) return;
+  if (!oneWire.reset()) return;
+  oneWire.select(tempAddr[i]);
+  oneWire.write(0x4E);
+  oneWire.write(sp[2]);
+  oneWire.write(sp[3]);
+  oneWire.write(cfg);
+}
+
+static void tempApplyCfg() {
+  const uint32_t now = millis();
+  for (uint8_t i = 0; i < tempCount; i++) {
+    TempSensorRt& rt = tempRt[i];
+    const int c = tempCfgFind(tempAddr[i]);
+    rt.res = (c >= 0) ? tempCfg[c].res : TEMP_DEFAULT_RES;
+    rt.intervalS = (c >= 0) ? tempCfg[c].intervalS : TEMP_DEFAULT_INTERVAL_S;
+    rt.nextDueMs = now;
+    ds18ApplyResolution(i);
+  }
+  tempPhase = TPH_IDLE;
+}
+
+static void mqttDiscoveryRestart();
+
+static uint8_t tempNextInBatch(uint8_t from) {
+  while (from < tempCount && !(tempBatch & (1u << from))) from++;
+  return from;
+}
+
+static void tempTick() {
+  if (tempCount == 0) return;
+  const uint32_t now = millis();
+  switch (tempPhase) {
+    case TPH_IDLE: {
+      uint8_t due = 0;
+      tempWaitMs = 0;
+      for (uint8_t i = 0; i < tempCount; i++) {
+        if ((int32_t)(now - tempRt[i].nextDueMs) < 0) continue;
+        due |= (uint8_t)(1u << i);
+        tempRt[i].nextDueMs = now + (uint32_t)tempRt[i].intervalS * 1000UL;
+        tempWaitMs = max(tempWaitMs, ds18ConvMs(tempRt[i].res));
+      }
+      if (!due) return;
+      tempBatch = due;
+      tempCursor = 0;
+      const uint8_t all = (uint8_t)((1u << tempCount) - 1);
+      if (due != all && !tempParasite) {
+        tempPhase = TPH_CONVERT;
+        return;
+      }
+      if (oneWire.reset()) {
+        oneWire.skip();
+        oneWire.write(0x44, tempParasite ? 1 : 0);
+      }
+      tempPhase = TPH_WAIT;
+      tempPhaseMs = now;
+      return;
+    }
+
+    case TPH_CONVERT:
+      tempCursor = tempNextInBatch(tempCursor);
+      if (tempCursor >= tempCount) {
+        tempPhase = TPH_WAIT;
+        tempPhaseMs = now;
+        return;
+      }
+      if (oneWire.reset()) {
+        oneWire.select(tempAddr[tempCursor]);
+        oneWire.write(0x44, 0);
+      }
+      tempCursor++;
+      return;
+
+    case TPH_WAIT:
+      if (now - tempPhaseMs < (uint32_t)tempWaitMs + 10) return;
+      tempCursor = 0;
+      tempPhase = TPH_READ;
+      return;
+
+    case TPH_READ: {
+      tempCursor = tempNextInBatch(tempCursor);
+      if (tempCursor >= tempCount) {
+        tempPhase = TPH_IDLE;
+        return;
+      }
+      const uint8_t i = tempCursor++;
+      TempSensorRt& rt = tempRt[i];
+      uint8_t sp[9];
+      bool present = ds18ReadScratch(tempAddr[i], sp);
+      if (present) {
+        // bus flottant = tout à 0xFF, bus tenu bas = tout à 0 (CRC valide): capteur absent
+        uint8_t ones = 0xFF, any = 0;
+        for (uint8_t k = 0; k < 9; k++) { ones &= sp[k]; any |= sp[k]; }
+        present = (ones != 0xFF) && (any != 0);
+      }
+      if (!present) {
+        rt.missed++;
+        tempC[i] = (float)DEVICE_DISCONNECTED_C;
+      } else if (OneWire::crc8(sp, 8) != sp[8]) {
+        rt.crcErr++;
+      } else {
+        tempC[i] = ds18Celsius(tempAddr[i], sp);
+        rt.lastOkMs = now;
+      }
+      return;
+    }
+  }
+}
+
+// ---- DHT22: capture des fronts par interruption ----
+// Le CPU n'est jamais tenu: broche en drain ouvert, impulsion de start de 1,1 ms
+// relâchée par un esp_timer, puis l'ISR horodate chaque front descendant de la
+// trame (~5 ms) et la boucle décode une fois la trame terminée. Un capteur absent
+// ne coûte rien: aucun front.
+static const uint32_t DHT_PERIOD_MS = 5000;      // DHT22: 2 s minimum entre lectures
+static const uint32_t DHT_START_LOW_US = 1100;
+static const uint32_t DHT_FRAME_MS = 10;         // start + réponse + 40 bits < 6 ms
+static const uint8_t DHT_EDGES = 42;             // réponse, 40 bits, fin
+static const uint8_t DHT_MAX_EDGES = 48;
+
+enum DhtPhase : uint8_t { DHT_IDLE, DHT_CAPTURE };
+static DhtPhase dhtPhase = DHT_IDLE;
+static uint32_t dhtPhaseMs = 0;
+static esp_timer_handle_t dhtReleaseTimer = nullptr;
+static volatile bool dhtArmed = false;
+static volatile uint8_t dhtEdgeCount = 0;
+static volatile uint32_t dhtEdgeUs[DHT_MAX_EDGES];
+
+static void IRAM_ATTR dhtEdgeIsr() {
+  if (!dhtArmed) return;
+  const uint8_t n = dhtEdgeCount;
+  if (n >= DHT_MAX_EDGES) return;
+  dhtEdgeUs[n] = micros();
+  dhtEdgeCount = n + 1;
+}
+
+static void dhtRelease(void*) {
+  dhtArmed = true;
+  gpio_set_level((gpio_num_t)PIN_DHT, 1);
+}
+
+static void dhtBegin() {
+  pinMode(PIN_DHT, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(PIN_DHT), dhtEdgeIsr, FALLING);
+  // sortie drain ouvert + entrée: pas de changement de mode (ni d'ISR) pendant la lecture
+  gpio_set_direction((gpio_num_t)PIN_DHT, GPIO_MODE_INPUT_OUTPUT_OD);
+  gpio_set_level((gpio_num_t)PIN_DHT, 1);
+  esp_timer_create_args_t args = {};
+  args.callback = dhtRelease;
+  args.name = "dht";
+  if (esp_timer_create(&args, &dhtReleaseTimer) != ESP_OK) {
+    dhtReleaseTimer = nullptr;
+    Serial.println("[DHT] timer create FAILED");
+  }
+}
+
+// Intervalles entre fronts descendants: réponse ~160 us, bit 0 ~76 us, bit 1 ~120 us.
+static bool dhtDecode(uint8_t count, float& t, float& h) {
+  uint8_t s = 0;
+  while (s + DHT_EDGES <= count) {
+    const uint32_t d = dhtEdgeUs[s + 1] - dhtEdgeUs[s];
+    if (d >= 140 && d <= 220) break;
+    s++;
+  }
+  if (s + DHT_EDGES > count) return false;
+  uint8_t b[5] = {0};
+  for (uint8_t k = 0; k < 40; k++) {
+    const uint32_t d = dhtEdgeUs[s + k + 2] - dhtEdgeUs[s + k + 1];
+    b[k / 8] = (uint8_t)((b[k / 8] << 1) | (d > 100 ? 1 : 0));
+  }
+  if ((uint8_t)(b[0] + b[1] + b[2] + b[3]) != b[4]) {
+    dhtChecksumErr++;
+    return false;
+  }
+  h = ((b[0] << 8) | b[1]) / 10.0f;
+  t = (((b[2] & 0x7F) << 8) | b[3]) / 10.0f;
+  if (b[2] & 0x80) t = -t;
+  return true;
+}
+
+static void dhtTick() {
+  if (!dhtReleaseTimer) return;
+  const uint32_t now = millis();
+  if (dhtPhase == DHT_IDLE) {
+    if (now - dhtPhaseMs < DHT_PERIOD_MS) return;
+    dhtPhaseMs = now;
+    dhtArmed = false;
+    dhtEdgeCount = 0;
+    gpio_set_level((gpio_num_t)PIN_DHT, 0);
+    esp_timer_start_once(dhtReleaseTimer, DHT_START_LOW_US);
+    dhtPhase = DHT_CAPTURE;
+    return;
+  }
+  if (now - dhtPhaseMs < DHT_FRAME_MS) return;
+  dhtArmed = false;
+  dhtPhase = DHT_IDLE;
+  const uint8_t count = dhtEdgeCount;
+  float t = NAN, h = NAN;
+  const uint32_t crcBefore = dhtChecksumErr;
+  if (!dhtDecode(count, t, h)) {
+    if (dhtChecksumErr == crcBefore) dhtMissed++;
+    if (!dhtCheckDone) {
+      Serial.printf("[DHT] not detected (edges=%u)\n", count);
+      dhtCheckDone = true;
+    }
+    return;
+  }
+  dhtReadOk++;
+  if (!dhtPresent) {
+    Serial.println("[DHT] detected");
+    mqttDiscoveryRestart();
+  }
+  dhtPresent = true;
+  dhtCheckDone = true;
+  dhtTempC = t;
+  dhtHum = h;
+}
+
+// ===============================================================
+// Historique embarqué (températures, entrées, relais)
+// ===============================================================
+// Mémoire fixe: HIST_BLOCKS blocs de 256 octets, le plus ancien est écrasé.
+// Enregistrement = série (u8), delta de temps en 1/10 s (varint), delta de valeur
+// zigzag (varint) par rapport à la valeur précédente de la même série dans le bloc.
+// Chaque bloc repart de zéro: il se décode seul, l'éviction ne casse aucune chaîne.
+// Temps = uptime (esp_timer, pas de repli à 49 jours); historique perdu au reboot.
+static const uint8_t HIST_BLOCKS = 32;
+static const uint16_t HIST_BLOCK_SIZE = 256;
+static const uint32_t HIST_TEMP_PERIOD_MS = 60000;
+static const uint32_t HIST_HEARTBEAT_MS = 900000; // valeur répétée au moins tous les 1/4 h
+
+enum HistSeries : uint8_t {
+  HS_TEMP0 = 0,                 // DS18B20 #i, 1/100 °C
+  HS_DHT_T = TEMP_MAX_SENSORS,  // 1/10 °C
+  HS_DHT_H,                     // 1/10 %
+  HS_INPUTS,                    // masque
+  HS_RELAYS,                    // masque
+  HS_COUNT
+};
+
+struct HistBlock {
+  uint32_t seq;     // 0 = vide
+  uint32_t baseDs;
+  uint32_t lastDs;
+  uint16_t used;
+  uint8_t data[HIST_BLOCK_SIZE];
+};
+
+static HistBlock histBlocks[HIST_BLOCKS];
+static uint32_t histSeqCur = 0;       // bloc en cours d'écriture
+static uint32_t histPrevDs = 0;
+static int32_t histPrev[HS_COUNT];    // valeurs de référence du bloc en cours
+static int32_t histLastVal[HS_COUNT]; // dernier échantillon retenu
+static uint32_t histLastRecMs[HS_COUNT];
+static uint16_t histHave = 0;
+static uint32_t histTempMs = 0;
+static uint32_t histIoVersion = 0;
+
+static uint32_t histNowDs() {
+  return (uint32_t)(esp_timer_get_time() / 100000);
+}
+
+static uint8_t histVarintPut(uint8_t* p, uint32_t v) {
+  uint8_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (uint8_t)v;
+  return n;
+}
+
+static bool histVarintGet(const uint8_t* p, uint16_t end, uint16_t& off, uint32_t& v) {
+  v = 0;
+  for (uint8_t shift = 0; off < end && shift < 35; shift += 7) {
+    const uint8_t b = p[off++];
+    v |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+static void histPut(uint8_t series, int32_t value) {
+  const uint32_t now = histNowDs();
+  for (uint8_t attempt = 0; attempt < 2; attempt++) {
+    if (histSeqCur) {
+      HistBlock& b = histBlocks[histSeqCur % HIST_BLOCKS];
+      const int32_t d = value - histPrev[series];
+      uint8_t rec[11];
+      uint8_t n = 0;
+      rec[n++] = series;
+      n += histVarintPut(rec + n, now - histPrevDs);
+      n += histVarintPut(rec + n, (uint32_t)((d << 1) ^ (d >> 31)));
+      if (b.used + n <= HIST_BLOCK_SIZE) {
+        memcpy(b.data + b.used, rec, n);
+        b.used += n;
+        b.lastDs = now;
+        histPrevDs = now;
+        histPrev[series] = value;
+        return;
+      }
+    }
+    histSeqCur++;
+    HistBlock& nb = histBlocks[histSeqCur % HIST_BLOCKS];
+    nb.seq = histSeqCur;
+    nb.baseDs = now;
+    nb.lastDs = now;
+    nb.used = 0;
+    histPrevDs = now;
+    memset(histPrev, 0, sizeof(histPrev));
+  }
+}
+
+static void histSample(uint8_t series, int32_t v, int32_t deadband, uint32_t nowMs) {
+  const uint16_t bit = (uint16_t)(1u << series);
+  if ((histHave & bit) && abs(v - histLastVal[series]) < deadband &&
+      nowMs - histLastRecMs[series] < HIST_HEARTBEAT_MS) {
+    return;
+  }
+  histHave |= bit;
+  histLastVal[series] = v;
+  histLastRecMs[series] = nowMs;
+  histPut(series, v);
+}
+
+static void histTick() {
+  const uint32_t now = millis();
+  IoSnapshot snap;
+  ioSnapshotRead(snap);
+  const bool heartbeat = now - histLastRecMs[HS_RELAYS] >= HIST_HEARTBEAT_MS;
+  if (snap.version != histIoVersion || heartbeat || !(histHave & (1u << HS_RELAYS))) {
+    histIoVersion = snap.version;
+    histSample(HS_INPUTS, snap.inputs, 1, now);
+    histSample(HS_RELAYS, snap.relays, 1, now);
+  }
+  if (now - histTempMs < HIST_TEMP_PERIOD_MS) return;
+  histTempMs = now;
+  for (uint8_t i = 0; i < tempCount; i++) {
+    if (tempC[i] > -100.0f) histSample(HS_TEMP0 + i, (int32_t)lroundf(tempC[i] * 100.0f), 10, now);
+  }
+  if (!isnan(dhtTempC)) histSample(HS_DHT_T, (int32_t)lroundf(dhtTempC * 10.0f), 1, now);
+  if (!isnan(dhtHum)) histSample(HS_DHT_H, (int32_t)lroundf(dhtHum * 10.0f), 5, now);
+}
+
+static const char* histSeriesName(uint8_t s, char* buf, size_t cap) {
+  switch (s) {
+    case HS_DHT_T: return "dht_t";
+    case HS_DHT_H: return "dht_h";
+    case HS_INPUTS: return "inputs";
+    case HS_RELAYS: return "relays";
+    default:
+      snprintf(buf, cap, "temp%u", (unsigned)(s - HS_TEMP0));
+      return buf;
+  }
+}
+
+static int histSeriesFind(const char* name, size_t len) {
+  char buf[8];
+  for (uint8_t s = 0; s < HS_COUNT; s++) {
+    const char* n = histSeriesName(s, buf, sizeof(buf));
+    if (strlen(n) == len && strncmp(n, name, len) == 0) return s;
+  }
+  return -1;
+}
+
+static void histAppendValue(String& out, uint8_t s, int32_t v) {
+  char num[16];
+  if (s < HS_DHT_T) snprintf(num, sizeof(num), "%.2f", v / 100.0f);
+  else if (s <= HS_DHT_H) snprintf(num, sizeof(num), "%.1f", v / 10.0f);
+  else snprintf(num, sizeof(num), "%ld", (long)v);
+  out += num;
+}
+
+// Un bloc par appel, en chunk HTTP: la réponse n'est jamais entière en RAM.
+// Le bloc en cours peut grossir entre deux appels: il est envoyé tel quel.
+static void histFill(HttpConn& hc) {
+  String body;
+  bool done = false;
+  const uint32_t oldest = (histSeqCur > HIST_BLOCKS) ? histSeqCur - HIST_BLOCKS + 1 : 1;
+  if (hc.histSeq < oldest) hc.histSeq = oldest;
+  if (histSeqCur == 0 || hc.histSeq > histSeqCur) {
+    done = true;
+  } else {
+    const HistBlock& b = histBlocks[hc.histSeq % HIST_BLOCKS];
+    hc.histSeq++;
+    if (b.baseDs > hc.histToDs) {
+      done = true;
+    } else if (b.lastDs >= hc.histFromDs) {
+      int32_t prev[HS_COUNT] = {0};
+      uint32_t t = b.baseDs;
+      uint16_t off = 0;
+      char nameBuf[8];
+      while (off < b.used) {
+        const uint8_t s = b.data[off++];
+        uint32_t dt = 0, zz = 0;
+        if (s >= HS_COUNT || !histVarintGet(b.data, b.used, off, dt) || !histVarintGet(b.data, b.used, off, zz)) break;
+        t += dt;
+        prev[s] += (int32_t)((zz >> 1) ^ (0u - (zz & 1u)));
+        if (t < hc.histFromDs || t > hc.histToDs || !(hc.histMask & (1u << s))) continue;
+        body += hc.histFirst ? "[\"" : ",[\"";
+        hc.histFirst = false;
+        body += histSeriesName(s, nameBuf, sizeof(nameBuf));
+        body += "\",";
+        body += String((unsigned long long)t * 100ULL);
+        body += ",";
+        histAppendValue(body, s, prev[s]);
+        body += "]";
+      }
+    }
+  }
+  if (done) {
+    body += "]}";
+    hc.hist = false;
+  }
+  char hdr[12];
+  hc.out = String();
+  if (body.length() > 0) {
+    snprintf(hdr, sizeof(hdr), "%x\r\n", body.length());
+    hc.out = hdr;
+    hc.out += body;
+    hc.out += "\r\n";
+  }
+  if (done) hc.out += "0\r\n\r\n";
+  hc.outOff = 0;
+}
+
 static String ruleSummaryShort(int relayIndex){
   JsonArray rel = rulesDoc["relays"].as<JsonArray>();
   if(!rel || relayIndex < 0 || relayIndex >= (int)rel.size()) return "NONE";
@@ -1831,401 +4048,773 @@ static String ruleSummaryShort(int relayIndex){
   return out;
 }
 
-static void mqttPublishDiscovery(const String& transport) {
-  if (!mqttConnectedForTransport(transport)) return;
-  if (mqttLowDataTransport(transport)) return; // data-saver on GSM
-  String base = mqttBaseTopic();
-  String node = mqttNodeId();
-  String avail = base + "/status";
-  String id = node;
+// ================== MQTT: Home Assistant discovery ==================
+// Job incrémental: quelques entités par passage de boucle. Une première passe
+// calcule l'empreinte (FNV-1a) de l'ensemble topic+payload; si elle est égale
+// à celle déjà publiée sur ce broker, rien n'est renvoyé (configs retenues).
+enum MqttDiscKind : uint8_t {
+  MD_RELAY, MD_RELAY_AUTO, MD_RULE, MD_IP, MD_WIFI, MD_BLE, MD_INPUT, MD_VIN,
+  MD_SHUTTER, MD_TEMP, MD_DHT_TEMP, MD_DHT_HUM, MD_END
+};
 
-  static JsonDocument doc;
+static const uint8_t MQTT_DISC_PER_TICK = 4;
+
+struct MqttDiscJob {
+  bool active = false;
+  bool publishing = false; // false: passe d'empreinte, true: passe d'émission
+  bool draining = false;   // tout est en file: attendre l'émission avant de mémoriser
+  uint8_t kind = 0;
+  uint8_t idx = 0;
+  uint16_t entities = 0;
+  uint32_t hash = 0;
+  uint32_t evictions = 0; // mqttDiscEvictions au début de l'émission
+  String transport;
+};
 
-  for (int i = 0; i < totalRelays; i++) {
-    doc.clear();
-    String uid = id + "_relay_" + String(i+1);
-    doc["name"] = "Relay " + String(i+1);
-    doc["uniq_id"] = uid;
-    doc["stat_t"] = base + "/relay/" + String(i+1) + "/state";
-    doc["cmd_t"] = base + "/relay/" + String(i+1) + "/set";
-    doc["pl_on"] = "ON";
-    doc["pl_off"] = "OFF";
-    doc["avty_t"] = avail;
-    doc["pl_avail"] = "online";
-    doc["pl_not_avail"] = "offline";
-    JsonObject dev = doc["dev"].to<JsonObject>();
-    dev["ids"] = id;
-    dev["name"] = node;
-    dev["mdl"] = "ESPRelay4";
-    dev["mf"] = "ESPRelay4";
-    String topic = mqttCfg.discoveryPrefix + "/switch/" + uid + "/config";
-    String out; serializeJson(doc, out);
-    mqttPublishToTransport(transport, topic, out, true);
-
-    // Auto button to return relay to AUTO mode
-    doc.clear();
-    doc["name"] = "Relay " + String(i+1) + " AUTO";
-    doc["uniq_id"] = uid + "_auto";
-    doc["cmd_t"] = base + "/relay/" + String(i+1) + "/auto";
-    doc["pl_press"] = "AUTO";
-    doc["avty_t"] = avail;
-    doc["pl_avail"] = "online";
-    doc["pl_not_avail"] = "offline";
-    JsonObject dev2 = doc["dev"].to<JsonObject>();
-    dev2["ids"] = id;
-    dev2["name"] = node;
-    dev2["mdl"] = "ESPRelay4";
-    dev2["mf"] = "ESPRelay4";
-    topic = mqttCfg.discoveryPrefix + "/button/" + uid + "_auto/config";
-    serializeJson(doc, out);
-    mqttPublishToTransport(transport, topic, out, true);
-
-    // Rule summary sensor
-    doc.clear();
-    String rid = id + "_rule_" + String(i+1);
-    doc["name"] = "Rule R" + String(i+1);
-    doc["uniq_id"] = rid;
-    doc["stat_t"] = base + "/rule/relay/" + String(i+1);
-    doc["avty_t"] = avail;
-    doc["pl_avail"] = "online";
-    doc["pl_not_avail"] = "offline";
-    JsonObject devr = doc["dev"].to<JsonObject>();
-    devr["ids"] = id;
-    devr["name"] = node;
-    devr["mdl"] = "ESPRelay4";
-    devr["mf"] = "ESPRelay4";
-    topic = mqttCfg.discoveryPrefix + "/sensor/" + rid + "/config";
-    serializeJson(doc, out);
-    mqttPublishToTransport(transport, topic, out, true);
-  }
-
-  // IP sensor
-  doc.clear();
-  String ipId = id + "_ip";
-  doc["name"] = "IP";
-  doc["uniq_id"] = ipId;
-  doc["stat_t"] = base + "/net/ip";
-  doc["avty_t"] = avail;
-  doc["pl_avail"] = "online";
-  doc["pl_not_avail"] = "offline";
-  JsonObject devip = doc["dev"].to<JsonObject>();
-  devip["ids"] = id;
-  devip["name"] = node;
-  devip["mdl"] = "ESPRelay4";
-  devip["mf"] = "ESPRelay4";
-  String ipTopic = mqttCfg.discoveryPrefix + "/sensor/" + ipId + "/config";
-  String out; serializeJson(doc, out);
-  mqttPublishToTransport(transport, ipTopic, out, true);
+static MqttDiscJob mqttDisc;
 
-  // WiFi AP enable switch
-  doc.clear();
-  String wId = id + "_wifi_ap";
-  doc["name"] = "WiFi AP";
-  doc["uniq_id"] = wId;
-  doc["stat_t"] = base + "/wifi/ap/state";
-  doc["cmd_t"] = base + "/wifi/ap/set";
-  doc["pl_on"] = "ON";
-  doc["pl_off"] = "OFF";
-  doc["avty_t"] = avail;
-  doc["pl_avail"] = "online";
-  doc["pl_not_avail"] = "offline";
-  JsonObject devw = doc["dev"].to<JsonObject>();
-  devw["ids"] = id;
-  devw["name"] = node;
-  devw["mdl"] = "ESPRelay4";
-  devw["mf"] = "ESPRelay4";
-  String wTopic = mqttCfg.discoveryPrefix + "/switch/" + wId + "/config";
-  serializeJson(doc, out);
-  mqttPublishToTransport(transport, wTopic, out, true);
+// Entités changées (config, capteur apparu...): job repris depuis le début
+static void mqttDiscoveryRestart() {
+  mqttDisc.active = false;
+  mqttAnnouncedEth = false;
+}
 
-  // BLE enable switch
-  doc.clear();
-  String bId = id + "_ble";
-  doc["name"] = "BLE";
-  doc["uniq_id"] = bId;
-  doc["stat_t"] = base + "/ble/state";
-  doc["cmd_t"] = base + "/ble/set";
-  doc["pl_on"] = "ON";
-  doc["pl_off"] = "OFF";
+static uint8_t mqttDiscCount(uint8_t kind) {
+  switch (kind) {
+    case MD_RELAY: case MD_RELAY_AUTO: case MD_RULE: return totalRelays;
+    case MD_IP: case MD_WIFI: case MD_BLE: return 1;
+    case MD_INPUT: case MD_VIN: return totalInputs;
+    case MD_SHUTTER: return shuttersLimit();
+    case MD_TEMP: return tempCount;
+    case MD_DHT_TEMP: case MD_DHT_HUM: return dhtPresent ? 1 : 0;
+    default: return 0;
+  }
+}
+
+static void mqttDiscAddCommon(JsonDocument& doc, const char* avail, const String& id) {
   doc["avty_t"] = avail;
   doc["pl_avail"] = "online";
   doc["pl_not_avail"] = "offline";
-  JsonObject devb = doc["dev"].to<JsonObject>();
-  devb["ids"] = id;
-  devb["name"] = node;
-  devb["mdl"] = "ESPRelay4";
-  devb["mf"] = "ESPRelay4";
-  String bTopic = mqttCfg.discoveryPrefix + "/switch/" + bId + "/config";
+  JsonObject dev = doc["dev"].to<JsonObject>();
+  dev["ids"] = id;
+  dev["name"] = id;
+  dev["mdl"] = "ESPRelay4";
+  dev["mf"] = "ESPRelay4";
+}
+
+// Entité (kind, i) -> topic + payload; false si l'entité n'existe pas (volet désactivé)
+static bool mqttDiscBuild(uint8_t kind, int i, String& topic, String& out) {
+  const MqttTopics& tp = mqttTopicsGet();
+  const String id = mqttNodeId();
+  const String& prefix = mqttCfg.discoveryPrefix;
+  static JsonDocument doc;
+  doc.clear();
+  String uid;
+  switch (kind) {
+    case MD_RELAY:
+      uid = id + "_relay_" + String(i+1);
+      doc["name"] = "Relay " + String(i+1);
+      doc["stat_t"] = tp.relayState[i];
+      doc["cmd_t"] = tp.relaySet[i];
+      doc["pl_on"] = "ON";
+      doc["pl_off"] = "OFF";
+      topic = prefix + "/switch/" + uid + "/config";
+      break;
+    case MD_RELAY_AUTO:
+      // Bouton pour rendre le relais au mode AUTO
+      uid = id + "_relay_" + String(i+1) + "_auto";
+      doc["name"] = "Relay " + String(i+1) + " AUTO";
+      doc["cmd_t"] = tp.relayAuto[i];
+      doc["pl_press"] = "AUTO";
+      topic = prefix + "/button/" + uid + "/config";
+      break;
+    case MD_RULE:
+      uid = id + "_rule_" + String(i+1);
+      doc["name"] = "Rule R" + String(i+1);
+      doc["stat_t"] = tp.rule[i];
+      topic = prefix + "/sensor/" + uid + "/config";
+      break;
+    case MD_IP:
+      uid = id + "_ip";
+      doc["name"] = "IP";
+      doc["stat_t"] = tp.netIp;
+      topic = prefix + "/sensor/" + uid + "/config";
+      break;
+    case MD_WIFI:
+      uid = id + "_wifi_ap";
+      doc["name"] = "WiFi AP";
+      doc["stat_t"] = tp.wifiApState;
+      doc["cmd_t"] = tp.wifiApSet;
+      doc["pl_on"] = "ON";
+      doc["pl_off"] = "OFF";
+      topic = prefix + "/switch/" + uid + "/config";
+      break;
+    case MD_BLE:
+      uid = id + "_ble";
+      doc["name"] = "BLE";
+      doc["stat_t"] = tp.bleState;
+      doc["cmd_t"] = tp.bleSet;
+      doc["pl_on"] = "ON";
+      doc["pl_off"] = "OFF";
+      topic = prefix + "/switch/" + uid + "/config";
+      break;
+    case MD_INPUT:
+      uid = id + "_input_" + String(i+1);
+      doc["name"] = "Input " + String(i+1);
+      doc["stat_t"] = tp.inputState[i];
+      doc["pl_on"] = "ON";
+      doc["pl_off"] = "OFF";
+      topic = prefix + "/binary_sensor/" + uid + "/config";
+      break;
+    case MD_VIN:
+      // Entrées virtuelles (pilotées par MQTT) en switch
+      uid = id + "_vin_" + String(i+1);
+      doc["name"] = "VInput " + String(i+1);
+      doc["stat_t"] = tp.vinState[i];
+      doc["cmd_t"] = tp.vinSet[i];
+      doc["pl_on"] = "ON";
+      doc["pl_off"] = "OFF";
+      topic = prefix + "/switch/" + uid + "/config";
+      break;
+    case MD_SHUTTER:
+      if (!shCfg[i].enabled) return false;
+      uid = id + "_shutter_" + String(i+1);
+      doc["name"] = shCfg[i].name;
+      doc["cmd_t"] = tp.shutterSet[i];
+      doc["stat_t"] = tp.shutterState[i];
+      doc["pl_open"] = "OPEN";
+      doc["pl_close"] = "CLOSE";
+      doc["pl_stop"] = "STOP";
+      doc["optimistic"] = true;
+      doc["assumed_state"] = true;
+      topic = prefix + "/cover/" + uid + "/config";
+      break;
+    case MD_TEMP:
+      uid = id + "_temp_" + String(i+1);
+      doc["name"] = "Temp " + String(i+1);
+      doc["stat_t"] = tp.tempState[i];
+      doc["unit_of_meas"] = "°C";
+      doc["dev_cla"] = "temperature";
+      doc["stat_cla"] = "measurement";
+      topic = prefix + "/sensor/" + uid + "/config";
+      break;
+    case MD_DHT_TEMP:
+      uid = id + "_temp_dht22";
+      doc["name"] = "Temp DHT22";
+      doc["stat_t"] = tp.dhtTemp;
+      doc["unit_of_meas"] = "°C";
+      doc["dev_cla"] = "temperature";
+      doc["stat_cla"] = "measurement";
+      topic = prefix + "/sensor/" + uid + "/config";
+      break;
+    case MD_DHT_HUM:
+      uid = id + "_hum_dht22";
+      doc["name"] = "Humidité DHT22";
+      doc["stat_t"] = tp.dhtHum;
+      doc["unit_of_meas"] = "%";
+      doc["dev_cla"] = "humidity";
+      doc["stat_cla"] = "measurement";
+      topic = prefix + "/sensor/" + uid + "/config";
+      break;
+    default:
+      return false;
+  }
+  doc["uniq_id"] = uid;
+  mqttDiscAddCommon(doc, tp.status, id);
+  out = String();
   serializeJson(doc, out);
-  mqttPublishToTransport(transport, bTopic, out, true);
+  return true;
+}
 
-  for (int i = 0; i < totalInputs; i++) {
-    doc.clear();
-    String uid = id + "_input_" + String(i+1);
-    doc["name"] = "Input " + String(i+1);
-    doc["uniq_id"] = uid;
-    doc["stat_t"] = base + "/input/" + String(i+1) + "/state";
-    doc["pl_on"] = "ON";
-    doc["pl_off"] = "OFF";
-    doc["avty_t"] = avail;
-    doc["pl_avail"] = "online";
-    doc["pl_not_avail"] = "offline";
-    JsonObject dev = doc["dev"].to<JsonObject>();
-    dev["ids"] = id;
-    dev["name"] = node;
-    dev["mdl"] = "ESPRelay4";
-    dev["mf"] = "ESPRelay4";
-    String topic = mqttCfg.discoveryPrefix + "/binary_sensor/" + uid + "/config";
-    String out; serializeJson(doc, out);
-    mqttPublishToTransport(transport, topic, out, true);
-  }
-
-  // Virtual inputs (MQTT-driven) as switches
-  for (int i = 0; i < totalInputs; i++) {
-    doc.clear();
-    String uid = id + "_vin_" + String(i+1);
-    doc["name"] = "VInput " + String(i+1);
-    doc["uniq_id"] = uid;
-    doc["stat_t"] = base + "/vin/" + String(i+1) + "/state";
-    doc["cmd_t"] = base + "/vin/" + String(i+1) + "/set";
-    doc["pl_on"] = "ON";
-    doc["pl_off"] = "OFF";
-    doc["avty_t"] = avail;
-    doc["pl_avail"] = "online";
-    doc["pl_not_avail"] = "offline";
-    JsonObject dev = doc["dev"].to<JsonObject>();
-    dev["ids"] = id;
-    dev["name"] = node;
-    dev["mdl"] = "ESPRelay4";
-    dev["mf"] = "ESPRelay4";
-    String topic = mqttCfg.discoveryPrefix + "/switch/" + uid + "/config";
-    String out; serializeJson(doc, out);
-    mqttPublishToTransport(transport, topic, out, true);
+static uint32_t fnv1a(uint32_t h, const char* p, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    h ^= (uint8_t)p[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static bool saveMqttDiscHash() {
+  String out = String("{\"hash\":") + String((unsigned long)mqttDiscHash) + "}";
+  return writeFile("/mqtt_disc.json", out);
+}
+
+static void loadMqttDiscHash() {
+  String s = readFile("/mqtt_disc.json");
+  mqttDiscHash = 0;
+  if (s.length() == 0) return;
+  JsonDocument doc;
+  if (deserializeJson(doc, s)) return;
+  mqttDiscHash = doc["hash"] | 0u;
+}
+
+static void mqttDiscoveryStart(const String& transport) {
+  if (mqttLowDataTransport(transport)) return; // data-saver on GSM
+  MqttDiscJob& j = mqttDisc;
+  j.active = true;
+  j.publishing = false;
+  j.draining = false;
+  j.kind = 0;
+  j.idx = 0;
+  j.entities = 0;
+  // le broker et le préfixe font partie de l'empreinte: changement = republication
+  j.hash = 2166136261u;
+  j.hash = fnv1a(j.hash, mqttCfg.host.c_str(), mqttCfg.host.length());
+  j.hash = fnv1a(j.hash, (const char*)&mqttCfg.port, sizeof(mqttCfg.port));
+  j.transport = transport;
+}
+
+static void mqttDiscoveryTick() {
+  MqttDiscJob& j = mqttDisc;
+  if (!j.active) return;
+  if (!mqttConnectedForTransport(j.transport)) {
+    j.active = false; // relancé à la reconnexion
+    return;
+  }
+  if (j.draining) {
+    // empreinte mémorisée seulement une fois la dernière config réellement publiée:
+    // sinon un reboot ou une coupure avant l'envoi laisserait HA sans entités
+    if (mqttDiscEvictions != j.evictions) {
+      j.active = false; // une config a été perdue: tout refaire (empreinte non mémorisée)
+      return;
+    }
+    if (mqttOutboxHolds(j.transport == "gsm" ? mqttOutGsm : mqttOutEth, MP_DISCOVERY)) return;
+    mqttDiscHash = j.hash;
+    cfgSaveLater(CS_MQTT_DISC);
+    j.active = false;
+    if (j.transport == "gsm") mqttAnnouncedGsm = true;
+    else mqttAnnouncedEth = true;
+    return;
+  }
+  String topic, out;
+  uint8_t done = 0;
+  while (done < MQTT_DISC_PER_TICK && j.kind < MD_END) {
+    if (j.idx >= mqttDiscCount(j.kind)) {
+      j.kind++;
+      j.idx = 0;
+      continue;
+    }
+    const uint8_t i = j.idx++;
+    if (!mqttDiscBuild(j.kind, i, topic, out)) continue;
+    done++;
+    if (j.publishing) {
+      mqttPublishToTransport(j.transport, topic.c_str(), out.c_str(), true, MP_DISCOVERY);
+    } else {
+      j.hash = fnv1a(j.hash, topic.c_str(), topic.length() + 1);
+      j.hash = fnv1a(j.hash, out.c_str(), out.length());
+      j.entities++;
+    }
+  }
+  if (j.kind < MD_END) return;
+
+  if (!j.publishing) {
+    if (j.hash == mqttDiscHash) {
+      Serial.printf("[MQTT] discovery unchanged (%u entities, hash %08lx) -> skip\n",
+                    (unsigned)j.entities, (unsigned long)j.hash);
+    } else {
+      Serial.printf("[MQTT] discovery changed -> publish %u entities\n", (unsigned)j.entities);
+      j.publishing = true;
+      j.kind = 0;
+      j.idx = 0;
+      j.evictions = mqttDiscEvictions;
+      return;
+    }
+  } else {
+    j.draining = true; // empreinte mémorisée par le passage qui voit la file vidée
+    return;
   }
+  j.active = false;
+  if (j.transport == "gsm") mqttAnnouncedGsm = true;
+  else mqttAnnouncedEth = true;
+}
+
+// ================== MQTT: état groupé <base>/state ==================
+// Un seul message JSON compact (masques de bits) à la place de ~100 topics:
+// {"ni":N,"nr":N,"in":m,"vin":m,"rel":m,"fon":m,"foff":m,"sh":[..],"t":[..],"dht":[t,h]}
+static const size_t MQTT_BULK_MAX = 384;
+static const uint32_t MQTT_BULK_TEMP_MIN_MS = 60000; // changement de température seul: pas plus souvent
+// Dernier état groupé émis, par transport (bandes mortes propres au GSM)
+struct MqttBulkTx {
+  bool sent;
+  uint32_t version;
+  uint32_t lastMs;
+  float temp[TEMP_MAX_SENSORS];
+  float dht[2];
+};
+static MqttBulkTx mqttBulkEth = {};
+static MqttBulkTx mqttBulkGsm = {};
 
+static bool mqttEntityTopicsFor(const String& transport) {
+  return transport != "gsm" || mqttGsmEntityTopics();
+}
+
+static bool mqttBulkFor(const String& transport) {
+  return mqttCfg.stateBulk || !mqttEntityTopicsFor(transport);
+}
+
+static size_t mqttBulkAppend(char* buf, size_t cap, size_t len, const char* fmt, ...) {
+  if (len >= cap) return len;
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf + len, cap - len, fmt, ap);
+  va_end(ap);
+  if (n < 0) return len;
+  return min(len + (size_t)n, cap - 1);
+}
+
+static void mqttStateBulkJson(char* buf, size_t cap, const IoSnapshot& snap) {
+  uint16_t fon = 0, foff = 0;
+  for (int i = 0; i < totalRelays; i++) {
+    if (snap.overrideRelay[i] == 1) fon |= (uint16_t)(1u << i);
+    else if (snap.overrideRelay[i] == 0) foff |= (uint16_t)(1u << i);
+  }
+  size_t n = mqttBulkAppend(buf, cap, 0,
+      "{\"ni\":%u,\"nr\":%u,\"in\":%u,\"vin\":%u,\"rel\":%u,\"fon\":%u,\"foff\":%u,\"sh\":[",
+      (unsigned)totalInputs, (unsigned)totalRelays, (unsigned)snap.inputs, (unsigned)snap.virtualInputs,
+      (unsigned)snap.relays, (unsigned)fon, (unsigned)foff);
   for (int s = 0; s < shuttersLimit(); s++) {
-    if (!shCfg[s].enabled) continue;
-    doc.clear();
-    String uid = id + "_shutter_" + String(s+1);
-    doc["name"] = shCfg[s].name;
-    doc["uniq_id"] = uid;
-    doc["cmd_t"] = base + "/shutter/" + String(s+1) + "/set";
-    doc["stat_t"] = base + "/shutter/" + String(s+1) + "/state";
-    doc["pl_open"] = "OPEN";
-    doc["pl_close"] = "CLOSE";
-    doc["pl_stop"] = "STOP";
-    doc["optimistic"] = true;
-    doc["assumed_state"] = true;
-    doc["avty_t"] = avail;
-    doc["pl_avail"] = "online";
-    doc["pl_not_avail"] = "offline";
-    JsonObject dev = doc["dev"].to<JsonObject>();
-    dev["ids"] = id;
-    dev["name"] = node;
-    dev["mdl"] = "ESPRelay4";
-    dev["mf"] = "ESPRelay4";
-    String topic = mqttCfg.discoveryPrefix + "/cover/" + uid + "/config";
-    String out; serializeJson(doc, out);
-    mqttPublishToTransport(transport, topic, out, true);
-  }
-
-  // Temperature sensors
+    if (shCfg[s].enabled) n = mqttBulkAppend(buf, cap, n, "%s%u", s ? "," : "", (unsigned)snap.shutterMove[s]);
+    else n = mqttBulkAppend(buf, cap, n, "%snull", s ? "," : "");
+  }
+  n = mqttBulkAppend(buf, cap, n, "],\"t\":[");
   for (int i = 0; i < tempCount; i++) {
-    doc.clear();
-    String uid = id + "_temp_" + String(i+1);
-    doc["name"] = "Temp " + String(i+1);
-    doc["uniq_id"] = uid;
-    doc["stat_t"] = base + "/temp/" + String(i+1) + "/state";
-    doc["unit_of_meas"] = "°C";
-    doc["dev_cla"] = "temperature";
-    doc["stat_cla"] = "measurement";
-    doc["avty_t"] = avail;
-    doc["pl_avail"] = "online";
-    doc["pl_not_avail"] = "offline";
-    JsonObject dev = doc["dev"].to<JsonObject>();
-    dev["ids"] = id;
-    dev["name"] = node;
-    dev["mdl"] = "ESPRelay4";
-    dev["mf"] = "ESPRelay4";
-    String topic = mqttCfg.discoveryPrefix + "/sensor/" + uid + "/config";
-    String out; serializeJson(doc, out);
-    mqttPublishToTransport(transport, topic, out, true);
-  }
-
-  if (dhtPresent) {
-    doc.clear();
-    String uid = id + "_temp_dht22";
-    doc["name"] = "Temp DHT22";
-    doc["uniq_id"] = uid;
-    doc["stat_t"] = base + "/temp/dht/state";
-    doc["unit_of_meas"] = "°C";
-    doc["dev_cla"] = "temperature";
-    doc["stat_cla"] = "measurement";
-    doc["avty_t"] = avail;
-    doc["pl_avail"] = "online";
-    doc["pl_not_avail"] = "offline";
-    JsonObject dev = doc["dev"].to<JsonObject>();
-    dev["ids"] = id;
-    dev["name"] = node;
-    dev["mdl"] = "ESPRelay4";
-    dev["mf"] = "ESPRelay4";
-    String topic = mqttCfg.discoveryPrefix + "/sensor/" + uid + "/config";
-    String out; serializeJson(doc, out);
-    mqttPublishToTransport(transport, topic, out, true);
-  }
-  if (dhtPresent) {
-    doc.clear();
-    String uid = id + "_hum_dht22";
-    doc["name"] = "Humidité DHT22";
-    doc["uniq_id"] = uid;
-    doc["stat_t"] = base + "/hum/dht/state";
-    doc["unit_of_meas"] = "%";
-    doc["dev_cla"] = "humidity";
-    doc["stat_cla"] = "measurement";
-    doc["avty_t"] = avail;
-    doc["pl_avail"] = "online";
-    doc["pl_not_avail"] = "offline";
-    JsonObject dev = doc["dev"].to<JsonObject>();
-    dev["ids"] = id;
-    dev["name"] = node;
-    dev["mdl"] = "ESPRelay4";
-    dev["mf"] = "ESPRelay4";
-    String topic = mqttCfg.discoveryPrefix + "/sensor/" + uid + "/config";
-    String out; serializeJson(doc, out);
-    mqttPublishToTransport(transport, topic, out, true);
-  }
-
-  if (transport == "gsm") mqttAnnouncedGsm = true;
-  else mqttAnnouncedEth = true;
+    if (tempC[i] > -100.0f) n = mqttBulkAppend(buf, cap, n, "%s%.2f", i ? "," : "", tempC[i]);
+    else n = mqttBulkAppend(buf, cap, n, "%snull", i ? "," : "");
+  }
+  n = mqttBulkAppend(buf, cap, n, "]");
+  if (dhtPresent && !isnan(dhtTempC) && !isnan(dhtHum)) {
+    n = mqttBulkAppend(buf, cap, n, ",\"dht\":[%.2f,%.1f]", dhtTempC, dhtHum);
+  }
+  mqttBulkAppend(buf, cap, n, "}");
+}
+
+static void mqttBulkMark(MqttBulkTx& b, const IoSnapshot& snap, uint32_t now) {
+  b.sent = true;
+  b.version = snap.version;
+  b.lastMs = now;
+  for (int i = 0; i < tempCount; i++) b.temp[i] = tempC[i];
+  b.dht[0] = dhtTempC;
+  b.dht[1] = dhtHum;
+}
+
+static bool mqttBulkTempsChanged(const MqttBulkTx& b, float scale) {
+  for (int i = 0; i < tempCount; i++) {
+    if (fabs(tempC[i] - b.temp[i]) >= 0.1f * scale) return true;
+  }
+  if (dhtPresent && !isnan(dhtTempC) && (isnan(b.dht[0]) || fabs(dhtTempC - b.dht[0]) >= 0.1f * scale)) return true;
+  if (dhtPresent && !isnan(dhtHum) && (isnan(b.dht[1]) || fabs(dhtHum - b.dht[1]) >= 0.5f * scale)) return true;
+  return false;
+}
+
+// Publie <base>/state sur un transport si l'état E/S a changé, ou si les températures ont
+// dépassé la bande morte depuis l'intervalle mini (élargis par le budget data sur GSM).
+static void mqttBulkTick(MqttBulkTx& b, PubSubClient& client, const IoSnapshot& snap, uint32_t now,
+                         char* bulk, bool& built) {
+  const uint8_t lvl = (&client == &mqttClientGsm) ? gsmBudgetLevel() : 0;
+  if (b.sent && snap.version == b.version &&
+      ((now - b.lastMs) < MQTT_BULK_TEMP_MIN_MS * GSM_INTERVAL_X[lvl] ||
+       !mqttBulkTempsChanged(b, (float)GSM_DEADBAND_X[lvl]))) {
+    return;
+  }
+  if (!built) {
+    mqttStateBulkJson(bulk, MQTT_BULK_MAX, snap);
+    built = true;
+  }
+  mqttPublishToClient(client, mqttTopicsGet().state, bulk, mqttCfg.retain);
+  mqttBulkMark(b, snap, now);
+}
+
+// ================== MQTT: compteurs de trafic <base>/traffic ==================
+static const uint32_t MQTT_TRAFFIC_PUB_MS = 300000;       // Ethernet: toutes les 5 min
+static const uint32_t MQTT_TRAFFIC_GSM_PUB_MS = 3600000;  // GSM: toutes les heures (x budget)
+static const size_t MQTT_TRAFFIC_MAX = 512;
+
+static size_t mqttTrafficFamJson(char* buf, size_t cap, size_t n, const MqttTraffic& t) {
+  n = mqttBulkAppend(buf, cap, n, "{");
+  for (uint8_t f = 0; f < MF_COUNT; f++) {
+    n = mqttBulkAppend(buf, cap, n, "%s\"%s\":[%llu,%llu]", f ? "," : "", MQTT_FAMILY_NAMES[f],
+                       (unsigned long long)t.famTx[f], (unsigned long long)t.famRx[f]);
+  }
+  return mqttBulkAppend(buf, cap, n, "}");
+}
+
+// {"eth":[tx,rx],"gsm":[tx,rx],"gsm_fam":{"state":[tx,rx],...},"month":AAAAMM,"used":N,"budget_mb":N,"level":L}
+static void mqttTrafficJson(char* buf, size_t cap) {
+  size_t n = mqttBulkAppend(buf, cap, 0, "{\"eth\":[%llu,%llu],\"gsm\":[%llu,%llu],\"gsm_fam\":",
+                            (unsigned long long)mqttTrafficEth.tx, (unsigned long long)mqttTrafficEth.rx,
+                            (unsigned long long)mqttTrafficGsm.tx, (unsigned long long)mqttTrafficGsm.rx);
+  n = mqttTrafficFamJson(buf, cap, n, mqttTrafficGsm);
+  mqttBulkAppend(buf, cap, n, ",\"month\":%lu,\"used\":%llu,\"budget_mb\":%u,\"level\":%u}",
+                 (unsigned long)gsmUsage.month, (unsigned long long)gsmUsage.bytes,
+                 (unsigned)mqttCfg.gsmBudgetMb, (unsigned)gsmBudgetLevel());
+}
+
+// ================== MQTT: diagnostics <base>/diag ==================
+static const uint32_t MQTT_DIAG_PUB_MS = 60000;  // Ethernet uniquement (pas de coût data GSM)
+static const size_t MQTT_DIAG_MAX = 640;
+
+// {"heap":[libre,min,plus_grand_bloc],"i2c":[ops,retries,fails],"stages":{"http":[n,moy_us,max_us],...}}
+// max_us: pire durée depuis la publication précédente (remis à zéro ici)
+static void mqttDiagJson(char* buf, size_t cap) {
+  size_t n = mqttBulkAppend(buf, cap, 0, "{\"heap\":[%lu,%lu,%lu],\"i2c\":[%lu,%lu,%lu],\"stages\":{",
+                            (unsigned long)ESP.getFreeHeap(), (unsigned long)ESP.getMinFreeHeap(),
+                            (unsigned long)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+                            (unsigned long)(i2cStats.ops[0] + i2cStats.ops[1]),
+                            (unsigned long)(i2cStats.retries[0] + i2cStats.retries[1]),
+                            (unsigned long)(i2cStats.failures[0] + i2cStats.failures[1]));
+  for (uint8_t s = 0; s < MS_COUNT; s++) {
+    StageStat st;
+    metricStageCopy((MetricStage)s, st, true);
+    const uint32_t avg = st.count ? (uint32_t)(st.sumUs / st.count) : 0;
+    n = mqttBulkAppend(buf, cap, n, "%s\"%s\":[%lu,%lu,%lu]", s ? "," : "", METRIC_STAGE_NAMES[s],
+                       (unsigned long)st.count, (unsigned long)avg, (unsigned long)st.winMaxUs);
+  }
+  mqttBulkAppend(buf, cap, n, "}}");
 }
 
 static void mqttPublishStateSnapshot(const String& transport, bool controlOnly) {
   if (!mqttConnectedForTransport(transport)) return;
-  String base = mqttBaseTopic();
-  mqttPublishToTransport(transport, base + "/status", "online", true);
+  const MqttTopics& tp = mqttTopicsGet();
+  char v[16];
+  mqttPublishToTransport(transport, tp.status, "online", true);
   String ip = mqttCurrentIpForTransport(transport);
-  mqttPublishToTransport(transport, base + "/net/ip", ip, mqttCfg.retain);
+  mqttPublishToTransport(transport, tp.netIp, ip.c_str(), mqttCfg.retain, MP_TELEMETRY);
   if (transport == "gsm") lastIpPubGsm = ip;
   else lastIpPubEth = ip;
-  mqttPublishToTransport(transport, base + "/gsm/iccid", gsmLastCcid.length() ? gsmLastCcid : "-", mqttCfg.retain);
+  mqttPublishToTransport(transport, tp.gsmIccid, gsmLastCcid.length() ? gsmLastCcid.c_str() : "-", mqttCfg.retain, MP_TELEMETRY);
 
   if (!controlOnly) {
-    mqttPublishToTransport(transport, base + "/wifi/ap/state", wifiCfg.enabled ? "ON" : "OFF", mqttCfg.retain);
+    mqttPublishToTransport(transport, tp.wifiApState, wifiCfg.enabled ? "ON" : "OFF", mqttCfg.retain);
     lastWifiPub = wifiCfg.enabled;
-    mqttPublishToTransport(transport, base + "/ble/state", bleEnabled ? "ON" : "OFF", mqttCfg.retain);
+    mqttPublishToTransport(transport, tp.bleState, bleEnabled ? "ON" : "OFF", mqttCfg.retain);
     lastBlePub = bleEnabled;
   }
 
+  IoSnapshot snap;
+  ioSnapshotRead(snap);
+  if (mqttBulkFor(transport)) {
+    char bulk[MQTT_BULK_MAX];
+    mqttStateBulkJson(bulk, sizeof(bulk), snap);
+    mqttPublishToTransport(transport, tp.state, bulk, mqttCfg.retain);
+    mqttBulkMark(transport == "gsm" ? mqttBulkGsm : mqttBulkEth, snap, millis());
+  }
+  if (!mqttEntityTopicsFor(transport)) return;
   for (int i = 0; i < totalInputs; i++) {
-    mqttPublishToTransport(transport, base + "/input/" + String(i+1) + "/state", inputs[i] ? "ON" : "OFF", mqttCfg.retain);
-    lastInputsPub[i] = inputs[i];
+    const bool on = snapBit(snap.inputs, i);
+    mqttPublishToTransport(transport, tp.inputState[i], on ? "ON" : "OFF", mqttCfg.retain);
+    lastInputsPub[i] = on;
   }
   for (int i = 0; i < totalInputs; i++) {
-    mqttPublishToTransport(transport, base + "/vin/" + String(i+1) + "/state", virtualInputs[i] ? "ON" : "OFF", mqttCfg.retain);
-    lastVirtualPub[i] = virtualInputs[i];
+    const bool on = snapBit(snap.virtualInputs, i);
+    mqttPublishToTransport(transport, tp.vinState[i], on ? "ON" : "OFF", mqttCfg.retain);
+    lastVirtualPub[i] = on;
   }
   for (int i = 0; i < totalRelays; i++) {
-    mqttPublishToTransport(transport, base + "/relay/" + String(i+1) + "/state", relays[i] ? "ON" : "OFF", mqttCfg.retain);
-    lastRelaysPub[i] = relays[i];
-    mqttPublishToTransport(transport, base + "/relay/" + String(i+1) + "/mode", relayModeText(overrideRelay[i]), mqttCfg.retain);
-    lastRelayModePub[i] = overrideRelay[i];
+    const bool on = snapBit(snap.relays, i);
+    mqttPublishToTransport(transport, tp.relayState[i], on ? "ON" : "OFF", mqttCfg.retain);
+    lastRelaysPub[i] = on;
+    mqttPublishToTransport(transport, tp.relayMode[i], relayModeText(snap.overrideRelay[i]), mqttCfg.retain);
+    lastRelayModePub[i] = snap.overrideRelay[i];
   }
   if (!controlOnly) {
     for (int i = 0; i < totalRelays; i++) {
       String rs = ruleSummaryShort(i);
-      mqttPublishToTransport(transport, base + "/rule/relay/" + String(i+1), rs, mqttCfg.retain);
+      mqttPublishToTransport(transport, tp.rule[i], rs.c_str(), mqttCfg.retain, MP_TELEMETRY);
       lastRulePub[i] = rs;
     }
   }
   for (int s = 0; s < shuttersLimit(); s++) {
     if (!shCfg[s].enabled) continue;
-    const char* st = (shRt[s].move==SH_UP ? "opening" : (shRt[s].move==SH_DOWN ? "closing" : "stopped"));
-    mqttPublishToTransport(transport, base + "/shutter/" + String(s+1) + "/state", String(st), mqttCfg.retain);
-    lastShutterMove[s] = (int)shRt[s].move;
+    const uint8_t mv = snap.shutterMove[s];
+    const char* st = (mv==SH_UP ? "opening" : (mv==SH_DOWN ? "closing" : "stopped"));
+    mqttPublishToTransport(transport, tp.shutterState[s], st, mqttCfg.retain);
+    lastShutterMove[s] = (int)mv;
   }
 
   if (!controlOnly) {
     for (int i = 0; i < tempCount; i++) {
       if (tempC[i] > -100.0f) {
-        mqttPublishToTransport(transport, base + "/temp/" + String(i+1) + "/state", String(tempC[i], 2), mqttCfg.retain);
+        mqttPublishToTransport(transport, tp.tempState[i], (snprintf(v, sizeof(v), "%.2f", tempC[i]), v), mqttCfg.retain, MP_TELEMETRY);
         lastTempPub[i] = tempC[i];
       }
     }
     if (dhtPresent && !isnan(dhtTempC)) {
-      mqttPublishToTransport(transport, base + "/temp/dht/state", String(dhtTempC, 2), mqttCfg.retain);
+      mqttPublishToTransport(transport, tp.dhtTemp, (snprintf(v, sizeof(v), "%.2f", dhtTempC), v), mqttCfg.retain, MP_TELEMETRY);
       lastDhtPub = dhtTempC;
     }
     if (dhtPresent && !isnan(dhtHum)) {
-      mqttPublishToTransport(transport, base + "/hum/dht/state", String(dhtHum, 1), mqttCfg.retain);
+      mqttPublishToTransport(transport, tp.dhtHum, (snprintf(v, sizeof(v), "%.1f", dhtHum), v), mqttCfg.retain, MP_TELEMETRY);
       lastDhtHumPub = dhtHum;
     }
   }
 }
 
-static void mqttHandleMessage(const char* source, char* topic, byte* payload, unsigned int length) {
-  String t = String(topic);
-  String p;
-  bool fastCommand = false;
-  for (unsigned int i = 0; i < length; i++) p += (char)payload[i];
-  p.trim();
-  p.toUpperCase();
-  Serial.printf("[MQTT][%s] RX topic=%s payload=%s\n", source, t.c_str(), p.c_str());
-
-  String base = mqttBaseTopic();
-  if (t.startsWith(base + "/relay/") && t.endsWith("/auto")) {
-    int idx = t.substring((base + "/relay/").length()).toInt();
-    if (idx >= 1 && idx <= totalRelays) {
-      int i = idx - 1;
-      if (!reservedByShutter[i]) {
-        overrideRelay[i] = -1;
-        fastCommand = true;
-      }
+// ================== MQTT: commandes entrantes ==================
+// Topic découpé une fois après la base en (entité, index, verbe) puis distribué
+// par table; le payload est comparé directement sur les octets reçus.
+enum MqttCmdResult : uint8_t { MCR_BAD, MCR_BUSY, MCR_POSTED, MCR_DONE };
+typedef MqttCmdResult (*MqttCmdFn)(int idx, const char* p, size_t n, uint8_t ack);
+
+static bool mqttPayloadIs(const char* p, size_t n, const char* word) {
+  return strlen(word) == n && strncasecmp(p, word, n) == 0;
+}
+
+static MqttCmdResult mqttPosted(bool ok) {
+  return ok ? MCR_POSTED : MCR_BUSY;
+}
+
+static MqttCmdResult mqttCmdRelaySet(int i, const char* p, size_t n, uint8_t ack) {
+  if (i >= totalRelays || reservedByShutter[i]) return MCR_BAD;
+  if (mqttPayloadIs(p, n, "ON")) return mqttPosted(controlPost(CC_OVERRIDE, (uint8_t)i, 1, ack));
+  if (mqttPayloadIs(p, n, "OFF")) return mqttPosted(controlPost(CC_OVERRIDE, (uint8_t)i, 0, ack));
+  if (mqttPayloadIs(p, n, "AUTO")) return mqttPosted(controlPost(CC_OVERRIDE, (uint8_t)i, -1, ack));
+  if (mqttPayloadIs(p, n, "TOGGLE")) return mqttPosted(controlPost(CC_OVERRIDE, (uint8_t)i, CC_TOGGLE, ack));
+  return MCR_BAD;
+}
+
+static MqttCmdResult mqttCmdRelayAuto(int i, const char*, size_t, uint8_t ack) {
+  if (i >= totalRelays || reservedByShutter[i]) return MCR_BAD;
+  return mqttPosted(controlPost(CC_OVERRIDE, (uint8_t)i, -1, ack));
+}
+
+static MqttCmdResult mqttCmdVinSet(int i, const char* p, size_t n, uint8_t ack) {
+  if (i >= totalInputs) return MCR_BAD;
+  if (mqttPayloadIs(p, n, "ON")) return mqttPosted(controlPost(CC_VIN, (uint8_t)i, 1, ack));
+  if (mqttPayloadIs(p, n, "OFF")) return mqttPosted(controlPost(CC_VIN, (uint8_t)i, 0, ack));
+  if (mqttPayloadIs(p, n, "TOGGLE")) return mqttPosted(controlPost(CC_VIN, (uint8_t)i, CC_TOGGLE, ack));
+  return MCR_BAD;
+}
+
+static MqttCmdResult mqttCmdShutterSet(int s, const char* p, size_t n, uint8_t ack) {
+  if (s >= shuttersLimit()) return MCR_BAD;
+  if (mqttPayloadIs(p, n, "OPEN") || mqttPayloadIs(p, n, "UP")) return mqttPosted(controlPost(CC_SHUTTER, (uint8_t)s, MC_UP, ack));
+  if (mqttPayloadIs(p, n, "CLOSE") || mqttPayloadIs(p, n, "DOWN")) return mqttPosted(controlPost(CC_SHUTTER, (uint8_t)s, MC_DOWN, ack));
+  if (mqttPayloadIs(p, n, "STOP")) return mqttPosted(controlPost(CC_SHUTTER, (uint8_t)s, MC_STOP, ack));
+  return MCR_BAD;
+}
+
+static MqttCmdResult mqttCmdWifiApSet(int, const char* p, size_t n, uint8_t) {
+  if (mqttPayloadIs(p, n, "ON")) wifiCfg.enabled = true;
+  else if (mqttPayloadIs(p, n, "OFF")) wifiCfg.enabled = false;
+  else return MCR_BAD;
+  cfgSaveLater(CS_CONFIG);
+  applyWifiCfg();
+  return MCR_DONE;
+}
+
+static MqttCmdResult mqttCmdBleSet(int, const char* p, size_t n, uint8_t) {
+  if (mqttPayloadIs(p, n, "ON")) setBleEnabled(true);
+  else if (mqttPayloadIs(p, n, "OFF")) setBleEnabled(false);
+  else return MCR_BAD;
+  cfgSaveLater(CS_CONFIG);
+  return MCR_DONE;
+}
+
+struct MqttCmdRoute {
+  const char* entity;  // après "<base>/"
+  bool indexed;        // "<entity>/<n>/<verb>" (n >= 1) sinon "<entity>/<verb>"
+  const char* verb;
+  MqttCmdFn fn;
+};
+
+static const MqttCmdRoute MQTT_CMD_ROUTES[] = {
+  {"relay",   true,  "set",  mqttCmdRelaySet},
+  {"relay",   true,  "auto", mqttCmdRelayAuto},
+  {"vin",     true,  "set",  mqttCmdVinSet},
+  {"shutter", true,  "set",  mqttCmdShutterSet},
+  {"wifi/ap", false, "set",  mqttCmdWifiApSet},
+  {"ble",     false, "set",  mqttCmdBleSet},
+};
+
+// "relay/3/set" -> route + index 0-based; nullptr si inconnu
+static const MqttCmdRoute* mqttParseCmdTopic(const char* rest, int& idx) {
+  for (const MqttCmdRoute& r : MQTT_CMD_ROUTES) {
+    const size_t n = strlen(r.entity);
+    if (strncmp(rest, r.entity, n) != 0 || rest[n] != '/') continue;
+    const char* q = rest + n + 1;
+    idx = 0;
+    if (r.indexed) {
+      int v = 0;
+      const char* d = q;
+      while (*q >= '0' && *q <= '9' && v < 1000) v = v * 10 + (*q++ - '0');
+      if (q == d || *q != '/' || v < 1) continue;
+      idx = v - 1;
+      q++;
     }
+    if (strcmp(q, r.verb) == 0) return &r;
   }
-  else if (t == base + "/wifi/ap/set") {
-    if (p == "ON") wifiCfg.enabled = true;
-    else if (p == "OFF") wifiCfg.enabled = false;
-    saveWifiCfg();
-    applyWifiCfg();
-  }
-  else if (t == base + "/ble/set") {
-    if (p == "ON") setBleEnabled(true);
-    else if (p == "OFF") setBleEnabled(false);
-    saveBleCfg();
-  }
-  else if (t.startsWith(base + "/vin/") && t.endsWith("/set")) {
-    int idx = t.substring((base + "/vin/").length()).toInt();
-    if (idx >= 1 && idx <= totalInputs) {
-      int i = idx - 1;
-      if (p == "ON") { virtualInputs[i] = true; fastCommand = true; }
-      else if (p == "OFF") { virtualInputs[i] = false; fastCommand = true; }
-      else if (p == "TOGGLE") { virtualInputs[i] = !virtualInputs[i]; fastCommand = true; }
-    }
-  }
-  else if (t.startsWith(base + "/relay/") && t.endsWith("/set")) {
-    int idx = t.substring((base + "/relay/").length()).toInt();
-    if (idx >= 1 && idx <= totalRelays) {
-      int i = idx - 1;
-      if (!reservedByShutter[i]) {
-        if (p == "ON") { overrideRelay[i] = 1; fastCommand = true; }
-        else if (p == "OFF") { overrideRelay[i] = 0; fastCommand = true; }
-        else if (p == "AUTO") { overrideRelay[i] = -1; fastCommand = true; }
-        else if (p == "TOGGLE") { overrideRelay[i] = (overrideRelay[i] == 1 ? 0 : 1); fastCommand = true; }
-      }
+  return nullptr;
+}
+
+// ================== MQTT: acquittements <base>/ack ==================
+// Chaque commande reçue est acquittée sur le transport d'arrivée:
+// {"id":"<corr>","cmd":"relay/1/set","val":"ON","ok":true,"lat_us":850}
+// "id" = texte après '#' dans le payload ("ON#42"); lat_us = réception -> sorties écrites.
+static const uint32_t MQTT_ACK_TIMEOUT_MS = 2000;
+
+struct MqttAckPending {
+  bool used = false;
+  bool fromGsm = false;
+  uint32_t rxUs = 0;
+  uint32_t rxMs = 0;
+  char id[24];
+  char cmd[32];
+  char val[12];
+};
+
+static MqttAckPending mqttAcks[CONTROL_ACK_SLOTS];
+
+static void mqttAckCopy(char* dst, size_t cap, const char* src, size_t n) {
+  size_t k = 0;
+  for (size_t i = 0; i < n && k + 1 < cap; i++) {
+    const char c = src[i];
+    if (isalnum((unsigned char)c) || c == '/' || c == '_' || c == '-' || c == '.' || c == ':') dst[k++] = c;
+  }
+  dst[k] = '\0';
+}
+
+// reason: "error" si !ok, "note" sinon (ex. duplicate)
+static void mqttAckPublish(const MqttAckPending& a, bool ok, const char* reason, int32_t latUs) {
+  char buf[160];
+  int n = snprintf(buf, sizeof(buf), "{\"id\":\"%s\",\"cmd\":\"%s\",\"val\":\"%s\",\"ok\":%s",
+                   a.id, a.cmd, a.val, ok ? "true" : "false");
+  if (n < 0 || n >= (int)sizeof(buf)) return;
+  if (reason) n += snprintf(buf + n, sizeof(buf) - n, ",\"%s\":\"%s\"}", ok ? "note" : "error", reason);
+  else if (latUs >= 0) n += snprintf(buf + n, sizeof(buf) - n, ",\"lat_us\":%ld}", (long)latUs);
+  else n += snprintf(buf + n, sizeof(buf) - n, "}");
+  mqttPublishToClient(a.fromGsm ? mqttClientGsm : mqttClientEth, mqttTopicsGet().ack, buf, false, MP_ACK);
+}
+
+// Acquittements en attente de la tâche contrôle (appelé par mqttLoop)
+static void mqttAckPoll() {
+  for (uint8_t k = 0; k < CONTROL_ACK_SLOTS; k++) {
+    MqttAckPending& a = mqttAcks[k];
+    if (!a.used) continue;
+    const uint32_t w = __atomic_load_n(&controlAckWord[k], __ATOMIC_ACQUIRE);
+    if (w && (uint8_t)(w >> 24) == controlAckGen[k]) {
+      const int32_t latUs = (int32_t)(((w & CONTROL_ACK_US_MASK) - a.rxUs) & CONTROL_ACK_US_MASK);
+      if (w & CONTROL_ACK_OK) mqttAckPublish(a, true, nullptr, latUs);
+      else mqttAckPublish(a, false, "write", -1);
+      a.used = false;
+    } else if (millis() - a.rxMs > MQTT_ACK_TIMEOUT_MS) {
+      mqttAckPublish(a, false, "timeout", -1);
+      a.used = false;
     }
-  } else if (t.startsWith(base + "/shutter/") && t.endsWith("/set")) {
-    int idx = t.substring((base + "/shutter/").length()).toInt();
-    if (idx >= 1 && idx <= shuttersLimit()) {
-      int s = idx - 1;
-      if (p == "OPEN" || p == "UP") { shRt[s].manual = MC_UP; fastCommand = true; }
-      else if (p == "CLOSE" || p == "DOWN") { shRt[s].manual = MC_DOWN; fastCommand = true; }
-      else if (p == "STOP") { shRt[s].manual = MC_STOP; fastCommand = true; }
+  }
+}
+
+// QoS 1 = "au moins une fois": une commande réémise (même cmd + même id) n'est
+// exécutée qu'une fois (TOGGLE!), elle est seulement réacquittée. Sans id, rien ne
+// distingue une réémission de deux appuis rapides: pas de déduplication (cf. APP_API).
+static const uint8_t MQTT_DEDUP_SLOTS = 8;
+static const uint32_t MQTT_DEDUP_WINDOW_MS = 30000;
+
+struct MqttSeenCmd {
+  uint32_t hash = 0;
+  uint32_t ms = 0;
+};
+
+static MqttSeenCmd mqttSeen[MQTT_DEDUP_SLOTS];
+static uint8_t mqttSeenNext = 0;
+
+static bool mqttCmdSeen(const MqttAckPending& a) {
+  if (!a.id[0]) return false;
+  uint32_t h = fnv1a(2166136261u, a.cmd, strlen(a.cmd) + 1);
+  h = fnv1a(h, a.id, strlen(a.id));
+  const uint32_t now = millis();
+  for (const MqttSeenCmd& e : mqttSeen) {
+    if (e.hash == h && now - e.ms < MQTT_DEDUP_WINDOW_MS) return true;
+  }
+  mqttSeen[mqttSeenNext] = {h, now};
+  mqttSeenNext = (uint8_t)((mqttSeenNext + 1) % MQTT_DEDUP_SLOTS);
+  return false;
+}
+
+static uint8_t mqttAckAlloc() {
+  for (uint8_t k = 0; k < CONTROL_ACK_SLOTS; k++) {
+    if (mqttAcks[k].used) continue;
+    mqttAcks[k].used = true;
+    uint8_t gen = (uint8_t)(controlAckGen[k] + 1);
+    controlAckGen[k] = gen ? gen : 1; // jamais 0: un mot nul = pas encore appliquée
+    __atomic_store_n(&controlAckWord[k], 0u, __ATOMIC_RELEASE);
+    return k;
+  }
+  return CONTROL_NO_ACK;
+}
+
+static void mqttHandleMessage(const char* source, char* topic, byte* payload, unsigned int length) {
+  const uint32_t rxUs = micros();
+  const char* p = (const char*)payload;
+  size_t n = length;
+  while (n > 0 && isspace((unsigned char)*p)) { p++; n--; }
+  while (n > 0 && isspace((unsigned char)p[n - 1])) n--;
+  Serial.printf("[MQTT][%s] RX topic=%s payload=%.*s\n", source, topic, (int)n, p);
+  {
+    MqttTraffic& tr = (strcmp(source, "GSM") == 0) ? mqttTrafficGsm : mqttTrafficEth;
+    const MqttTopics& tp = mqttTopicsGet();
+    const bool own = strncmp(topic, tp.base, tp.baseLen) == 0 && topic[tp.baseLen] == '/';
+    tr.famRx[own ? MF_CMD : MF_SYS] += mqttPublishLen(strlen(topic), length, 1);
+    tr.msgRx++;
+  }
+
+  const size_t pl = mqttCfg.discoveryPrefix.length();
+  if (strncmp(topic, mqttCfg.discoveryPrefix.c_str(), pl) == 0 && strcmp(topic + pl, "/status") == 0) {
+    if (mqttPayloadIs(p, n, "online")) {
+      mqttDiscHash = 0;
+      mqttDiscoveryRestart();
+      // HA relit les états retenus: ne rien supposer de ce que le broker a gardé
+      mqttViewClear(mqttViewEth);
+      mqttViewClear(mqttViewGsm);
+      if (mqttEthConnectedSafe()) mqttPublishStateSnapshot("ethernet", false);
+      if (mqttGsmConnectedSafe() && !mqttGsmStandby()) mqttPublishStateSnapshot("gsm", true);
     }
+    return;
+  }
+
+  const MqttTopics& tp = mqttTopicsGet();
+  if (strncmp(topic, tp.base, tp.baseLen) != 0 || topic[tp.baseLen] != '/') return;
+  const char* rest = topic + tp.baseLen + 1;
+  int idx = 0;
+  const MqttCmdRoute* r = mqttParseCmdTopic(rest, idx);
+  if (!r) return;
+
+  // "ON#42": identifiant de corrélation renvoyé dans l'acquittement
+  const char* corr = (const char*)memchr(p, '#', n);
+  const size_t corrLen = corr ? (size_t)(p + n - corr - 1) : 0;
+  if (corr) {
+    n = (size_t)(corr - p);
+    while (n > 0 && isspace((unsigned char)p[n - 1])) n--;
+  }
+
+  MqttAckPending local;
+  const uint8_t ack = mqttAckAlloc();
+  MqttAckPending& a = (ack == CONTROL_NO_ACK) ? local : mqttAcks[ack];
+  a.fromGsm = strcmp(source, "GSM") == 0;
+  a.rxUs = rxUs;
+  a.rxMs = millis();
+  mqttAckCopy(a.id, sizeof(a.id), corr ? corr + 1 : "", corrLen);
+  mqttAckCopy(a.cmd, sizeof(a.cmd), rest, strlen(rest));
+  mqttAckCopy(a.val, sizeof(a.val), p, n);
+
+  if (mqttCmdSeen(a)) {
+    mqttAckPublish(a, true, "duplicate", -1);
+    if (ack != CONTROL_NO_ACK) mqttAcks[ack].used = false;
+    return;
   }
-  if (fastCommand) {
+
+  const MqttCmdResult res = r->fn(idx, p, n, ack);
+  if (res == MCR_POSTED) {
+    // appliqué par la tâche contrôle au prochain cycle (<= CONTROL_PERIOD_MS)
     mqttFastCommandPending = true;
     mqttFastModeUntilMs = millis() + 700;
+    if (ack != CONTROL_NO_ACK) return; // acquitté par mqttAckPoll
+    mqttAckPublish(a, true, nullptr, -1);
+  } else if (res == MCR_DONE) {
+    mqttAckPublish(a, true, nullptr, (int32_t)(micros() - rxUs));
+  } else {
+    mqttAckPublish(a, false, res == MCR_BUSY ? "busy" : "rejected", -1);
   }
+  if (ack != CONTROL_NO_ACK) mqttAcks[ack].used = false;
 }
 
 static void mqttCallbackEth(char* topic, byte* payload, unsigned int length) {
@@ -2247,22 +4836,26 @@ static void mqttSetup() {
   mqttClientGsm.setSocketTimeout(MQTT_SOCKET_TIMEOUT_SECONDS);
   mqttClientEth.setCallback(mqttCallbackEth);
   mqttClientGsm.setCallback(mqttCallbackGsm);
+  mqttOutboxInit();
 }
 
+// Commandes en QoS 1: le broker réémet tant que le PUBACK n'est pas reçu
 static void mqttSubscribeTopics(PubSubClient &client) {
-  String base = mqttBaseTopic();
-  for (int i = 1; i <= totalRelays; i++) {
-    client.subscribe((base + "/relay/" + String(i) + "/set").c_str());
-    client.subscribe((base + "/relay/" + String(i) + "/auto").c_str());
+  const MqttTopics& tp = mqttTopicsGet();
+  for (int i = 0; i < totalRelays; i++) {
+    client.subscribe(tp.relaySet[i], 1);
+    client.subscribe(tp.relayAuto[i], 1);
   }
-  client.subscribe((base + "/wifi/ap/set").c_str());
-  client.subscribe((base + "/ble/set").c_str());
-  for (int i = 1; i <= totalInputs; i++) {
-    client.subscribe((base + "/vin/" + String(i) + "/set").c_str());
+  client.subscribe(tp.wifiApSet, 1);
+  client.subscribe(tp.bleSet, 1);
+  for (int i = 0; i < totalInputs; i++) {
+    client.subscribe(tp.vinSet[i], 1);
   }
-  for (int s = 1; s <= shuttersLimit(); s++) {
-    client.subscribe((base + "/shutter/" + String(s) + "/set").c_str());
+  for (int s = 0; s < shuttersLimit(); s++) {
+    client.subscribe(tp.shutterSet[s], 1);
   }
+  // message "birth" de Home Assistant: republie la discovery après un redémarrage HA
+  client.subscribe((mqttCfg.discoveryPrefix + "/status").c_str());
 }
 
 static String mqttClientIdForTransport(const String& transport) {
@@ -2294,7 +4887,7 @@ static bool mqttTryConnectTransport(const String& transport) {
     if (now - mqttLastConnectGsmMs < 3000) return false;
     mqttLastConnectGsmMs = now;
   } else {
-    if (now - mqttLastConnectEthMs < 3000) return false;
+    if (now - mqttLastConnectEthMs < MQTT_ETH_RETRY_MIN_MS) return false;
     mqttLastConnectEthMs = now;
   }
 
@@ -2317,14 +4910,14 @@ static bool mqttTryConnectTransport(const String& transport) {
         return false;
       }
     }
-    if (!gsmEnsureData()) {
-      Serial.println("[MQTT][GSM] skip connect: 1NCE not ready");
+    if (gsmLink.stage != GS_READY || !gsmDataReady) {
+      Serial.printf("[MQTT][GSM] skip connect: 1NCE not ready (%s)\n", gsmStageName(gsmLink.stage));
       return false;
     }
   }
 
   mqttApplyServerForTransport(transport);
-  String willTopic = mqttBaseTopic() + "/status";
+  const char* willTopic = mqttTopicsGet().status;
 
   const char* mqttHost = mqttHostForTransport(transport);
   uint16_t mqttPort = mqttPortForTransport(transport);
@@ -2343,9 +4936,9 @@ static bool mqttTryConnectTransport(const String& transport) {
   bool ok = false;
   if (mqttUser.length() > 0) {
     ok = client->connect(clientId.c_str(), mqttUser.c_str(), mqttPass.c_str(),
-                         willTopic.c_str(), 0, true, "offline");
+                         willTopic, 0, true, "offline");
   } else {
-    ok = client->connect(clientId.c_str(), willTopic.c_str(), 0, true, "offline");
+    ok = client->connect(clientId.c_str(), willTopic, 0, true, "offline");
   }
 
   if (ok) {
@@ -2357,7 +4950,11 @@ static bool mqttTryConnectTransport(const String& transport) {
       mqttLastEthFailMs = 0;
       mqttLastEthFailRc = 0;
       mqttEthAuthBlocked = false;
+      mqttEthRetryMs = MQTT_ETH_RETRY_MIN_MS;
+      mqttEthHealth.pingSentMs = 0;
+      mqttTrafficEth.lastRxMs = millis();
     }
+    mqttViewOnConnect(*client);
     mqttSubscribeTopics(*client);
     if (mqttLowDataTransport(transport)) {
       Serial.println("[MQTT][GSM] low-data mode: publish control state only");
@@ -2368,18 +4965,21 @@ static bool mqttTryConnectTransport(const String& transport) {
       }
     } else {
       mqttPublishStateSnapshot(transport, false);
-      mqttPublishDiscovery(transport);
+      mqttDiscoveryStart(transport);
     }
     return true;
   }
 
   if (transport == "gsm" && !modem.isGprsConnected()) {
     gsmDataReady = false;
+    gsmLastDataConnected = false;
+    gsmEnter(GS_PDP); // réactive le contexte PDP en tâche de fond
   }
   if (transport == "gsm") gsmDebug1nce("mqtt_connect_fail", true);
   int rc = client->state();
   if (transport == "ethernet") {
     mqttEth.stop(); // release W5500 socket immediately on failed MQTT connect
+    if (mqttLastEthFailMs != 0) mqttEthRetryMs = min(MQTT_ETH_RETRY_MAX_MS, mqttEthRetryMs * 2);
     mqttLastEthFailMs = millis();
     mqttLastEthFailRc = rc;
     if (rc == 4 || rc == 5) {
@@ -2437,12 +5037,29 @@ static void mqttLoop() {
     gsmConn = false;
   }
 
+  if (mqttTransportAllowsEthernet()) mqttEthProbe();
   mqttEnsureConnected();
   ethConn = mqttEthConnectedSafe();
   gsmConn = mqttGsmConnectedSafe();
   if (ethConn) mqttClientEth.loop();
   if (gsmConn) mqttClientGsm.loop();
 
+  // Bascule: le GSM quitte la veille et n'envoie que ce que son broker n'a pas déjà.
+  static bool gsmStandbyLast = false;
+  const bool gsmStandby = mqttGsmStandby();
+  if (gsmStandbyLast && !gsmStandby && gsmConn) {
+    mqttEthHealth.failovers++;
+    mqttViewForgetUnacked(mqttViewEth); // vue partagée: ne pas sauter ce que l'Ethernet a perdu
+    Serial.println("[MQTT] failover ETH -> GSM (delta)");
+    mqttPublishStateSnapshot("gsm", true);
+  }
+  gsmStandbyLast = gsmStandby;
+  if (!mqttTransportAllowsGsm() && mqttOutGsm.count > 0) mqttOutboxClear(mqttOutGsm);
+  mqttAckPoll();
+  mqttOutboxDrain(mqttOutEth, mqttClientEth, ethConn);
+  mqttOutboxDrain(mqttOutGsm, mqttClientGsm, gsmConn);
+  gsmUsageTick();
+
   if (mqttTransportAllowsGsm()) {
     gsmDebug1nce(gsmConn ? "loop" : "mqtt_disconnected", false);
   }
@@ -2452,33 +5069,35 @@ static void mqttLoop() {
 
   if (!ethConn && !gsmConn) return;
 
-  if (ethConn && !mqttAnnouncedEth) {
-    mqttPublishDiscovery("ethernet");
+  if (ethConn && !mqttAnnouncedEth && !mqttDisc.active) {
+    mqttDiscoveryStart("ethernet");
   }
+  mqttDiscoveryTick();
 
-  String base = mqttBaseTopic();
+  const MqttTopics& tp = mqttTopicsGet();
+  char v[16];
   if (ethConn) {
     String ipEth = mqttCurrentIpForTransport("ethernet");
     if(ipEth != lastIpPubEth){
-      mqttPublishToTransport("ethernet", base + "/net/ip", ipEth, mqttCfg.retain);
+      mqttPublishToTransport("ethernet", tp.netIp, ipEth.c_str(), mqttCfg.retain, MP_TELEMETRY);
       lastIpPubEth = ipEth;
     }
   }
   if (gsmConn) {
     String ipGsm = mqttCurrentIpForTransport("gsm");
     if(ipGsm != lastIpPubGsm){
-      mqttPublishToTransport("gsm", base + "/net/ip", ipGsm, mqttCfg.retain);
+      mqttPublishToTransport("gsm", tp.netIp, ipGsm.c_str(), mqttCfg.retain, MP_TELEMETRY);
       lastIpPubGsm = ipGsm;
     }
   }
 
   if (ethConn) {
     if(wifiCfg.enabled != lastWifiPub){
-      mqttPublishEthernetOnly(base + "/wifi/ap/state", wifiCfg.enabled ? "ON" : "OFF", mqttCfg.retain);
+      mqttPublishEthernetOnly(tp.wifiApState, wifiCfg.enabled ? "ON" : "OFF", mqttCfg.retain);
       lastWifiPub = wifiCfg.enabled;
     }
     if(bleEnabled != lastBlePub){
-      mqttPublishEthernetOnly(base + "/ble/state", bleEnabled ? "ON" : "OFF", mqttCfg.retain);
+      mqttPublishEthernetOnly(tp.bleState, bleEnabled ? "ON" : "OFF", mqttCfg.retain);
       lastBlePub = bleEnabled;
     }
   }
@@ -2490,60 +5109,99 @@ static void mqttLoop() {
     for (int i = 0; i < totalRelays; i++) {
       String rs = ruleSummaryShort(i);
       if(rs != lastRulePub[i]){
-        mqttPublishEthernetOnly(base + "/rule/relay/" + String(i+1), rs, mqttCfg.retain);
+        mqttPublishEthernetOnly(tp.rule[i], rs.c_str(), mqttCfg.retain, MP_TELEMETRY);
         lastRulePub[i] = rs;
       }
     }
   }
+  IoSnapshot snap;
+  ioSnapshotRead(snap);
   for (int i = 0; i < totalInputs; i++) {
-    if (inputs[i] != lastInputsPub[i]) {
-      mqttPublish(base + "/input/" + String(i+1) + "/state", inputs[i] ? "ON" : "OFF", mqttCfg.retain);
-      lastInputsPub[i] = inputs[i];
+    const bool on = snapBit(snap.inputs, i);
+    if (on != lastInputsPub[i]) {
+      mqttPublishEntity(tp.inputState[i], on ? "ON" : "OFF", mqttCfg.retain);
+      lastInputsPub[i] = on;
     }
   }
   for (int i = 0; i < totalInputs; i++) {
-    if (virtualInputs[i] != lastVirtualPub[i]) {
-      mqttPublish(base + "/vin/" + String(i+1) + "/state", virtualInputs[i] ? "ON" : "OFF", mqttCfg.retain);
-      lastVirtualPub[i] = virtualInputs[i];
+    const bool on = snapBit(snap.virtualInputs, i);
+    if (on != lastVirtualPub[i]) {
+      mqttPublishEntity(tp.vinState[i], on ? "ON" : "OFF", mqttCfg.retain);
+      lastVirtualPub[i] = on;
     }
   }
   for (int i = 0; i < totalRelays; i++) {
-    if (relays[i] != lastRelaysPub[i]) {
-      mqttPublish(base + "/relay/" + String(i+1) + "/state", relays[i] ? "ON" : "OFF", mqttCfg.retain);
-      lastRelaysPub[i] = relays[i];
+    const bool on = snapBit(snap.relays, i);
+    if (on != lastRelaysPub[i]) {
+      mqttPublishEntity(tp.relayState[i], on ? "ON" : "OFF", mqttCfg.retain);
+      lastRelaysPub[i] = on;
     }
-    if (overrideRelay[i] != lastRelayModePub[i]) {
-      mqttPublish(base + "/relay/" + String(i+1) + "/mode", relayModeText(overrideRelay[i]), mqttCfg.retain);
-      lastRelayModePub[i] = overrideRelay[i];
+    if (snap.overrideRelay[i] != lastRelayModePub[i]) {
+      mqttPublishEntity(tp.relayMode[i], relayModeText(snap.overrideRelay[i]), mqttCfg.retain);
+      lastRelayModePub[i] = snap.overrideRelay[i];
     }
   }
 
   for (int s = 0; s < shuttersLimit(); s++) {
     if (!shCfg[s].enabled) continue;
-    if ((int)shRt[s].move != lastShutterMove[s]) {
-      const char* st = (shRt[s].move==SH_UP ? "opening" : (shRt[s].move==SH_DOWN ? "closing" : "stopped"));
-      mqttPublish(base + "/shutter/" + String(s+1) + "/state", String(st), mqttCfg.retain);
-      lastShutterMove[s] = (int)shRt[s].move;
+    const uint8_t mv = snap.shutterMove[s];
+    if ((int)mv != lastShutterMove[s]) {
+      const char* st = (mv==SH_UP ? "opening" : (mv==SH_DOWN ? "closing" : "stopped"));
+      mqttPublishEntity(tp.shutterState[s], st, mqttCfg.retain);
+      lastShutterMove[s] = (int)mv;
+    }
+  }
+
+  {
+    char bulk[MQTT_BULK_MAX];
+    bool built = false;
+    if (ethConn && mqttBulkFor("ethernet")) mqttBulkTick(mqttBulkEth, mqttClientEth, snap, now, bulk, built);
+    if (gsmConn && !gsmStandby && mqttBulkFor("gsm")) mqttBulkTick(mqttBulkGsm, mqttClientGsm, snap, now, bulk, built);
+  }
+
+  static uint32_t lastTrafficEthMs = 0;
+  static uint32_t lastTrafficGsmMs = 0;
+  const bool trafficEth = ethConn && (now - lastTrafficEthMs >= MQTT_TRAFFIC_PUB_MS);
+  const bool trafficGsm = gsmConn && !mqttCfg.gsmBulkOnly &&
+                          (now - lastTrafficGsmMs >= MQTT_TRAFFIC_GSM_PUB_MS * GSM_INTERVAL_X[gsmBudgetLevel()]);
+  if (trafficEth || trafficGsm) {
+    char traffic[MQTT_TRAFFIC_MAX];
+    mqttTrafficJson(traffic, sizeof(traffic));
+    if (trafficEth) {
+      mqttPublishToClient(mqttClientEth, tp.traffic, traffic, false, MP_TELEMETRY);
+      lastTrafficEthMs = now;
     }
+    if (trafficGsm) {
+      mqttPublishToClient(mqttClientGsm, tp.traffic, traffic, false, MP_TELEMETRY);
+      lastTrafficGsmMs = now;
+    }
+  }
+
+  static uint32_t lastDiagMs = 0;
+  if (ethConn && now - lastDiagMs >= MQTT_DIAG_PUB_MS) {
+    char diag[MQTT_DIAG_MAX];
+    mqttDiagJson(diag, sizeof(diag));
+    mqttPublishToClient(mqttClientEth, tp.diag, diag, false, MP_TELEMETRY);
+    lastDiagMs = now;
   }
 
   if (ethConn) {
     for (int i = 0; i < tempCount; i++) {
       if (fabs(tempC[i] - lastTempPub[i]) >= 0.1f) {
-        mqttPublishEthernetOnly(base + "/temp/" + String(i+1) + "/state", String(tempC[i], 2), mqttCfg.retain);
+        mqttPublishEthernetOnly(tp.tempState[i], (snprintf(v, sizeof(v), "%.2f", tempC[i]), v), mqttCfg.retain, MP_TELEMETRY);
         lastTempPub[i] = tempC[i];
       }
     }
 
     if (dhtPresent && !isnan(dhtTempC)) {
       if (isnan(lastDhtPub) || fabs(dhtTempC - lastDhtPub) >= 0.1f) {
-        mqttPublishEthernetOnly(base + "/temp/dht/state", String(dhtTempC, 2), mqttCfg.retain);
+        mqttPublishEthernetOnly(tp.dhtTemp, (snprintf(v, sizeof(v), "%.2f", dhtTempC), v), mqttCfg.retain, MP_TELEMETRY);
         lastDhtPub = dhtTempC;
       }
     }
     if (dhtPresent && !isnan(dhtHum)) {
       if (isnan(lastDhtHumPub) || fabs(dhtHum - lastDhtHumPub) >= 0.5f) {
-        mqttPublishEthernetOnly(base + "/hum/dht/state", String(dhtHum, 1), mqttCfg.retain);
+        mqttPublishEthernetOnly(tp.dhtHum, (snprintf(v, sizeof(v), "%.1f", dhtHum), v), mqttCfg.retain, MP_TELEMETRY);
         lastDhtHumPub = dhtHum;
       }
     }
@@ -2559,12 +5217,17 @@ static void clearReservations() {
   for(int i=0;i<MAX_RELAYS;i++) reservedByShutter[i] = false;
 }
 
+static uint16_t shutterInputMask = 0;
+
 static void applyReservationsFromConfig() {
   clearReservations();
+  shutterInputMask = 0;
   for (int s = 0; s < shuttersLimit(); s++) {
     if(!shCfg[s].enabled) continue;
     if(inRangeRelay(shCfg[s].up_relay)) reservedByShutter[shCfg[s].up_relay-1] = true;
     if(inRangeRelay(shCfg[s].down_relay)) reservedByShutter[shCfg[s].down_relay-1] = true;
+    if(inRangeInput(shCfg[s].up_in)) shutterInputMask |= (uint16_t)(1u << (shCfg[s].up_in-1));
+    if(inRangeInput(shCfg[s].down_in)) shutterInputMask |= (uint16_t)(1u << (shCfg[s].down_in-1));
   }
 }
 
@@ -2781,9 +5444,20 @@ static void shutterTick() {
   for(int i=0;i<MAX_RELAYS;i++) relayFromShutter[i] = false;
   for(int s=0; s<shuttersLimit(); s++){
     shutterTickOne(s);
+    shRt[s].cooldownWake = (millis() < shRt[s].cooldownUntilMs);
   }
 }
 
+static bool shutterTimersDue(uint32_t now) {
+  for(int s=0; s<shuttersLimit(); s++){
+    if(!shCfg[s].enabled) continue;
+    if(shRt[s].cooldownWake && (int32_t)(now - shRt[s].cooldownUntilMs) >= 0) return true;
+    if(shCfg[s].max_run_ms > 0 && shRt[s].move != SH_STOP &&
+       now - shRt[s].moveStartMs >= shCfg[s].max_run_ms) return true;
+  }
+  return false;
+}
+
 // ===============================================================
 // Simple rules engine
 // ===============================================================
@@ -2806,81 +5480,108 @@ static bool applyDelays(int i, bool desired, uint32_t onDelay, uint32_t offDelay
     return desired;
   }
 
-  if(millis() >= pendingDeadlineMs[i]){
+  if((int32_t)(millis() - pendingDeadlineMs[i]) >= 0){ // sûr au rebouclage de millis()
     hasPending[i] = false;
     return desired;
   }
   return relayFromSimple[i];
 }
 
-static bool evalExprSimple(int relayIndex, JsonObject expr, uint32_t rulePulseMs) {
-  const char* op = expr["op"] | "FOLLOW";
+// Règles compilées (include/rules_compiled.h): table POD évaluée par masques
+static CompiledRule compiledRules[MAX_RELAYS];
+static uint8_t compiledRuleCount = 0;
+// index de dépendances: entrée -> relais dont la règle la lit
+static uint16_t ruleDependents[MAX_INPUTS] = {0};
+// relais avec un délai ou une impulsion en cours, et leur échéance
+static uint16_t ruleTimerMask = 0;
+static uint32_t ruleTimerDeadlineMs[MAX_RELAYS] = {0};
+static uint16_t combinedInputMask = 0;
+static uint16_t prevCombinedInputMask = 0;
 
-  if(strcmp(op, "NONE")==0){
-    return false;
-  }
-  if(strcmp(op, "FOLLOW")==0){
-    int in = expr["in"] | 1;
-    return getInputN(in);
+static void compileRulesFromDoc() {
+  JsonArray rel = rulesDoc["relays"].as<JsonArray>();
+  uint8_t count = 0;
+  if(rel){
+    count = (rel.size() < totalRelays) ? (uint8_t)rel.size() : totalRelays;
   }
-  if(strcmp(op, "AND")==0 || strcmp(op,"OR")==0 || strcmp(op,"XOR")==0){
-    JsonArray ins = expr["ins"].as<JsonArray>();
-    if(!ins || ins.size()==0) return false;
-    bool acc = (strcmp(op,"AND")==0) ? true : false;
-    bool x = false;
-    for(JsonVariant v : ins){
-      int in = (int)v;
-      bool b = getInputN(in);
-      if(strcmp(op,"AND")==0) acc &= b;
-      else if(strcmp(op,"OR")==0) acc |= b;
-      else x ^= b;
-    }
-    return (strcmp(op,"XOR")==0) ? x : acc;
-  }
-  if(strcmp(op,"TOGGLE_RISE")==0){
-    int in = expr["in"] | 1;
-    bool thisRise = false;
-    if(in>=1 && in<=totalInputs){
-      thisRise = (combinedInputs[in-1] && !prevCombinedInputs[in-1]);
+  for(int i=0;i<MAX_RELAYS;i++){
+    if(i < count) compileRule(rel[i].as<JsonObject>(), compiledRules[i], totalInputs);
+    else {
+      compiledRules[i] = CompiledRule();
+      compiledRules[i].in = RULE_NO_INPUT;
     }
-    if(thisRise) toggleState[relayIndex] = !toggleState[relayIndex];
-    return toggleState[relayIndex];
   }
-  if(strcmp(op,"PULSE_RISE")==0){
-    int in = expr["in"] | 1;
-    uint32_t pulseMs = expr["pulseMs"] | rulePulseMs;
-    if(pulseMs == 0) pulseMs = 1;
-    bool thisRise = false;
-    if(in>=1 && in<=totalInputs){
-      thisRise = (combinedInputs[in-1] && !prevCombinedInputs[in-1]);
-    }
-    if(thisRise){
-      pulseUntilMs[relayIndex] = millis() + pulseMs;
+  compiledRuleCount = count;
+
+  for(int k=0;k<MAX_INPUTS;k++) ruleDependents[k] = 0;
+  for(int i=0;i<count;i++){
+    const CompiledRule &r = compiledRules[i];
+    uint16_t deps = r.inMask;
+    if(r.in != RULE_NO_INPUT) deps |= (uint16_t)(1u << r.in);
+    for(int k=0;k<MAX_INPUTS;k++){
+      if((deps >> k) & 1u) ruleDependents[k] |= (uint16_t)(1u << i);
     }
-    return (millis() < pulseUntilMs[relayIndex]);
   }
+  ruleTimerMask = 0;
+  controlMarkDirty();
+}
 
-  return false;
+static void updateCombinedInputMasks() {
+  uint16_t cur = 0;
+  uint16_t prev = 0;
+  for(int i=0;i<totalInputs;i++){
+    if(combinedInputs[i]) cur |= (uint16_t)(1u << i);
+    if(prevCombinedInputs[i]) prev |= (uint16_t)(1u << i);
+  }
+  combinedInputMask = cur;
+  prevCombinedInputMask = prev;
 }
 
-static void evalSimpleRules() {
-  JsonArray rel = rulesDoc["relays"].as<JsonArray>();
-  for(int i=0;i<totalRelays;i++){
-    bool desired = false;
+static bool evalCompiledRule(int relayIndex, const CompiledRule &r, uint16_t cur, uint16_t rise) {
+  return ruleEvalExpr(r, cur, rise, millis(), toggleState[relayIndex], pulseUntilMs[relayIndex]);
+}
 
-    if(rel && i < (int)rel.size()){
-      JsonObject r = rel[i].as<JsonObject>();
-      JsonObject expr = r["expr"].as<JsonObject>();
-      uint32_t pulseMs = r["pulseMs"] | 200;
-      desired = evalExprSimple(i, expr, pulseMs);
+static void armRuleTimer(int i, const CompiledRule &r) {
+  const uint16_t bit = (uint16_t)(1u << i);
+  if(hasPending[i]){
+    ruleTimerDeadlineMs[i] = pendingDeadlineMs[i];
+    ruleTimerMask |= bit;
+    // impulsion + délai: se réveiller à la première des deux échéances
+    if(r.op == RULE_PULSE_RISE && millis() < pulseUntilMs[i] &&
+       (int32_t)(pulseUntilMs[i] - pendingDeadlineMs[i]) < 0){
+      ruleTimerDeadlineMs[i] = pulseUntilMs[i];
+    }
+  } else if(r.op == RULE_PULSE_RISE && millis() < pulseUntilMs[i]){
+    ruleTimerDeadlineMs[i] = pulseUntilMs[i];
+    ruleTimerMask |= bit;
+  } else {
+    ruleTimerMask &= (uint16_t)~bit;
+  }
+}
 
-      bool inv = r["invert"] | false;
-      if(inv) desired = !desired;
+static uint16_t ruleTimersDue(uint32_t now) {
+  uint16_t due = 0;
+  for(int i=0;i<totalRelays;i++){
+    if(!((ruleTimerMask >> i) & 1u)) continue;
+    if((int32_t)(now - ruleTimerDeadlineMs[i]) >= 0) due |= (uint16_t)(1u << i);
+  }
+  return due;
+}
 
-      uint32_t onD  = r["onDelay"] | 0;
-      uint32_t offD = r["offDelay"] | 0;
+// relayMask: relais à réévaluer (les autres gardent relayFromSimple)
+static void evalSimpleRules(uint16_t relayMask) {
+  const uint16_t cur = combinedInputMask;
+  const uint16_t rise = combinedInputMask & (uint16_t)~prevCombinedInputMask;
+  for(int i=0;i<totalRelays;i++){
+    if(!((relayMask >> i) & 1u)) continue;
+    bool desired = false;
 
-      desired = applyDelays(i, desired, onD, offD);
+    if(i < compiledRuleCount){
+      const CompiledRule &r = compiledRules[i];
+      desired = evalCompiledRule(i, r, cur, rise);
+      if(r.invert) desired = !desired;
+      desired = applyDelays(i, desired, r.onDelay, r.offDelay);
+      armRuleTimer(i, r);
     }
 
     relayFromSimple[i] = desired;
@@ -2907,40 +5608,172 @@ static void buildFinalRelays() {
     relays[i] = (overrideRelay[i] == 1);
   }
 
-  // 4) final safety (absolute): if shutter relays both ON => STOP both
-  for(int s=0; s<shuttersLimit(); s++){
-    if(!shCfg[s].enabled) continue;
-    bool up = relays[shCfg[s].up_relay-1];
-    bool dn = relays[shCfg[s].down_relay-1];
-    if(up && dn){
-      relays[shCfg[s].up_relay-1] = false;
-      relays[shCfg[s].down_relay-1] = false;
+  // 4) final safety (absolute): if shutter relays both ON => STOP both
+  for(int s=0; s<shuttersLimit(); s++){
+    if(!shCfg[s].enabled) continue;
+    bool up = relays[shCfg[s].up_relay-1];
+    bool dn = relays[shCfg[s].down_relay-1];
+    if(up && dn){
+      relays[shCfg[s].up_relay-1] = false;
+      relays[shCfg[s].down_relay-1] = false;
+    }
+  }
+
+}
+
+// Pipeline volet -> règles -> sorties, uniquement pour ce qui a changé.
+// force: commande rapide (MQTT) à appliquer tout de suite.
+static void controlTick(bool force) {
+  const uint32_t now = millis();
+  updateCombinedInputMasks();
+  const uint16_t changed = combinedInputMask ^ prevCombinedInputMask;
+  const bool full = force || controlDirty || (now - controlLastFullEvalMs >= CONTROL_FULL_EVAL_MS);
+
+  uint16_t evalRelays = full ? (uint16_t)0xFFFF : ruleTimersDue(now);
+  for(int k=0;k<totalInputs;k++){
+    if((changed >> k) & 1u) evalRelays |= ruleDependents[k];
+  }
+  const bool shutterDue = full || (changed & shutterInputMask) || shutterTimersDue(now);
+  if(!shutterDue && evalRelays == 0) return; // rien n'a bougé: aucun travail
+
+  if(shutterDue) shutterTick();
+  const int64_t tRules = metricStart();
+  evalSimpleRules(evalRelays);
+  metricStop(MS_RULES, tRules);
+
+  // build final outputs with ownership rules:
+  // simple -> shutter overwrites reserved -> overrides (non-reserved only) -> final safety
+  buildFinalRelays();
+  pcaApplyRelays();
+
+  if(full){
+    controlDirty = false;
+    controlLastFullEvalMs = now;
+  }
+}
+
+static void controlApplyCmd(const ControlCmd& c) {
+  switch (c.type) {
+    case CC_VIN:
+      if (c.index >= totalInputs) return;
+      virtualInputs[c.index] = (c.value == CC_TOGGLE) ? !virtualInputs[c.index] : (c.value != 0);
+      break;
+    case CC_OVERRIDE:
+      if (c.index >= totalRelays || reservedByShutter[c.index]) return;
+      if (c.value == CC_TOGGLE) overrideRelay[c.index] = (overrideRelay[c.index] == 1 ? 0 : 1);
+      else overrideRelay[c.index] = c.value;
+      break;
+    case CC_SHUTTER:
+      if (c.index >= shuttersLimit()) return;
+      shRt[c.index].manual = (ManualCmd)c.value;
+      break;
+    default:
+      return;
+  }
+  controlMarkDirty();
+}
+
+static void ioSnapshotPublish() {
+  IoSnapshot next;
+  memset(&next, 0, sizeof(next));
+  next.version = ioSnap.version;
+  for (int i = 0; i < totalInputs; i++) {
+    if (inputs[i]) next.inputs |= (uint16_t)(1u << i);
+    if (virtualInputs[i]) next.virtualInputs |= (uint16_t)(1u << i);
+  }
+  for (int i = 0; i < totalRelays; i++) {
+    if (relays[i]) next.relays |= (uint16_t)(1u << i);
+    if (reservedByShutter[i]) next.reserved |= (uint16_t)(1u << i);
+    next.overrideRelay[i] = overrideRelay[i];
+  }
+  const uint32_t now = millis();
+  for (int m = 0; m < PCA_MAX_MODULES; m++) {
+    if (pcaLastOkMs[m] != 0 && now - pcaLastOkMs[m] < 5000) next.pcaOk |= (uint8_t)(1u << m);
+    next.pcaFail[m] = pcaFailCount[m];
+  }
+  for (int s = 0; s < SHUTTER_MAX; s++) {
+    next.shutterMove[s] = (uint8_t)shRt[s].move;
+    next.shutterCooldownUntilMs[s] = shRt[s].cooldownUntilMs;
+  }
+  if (memcmp(&next, &ioSnap, sizeof(next)) == 0) return;
+  next.version++;
+
+  __atomic_store_n(&ioSnapSeq, ioSnapSeq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy((void*)&ioSnap, &next, sizeof(next));
+  __atomic_store_n(&ioSnapSeq, ioSnapSeq + 1, __ATOMIC_RELEASE);
+}
+
+// Un cycle: commandes -> entrées -> anti-rebond -> volet/règles -> sorties -> instantané
+static void controlStep() {
+  static int64_t lastStartUs = 0;
+  const int64_t tStep = metricStart();
+  const uint32_t periodUs = lastStartUs ? metricElapsedUs(lastStartUs) : 0;
+  controlLock();
+  if (lastStartUs) metricRecordUs(MS_CONTROL_PERIOD, periodUs);
+  lastStartUs = tStep;
+  bool commanded = false;
+  uint8_t acks[CONTROL_QUEUE_LEN];
+  uint8_t ackGens[CONTROL_QUEUE_LEN];
+  uint8_t ackCount = 0;
+  ControlCmd c;
+  while (controlQueue && xQueueReceive(controlQueue, &c, 0) == pdTRUE) {
+    controlApplyCmd(c);
+    commanded = true;
+    if (c.ack < CONTROL_ACK_SLOTS && ackCount < CONTROL_QUEUE_LEN) {
+      acks[ackCount] = c.ack;
+      ackGens[ackCount++] = c.ackGen;
+    }
+  }
+
+  const int64_t tRead = metricStart();
+  pcaReadInputs();
+  metricStop(MS_PCA_READ, tRead);
+  debounceInputs();
+  for(int i=0;i<totalInputs;i++){
+    combinedInputs[i] = inputs[i] || virtualInputs[i];
+  }
+
+  // shutter -> simple rules -> final relays -> outputs, only when an input,
+  // a command or a timer moved
+  controlTick(commanded);
+  const int64_t tWrite = metricStart();
+  pcaRefreshOutputs();
+  metricStop(MS_PCA_WRITE, tWrite);
+  if (ackCount) {
+    // ok seulement si toutes les sorties voulues sont réellement écrites
+    bool written = true;
+    for (uint8_t m = 0; m < PCA_MAX_MODULES; m++) {
+      if (pcaPresent[m] && pcaOutDirty[m]) written = false;
     }
+    const uint32_t done = (micros() & CONTROL_ACK_US_MASK) | (written ? CONTROL_ACK_OK : 0u);
+    for (uint8_t k = 0; k < ackCount; k++) {
+      __atomic_store_n(&controlAckWord[acks[k]], ((uint32_t)ackGens[k] << 24) | done, __ATOMIC_RELEASE);
+    }
+  }
+
+  // update prev inputs for edge-based rules/toggle/pulse
+  for(int k=0;k<totalInputs;k++){
+    prevInputs[k] = inputs[k];
+    prevCombinedInputs[k] = combinedInputs[k];
   }
+  ioSnapshotPublish();
+  if (commanded) mqttFastCommandPending = false;
+  metricStop(MS_CONTROL, tStep);
+  controlUnlock();
+}
 
+static void controlTask(void*) {
+  TickType_t last = xTaskGetTickCount();
+  for (;;) {
+    controlStep();
+    vTaskDelayUntil(&last, pdMS_TO_TICKS(CONTROL_PERIOD_MS));
+  }
 }
 
 // ===============================================================
 // HTTP helpers
 // ===============================================================
-static String readLine(Client& c){
-  static const uint32_t HTTP_IO_TIMEOUT_MS = 800;
-  String s;
-  uint32_t lastRxMs = millis();
-  while(c.connected() || c.available()){
-    if(c.available()){
-      char ch = c.read();
-      if(ch=='\n') break;
-      if(ch!='\r') s += ch;
-      lastRxMs = millis();
-    } else {
-      if ((millis() - lastRxMs) > HTTP_IO_TIMEOUT_MS) break;
-      delay(1);
-    }
-  }
-  return s;
-}
-
 static void sendText(Client& c, const String& body, const char* ctype, int code);
 
 static bool clientWriteAll(Client& c, const uint8_t* data, size_t len, uint32_t timeoutMs){
@@ -2964,7 +5797,8 @@ static bool clientWriteString(Client& c, const String& s, uint32_t timeoutMs){
   return clientWriteAll(c, (const uint8_t*)s.c_str(), s.length(), timeoutMs);
 }
 
-static String base64Decode(const String& in){
+// Décode en base64 dans un buffer fixe (pas d'allocation); renvoie la longueur, -1 si trop long.
+static int base64DecodeTo(const char* in, char* out, size_t outCap){
   static int8_t table[256];
   static bool inited = false;
   if(!inited){
@@ -2973,61 +5807,39 @@ static String base64Decode(const String& in){
     for(int i=0;i<64;i++) table[(uint8_t)alpha[i]] = i;
     inited = true;
   }
-  String out;
-  out.reserve((in.length()*3)/4);
+  size_t n = 0;
   int val = 0;
   int valb = -8;
-  for(size_t i=0;i<in.length();i++){
-    int8_t c = table[(uint8_t)in[i]];
+  for(; *in; in++){
+    int8_t c = table[(uint8_t)*in];
     if(c < 0) continue;
     val = (val<<6) + c;
     valb += 6;
     if(valb >= 0){
-      out += char((val>>valb) & 0xFF);
+      if(n + 1 >= outCap) return -1;
+      out[n++] = char((val>>valb) & 0xFF);
       valb -= 8;
     }
   }
-  return out;
+  out[n] = '\0';
+  return (int)n;
 }
 
-static bool checkAuthHeader(const String& authHeader){
-  if(authHeader.length() == 0) return false;
-  String h = authHeader;
-  h.trim();
-  String hl = h;
-  hl.toLowerCase();
-  if(!hl.startsWith("basic ")) return false;
-  String b64 = h.substring(6);
-  b64.trim();
-  String decoded = base64Decode(b64);
-  int sep = decoded.indexOf(':');
-  if(sep < 0) return false;
-  String user = decoded.substring(0, sep);
-  String pass = decoded.substring(sep+1);
-  return (user == authCfg.user && pass == authCfg.pass);
+static bool checkAuthHeader(const char* authHeader){
+  while(*authHeader == ' ') authHeader++;
+  if(strncasecmp(authHeader, "basic ", 6) != 0) return false;
+  char decoded[160];
+  if(base64DecodeTo(authHeader + 6, decoded, sizeof(decoded)) < 0) return false;
+  char* sep = strchr(decoded, ':');
+  if(!sep) return false;
+  *sep = '\0';
+  return strcmp(decoded, authCfg.user.c_str()) == 0 && strcmp(sep + 1, authCfg.pass.c_str()) == 0;
 }
 
 static void sendAuthRequired(Client& c){
   sendText(c, String("{\"ok\":false,\"error\":\"auth required\"}"), "application/json", 401);
 }
 
-static String readBody(Client& c, int len){
-  static const uint32_t HTTP_IO_TIMEOUT_MS = 2000;
-  String b; b.reserve(len);
-  uint32_t lastRxMs = millis();
-  while(len-- > 0){
-    while(!c.available()){
-      if (!c.connected() || (millis() - lastRxMs) > HTTP_IO_TIMEOUT_MS) {
-        return b;
-      }
-      delay(1);
-    }
-    b += (char)c.read();
-    lastRxMs = millis();
-  }
-  return b;
-}
-
 static void sendText(Client& c, const String& body, const char* ctype, int code=200){
   String status = "HTTP/1.1 500 Internal Server Error";
   if(code==200) status = "HTTP/1.1 200 OK";
@@ -3035,12 +5847,13 @@ static void sendText(Client& c, const String& body, const char* ctype, int code=
   else if(code==204) status = "HTTP/1.1 204 No Content";
   else if(code==400) status = "HTTP/1.1 400 Bad Request";
   else if(code==404) status = "HTTP/1.1 404 Not Found";
+  else if(code==503) status = "HTTP/1.1 503 Service Unavailable";
 
   String hdr = status + "\r\n";
   hdr += "Content-Type: ";
   hdr += ctype;
   hdr += "\r\n";
-  hdr += "Connection: close\r\n";
+  httpAddConnectionHeader(hdr);
   hdr += "Content-Length: " + String(body.length()) + "\r\n\r\n";
   if (!clientWriteString(c, hdr, 4000)) {
     return;
@@ -3049,65 +5862,46 @@ static void sendText(Client& c, const String& body, const char* ctype, int code=
     clientWriteAll(c, (const uint8_t*)body.c_str(), body.length(), 4000);
   }
   c.flush();
-  delay(2);
 }
 
-static void buildStateJson(String &out){
-  static StaticJsonDocument<4096> doc;
-  doc.clear();
-  doc["device_id"] = mqttDeviceId();
+// Morceaux de l'état, partagés entre /api/state et les deltas de /api/events.
+static void stateAddInputs(JsonDocument& doc, const IoSnapshot& snap){
   JsonArray inA = doc["inputs"].to<JsonArray>();
+  for(int i=0;i<totalInputs;i++){
+    inA.add(snapBit(snap.inputs, i) ? 1 : 0);
+  }
+}
+
+static void stateAddRelays(JsonDocument& doc, const IoSnapshot& snap){
   JsonArray reA = doc["relays"].to<JsonArray>();
   JsonArray ovA = doc["override"].to<JsonArray>();
   JsonArray rsA = doc["reserved"].to<JsonArray>();
-  JsonArray modA = doc["modules_status"].to<JsonArray>();
-  JsonArray modF = doc["modules_fail"].to<JsonArray>();
-
-  for(int i=0;i<totalInputs;i++){
-    inA.add(inputs[i] ? 1 : 0);
-  }
   for(int i=0;i<totalRelays;i++){
-    reA.add(relays[i] ? 1 : 0);
-    ovA.add(overrideRelay[i]);
-    rsA.add(reservedByShutter[i] ? 1 : 0);
+    reA.add(snapBit(snap.relays, i) ? 1 : 0);
+    ovA.add(snap.overrideRelay[i]);
+    rsA.add(snapBit(snap.reserved, i) ? 1 : 0);
   }
+}
+
+static void stateAddModules(JsonDocument& doc, const IoSnapshot& snap){
+  JsonArray modA = doc["modules_status"].to<JsonArray>();
+  JsonArray modF = doc["modules_fail"].to<JsonArray>();
   for(int m=0; m<pcaCount; m++){
-    const bool ok = (pcaLastOkMs[m] != 0) && (millis() - pcaLastOkMs[m] < 5000);
-    modA.add(ok ? 1 : 0);
-    modF.add(pcaFailCount[m]);
+    modA.add(snapBit(snap.pcaOk, m) ? 1 : 0);
+    modF.add(snap.pcaFail[m]);
   }
+}
 
-  JsonObject eth = doc["eth"].to<JsonObject>();
-  eth["link"] = (Ethernet.linkStatus()==LinkON) ? 1 : 0;
-  eth["ip"] = Ethernet.localIP().toString();
-
-  JsonObject wifi = doc["wifi"].to<JsonObject>();
-  wifi["enabled"] = wifiCfg.enabled ? 1 : 0;
-  wifi["ap"] = wifiApOn ? 1 : 0;
-  wifi["ssid"] = wifiCfg.ssid;
-  wifi["ip"] = wifiApOn ? WiFi.softAPIP().toString() : "";
-
-  JsonObject mq = doc["mqtt"].to<JsonObject>();
-  mq["enabled"] = mqttCfg.enabled ? 1 : 0;
-  const bool ethConn = mqttEthConnectedSafe();
-  const bool gsmConn = mqttGsmConnectedSafe();
-  mq["connected"] = (ethConn || gsmConn) ? 1 : 0;
-  mq["eth_connected"] = ethConn ? 1 : 0;
-  mq["gsm_connected"] = gsmConn ? 1 : 0;
-  mq["transport"] = normalizeMqttTransport(mqttCfg.transport);
-  mq["active_transport"] = mqttActiveTransportText();
-  mq["gsm_network"] = gsmNetworkReady ? 1 : 0;
-  mq["gsm_data"] = gsmDataReady ? 1 : 0;
-  mq["ip"] = mqttCurrentIp();
-
+static void stateAddShutters(JsonDocument& doc, const IoSnapshot& snap){
+  const uint32_t now = millis();
   JsonObject sh = doc["shutter"].to<JsonObject>();
   sh["enabled"] = shCfg[0].enabled ? 1 : 0;
   if(shCfg[0].enabled){
     sh["name"] = shCfg[0].name;
     sh["up_relay"] = shCfg[0].up_relay;
     sh["down_relay"] = shCfg[0].down_relay;
-    sh["move"] = (shRt[0].move==SH_UP ? "up" : (shRt[0].move==SH_DOWN ? "down" : "stop"));
-    sh["cooldown_ms"] = (millis() < shRt[0].cooldownUntilMs) ? (uint32_t)(shRt[0].cooldownUntilMs - millis()) : 0;
+    sh["move"] = (snap.shutterMove[0]==SH_UP ? "up" : (snap.shutterMove[0]==SH_DOWN ? "down" : "stop"));
+    sh["cooldown_ms"] = (now < snap.shutterCooldownUntilMs[0]) ? (uint32_t)(snap.shutterCooldownUntilMs[0] - now) : 0;
   }
 
   JsonArray shA = doc["shutters"].to<JsonArray>();
@@ -3118,11 +5912,13 @@ static void buildStateJson(String &out){
       o["name"] = shCfg[s].name;
       o["up_relay"] = shCfg[s].up_relay;
       o["down_relay"] = shCfg[s].down_relay;
-      o["move"] = (shRt[s].move==SH_UP ? "up" : (shRt[s].move==SH_DOWN ? "down" : "stop"));
-      o["cooldown_ms"] = (millis() < shRt[s].cooldownUntilMs) ? (uint32_t)(shRt[s].cooldownUntilMs - millis()) : 0;
+      o["move"] = (snap.shutterMove[s]==SH_UP ? "up" : (snap.shutterMove[s]==SH_DOWN ? "down" : "stop"));
+      o["cooldown_ms"] = (now < snap.shutterCooldownUntilMs[s]) ? (uint32_t)(snap.shutterCooldownUntilMs[s] - now) : 0;
     }
   }
+}
 
+static void stateAddTemps(JsonDocument& doc){
   JsonArray tA = doc["temps"].to<JsonArray>();
   for(int i=0;i<tempCount;i++){
     JsonObject t = tA.add<JsonObject>();
@@ -3135,6 +5931,44 @@ static void buildStateJson(String &out){
     if(!isnan(dhtTempC)) t["c"] = dhtTempC;
     if(!isnan(dhtHum)) t["h"] = dhtHum;
   }
+}
+
+static void buildStateJson(String &out){
+  static StaticJsonDocument<4096> doc;
+  doc.clear();
+  doc["device_id"] = mqttDeviceId();
+
+  IoSnapshot snap;
+  ioSnapshotRead(snap);
+  stateAddInputs(doc, snap);
+  stateAddRelays(doc, snap);
+  stateAddModules(doc, snap);
+
+  JsonObject eth = doc["eth"].to<JsonObject>();
+  eth["link"] = (Ethernet.linkStatus()==LinkON) ? 1 : 0;
+  eth["ip"] = Ethernet.localIP().toString();
+
+  JsonObject wifi = doc["wifi"].to<JsonObject>();
+  wifi["enabled"] = wifiCfg.enabled ? 1 : 0;
+  wifi["ap"] = wifiApOn ? 1 : 0;
+  wifi["ssid"] = wifiCfg.ssid;
+  wifi["ip"] = wifiApOn ? WiFi.softAPIP().toString() : "";
+
+  JsonObject mq = doc["mqtt"].to<JsonObject>();
+  mq["enabled"] = mqttCfg.enabled ? 1 : 0;
+  const bool ethConn = mqttEthConnectedSafe();
+  const bool gsmConn = mqttGsmConnectedSafe();
+  mq["connected"] = (ethConn || gsmConn) ? 1 : 0;
+  mq["eth_connected"] = ethConn ? 1 : 0;
+  mq["gsm_connected"] = gsmConn ? 1 : 0;
+  mq["transport"] = normalizeMqttTransport(mqttCfg.transport);
+  mq["active_transport"] = mqttActiveTransportText();
+  mq["gsm_network"] = gsmNetworkReady ? 1 : 0;
+  mq["gsm_data"] = gsmDataReady ? 1 : 0;
+  mq["ip"] = mqttCurrentIp();
+
+  stateAddShutters(doc, snap);
+  stateAddTemps(doc);
 
   doc["modules"] = pcaCount;
   doc["relays_per"] = RELAYS_PER_MODULE;
@@ -3166,17 +6000,18 @@ static void buildStateJsonBle(String &out){
   JsonArray modA = doc["modules_status"].to<JsonArray>();
   JsonArray modF = doc["modules_fail"].to<JsonArray>();
 
+  IoSnapshot snap;
+  ioSnapshotRead(snap);
   for(int i=0;i<totalInputs;i++){
-    inA.add(inputs[i] ? 1 : 0);
+    inA.add(snapBit(snap.inputs, i) ? 1 : 0);
   }
   for(int i=0;i<totalRelays;i++){
-    reA.add(relays[i] ? 1 : 0);
-    ovA.add(overrideRelay[i]);
+    reA.add(snapBit(snap.relays, i) ? 1 : 0);
+    ovA.add(snap.overrideRelay[i]);
   }
   for(int m=0; m<pcaCount; m++){
-    const bool ok = (pcaLastOkMs[m] != 0) && (millis() - pcaLastOkMs[m] < 5000);
-    modA.add(ok ? 1 : 0);
-    modF.add(pcaFailCount[m]);
+    modA.add(snapBit(snap.pcaOk, m) ? 1 : 0);
+    modF.add(snap.pcaFail[m]);
   }
 
   JsonObject eth = doc["eth"].to<JsonObject>();
@@ -3195,6 +6030,7 @@ static void buildStateJsonBle(String &out){
 
   JsonObject gsm = doc["gsm"].to<JsonObject>();
   gsm["modem_ready"] = modemReady ? 1 : 0;
+  gsm["stage"] = gsmStageName(gsmLink.stage);
   gsm["ready"] = (modemReady && gsmNetworkReady && gsmDataReady) ? 1 : 0;
   gsm["network"] = gsmNetworkReady ? 1 : 0;
   gsm["data"] = gsmDataReady ? 1 : 0;
@@ -3221,8 +6057,6 @@ static void buildStateJsonBle(String &out){
 }
 
 static void sendJsonNetCfg(Client& c){
-  // Reload from flash to reflect latest saved mode
-  loadNetCfg();
   String out;
   netCfgToJson(out);
   sendText(c, out, "application/json");
@@ -3235,7 +6069,6 @@ static void sendJsonWifiCfg(Client& c){
 }
 
 static void sendJsonMqttCfg(Client& c){
-  loadMqttCfg();
   mqttSetup();
   String out;
   mqttCfgToJson(out);
@@ -3243,9 +6076,6 @@ static void sendJsonMqttCfg(Client& c){
 }
 
 static void sendJsonBackup(Client& c){
-  loadNetCfg();
-  loadMqttCfg();
-
   static JsonDocument doc;
   doc.clear();
   doc["rules"] = rulesDoc;
@@ -3277,6 +6107,9 @@ static void sendJsonBackup(Client& c){
   mq["apn"] = mqttCfg.apn;
   mq["gsm_user"] = mqttCfg.gsmUser;
   mq["gsm_pass"] = mqttCfg.gsmPass;
+  mq["state_bulk"] = mqttCfg.stateBulk ? 1 : 0;
+  mq["gsm_bulk_only"] = mqttCfg.gsmBulkOnly ? 1 : 0;
+  mq["gsm_budget_mb"] = mqttCfg.gsmBudgetMb;
 
   String out; serializeJson(doc, out);
   sendText(c, out, "application/json");
@@ -3322,7 +6155,7 @@ static bool applyNetFromJson(JsonObject o, String &err) {
 
   NetConfig prevCfg = netCfg;
   netCfg = nextCfg;
-  if(!saveNetCfg()){
+  if(!saveConfigStore()){
     netCfg = prevCfg;
     err = "net fs write failed";
     return false;
@@ -3351,7 +6184,7 @@ static bool applyWifiFromJson(JsonObject o, String &err, bool &restarting) {
     passChanged = (p != oldPass);
     wifiCfg.pass = p;
   }
-  if(!saveWifiCfg()){
+  if(!saveConfigStore()){
     err = "wifi fs write failed";
     return false;
   }
@@ -3394,6 +6227,9 @@ static bool parseMqttFromJson(JsonObject o, MqttConfig &nextCfg, String &err) {
   nextCfg.apn = String((const char*)(o["apn"] | GPRS_DEFAULT_APN));
   nextCfg.gsmUser = String((const char*)(o["gsm_user"] | GPRS_DEFAULT_USER));
   nextCfg.gsmPass = String((const char*)(o["gsm_pass"] | GPRS_DEFAULT_PASS));
+  nextCfg.stateBulk = (o["state_bulk"] | 1) ? true : false;
+  nextCfg.gsmBulkOnly = (o["gsm_bulk_only"] | 0) ? true : false;
+  nextCfg.gsmBudgetMb = (uint16_t)(o["gsm_budget_mb"] | 0);
   nextCfg.host.trim();
   if (nextCfg.host.length() == 0) {
     err = "mqtt.host required";
@@ -3408,17 +6244,12 @@ static bool parseMqttFromJson(JsonObject o, MqttConfig &nextCfg, String &err) {
 }
 
 static void mqttOnConfigApplied() {
-  gsmMarkDown();
-  modemReady = false;
-  modemPowerKickDone = false;
-  simPinChecked = false;
-  modemUartBaud = MODEM_UART_BAUD;
-  modemUartRxPin = MODEM_RX;
-  modemUartTxPin = MODEM_TX;
-  gsmLastTryMs = 0;
+  gsmReset();
   gsmLastDebugMs = 0;
   mqttSetup();
-  mqttAnnouncedEth = false;
+  mqttOutboxClear(mqttOutEth); // la base a pu changer: anciens topics périmés
+  mqttOutboxClear(mqttOutGsm);
+  mqttDiscoveryRestart();
   mqttAnnouncedGsm = false;
   mqttLastConnectEthMs = 0;
   mqttLastConnectGsmMs = 0;
@@ -3427,6 +6258,9 @@ static void mqttOnConfigApplied() {
   mqttLastEthFailMs = 0;
   mqttLastEthFailRc = 0;
   mqttEthAuthBlocked = false;
+  mqttEthRetryMs = MQTT_ETH_RETRY_MIN_MS;
+  mqttViewClear(mqttViewEth); // broker ou topics ont pu changer
+  mqttViewClear(mqttViewGsm);
 }
 
 static bool applyMqttFromJson(JsonObject o, String &err) {
@@ -3435,7 +6269,7 @@ static bool applyMqttFromJson(JsonObject o, String &err) {
 
   MqttConfig prevCfg = mqttCfg;
   mqttCfg = nextCfg;
-  if(!saveMqttCfg()){
+  if(!saveConfigStore()){
     mqttCfg = prevCfg;
     err = "mqtt fs write failed";
     return false;
@@ -3624,6 +6458,9 @@ static bool validateRulesDocNoSideEffects(JsonDocument &candidate, String &errMs
   ShutterRuntime shRtBackup[SHUTTER_MAX];
   bool reservedBackup[MAX_RELAYS];
 
+  // la validation réutilise l'état volet/réservations: pas de cycle contrôle pendant ce temps
+  controlLock();
+  const uint16_t shutterInputMaskBackup = shutterInputMask;
   for(int i=0; i<SHUTTER_MAX; i++){
     shCfgBackup[i] = shCfg[i];
     shRtBackup[i] = shRt[i];
@@ -3641,11 +6478,14 @@ static bool validateRulesDocNoSideEffects(JsonDocument &candidate, String &errMs
   for(int i=0; i<MAX_RELAYS; i++){
     reservedByShutter[i] = reservedBackup[i];
   }
+  shutterInputMask = shutterInputMaskBackup;
+  controlUnlock();
   return ok;
 }
 
 static void rebuildRuntimeFromRules() {
   // parse shutter & reservations from current rulesDoc
+  controlLock();
   String err;
   if(!parseShutterFromRules(rulesDoc["shutters"].as<JsonArray>(), err)){
     // si règles en flash sont invalides, on désactive le volet par sécurité
@@ -3653,470 +6493,1211 @@ static void rebuildRuntimeFromRules() {
     for(int s=0; s<shuttersLimit(); s++) shCfg[s].enabled = false;
     applyReservationsFromConfig();
   }
-  mqttAnnouncedEth = false;
+  compileRulesFromDoc();
+  controlUnlock();
+  mqttDiscoveryRestart();
 }
 
 // ===============================================================
-// HTTP router
+// SSE /api/events: état complet à l'ouverture, puis deltas
 // ===============================================================
-static void handleHttpClient(Client& client, bool fromWifi=false){
-  String req = readLine(client); // "GET /path HTTP/1.1"
-  if(req.length()==0){
-    client.stop();
+static const uint8_t SSE_MAX_STREAMS = 3;         // garde des slots pour les requêtes
+static const uint32_t SSE_MIN_INTERVAL_MS = 50;   // coalescence des changements
+static const uint32_t SSE_PING_MS = 2000;         // uptime pour l'indicateur de vie
+
+struct SseState {
+  IoSnapshot last;
+  float temps[TEMP_MAX_SENSORS];
+  uint8_t tempCount;
+  float dhtC;
+  float dhtH;
+  uint32_t lastSendMs;
+};
+
+static SseState httpSse[HTTP_MAX_CONN];
+
+static SseState& sseFor(HttpConn& hc){
+  return httpSse[&hc - httpConns];
+}
+
+static bool floatChanged(float a, float b){
+  if(isnan(a) || isnan(b)) return isnan(a) != isnan(b);
+  return a != b;
+}
+
+static void sseRememberTemps(SseState& ss){
+  ss.tempCount = tempCount;
+  for(int i=0;i<tempCount;i++) ss.temps[i] = tempC[i];
+  ss.dhtC = dhtTempC;
+  ss.dhtH = dhtHum;
+}
+
+static bool sseTempsChanged(const SseState& ss){
+  if(ss.tempCount != tempCount) return true;
+  for(int i=0;i<tempCount;i++){
+    if(floatChanged(ss.temps[i], tempC[i])) return true;
+  }
+  return floatChanged(ss.dhtC, dhtTempC) || floatChanged(ss.dhtH, dhtHum);
+}
+
+static void sseBegin(HttpConn& hc, Client& client){
+  uint8_t streams = 0;
+  for(uint8_t i=0;i<HTTP_MAX_CONN;i++){
+    if(httpConns[i].stream) streams++;
+  }
+  if(streams >= SSE_MAX_STREAMS){
+    sendText(client, String("{\"ok\":false,\"error\":\"too many streams\"}"), "application/json", 503);
     return;
   }
+  SseState& ss = sseFor(hc);
+  String state;
+  buildStateJson(state);
+  ioSnapshotRead(ss.last);
+  sseRememberTemps(ss);
+  ss.lastSendMs = millis();
 
-  int contentLen = 0;
-  String authHeader = "";
-  String contentType = "";
-  String checksumSha256 = "";
-  while(true){
-    String h = readLine(client);
-    if(h.length()==0) break;
-    String hl = h;
-    hl.toLowerCase();
-    if(hl.startsWith("content-length:")){
-      int colon = h.indexOf(':');
-      if(colon >= 0) contentLen = h.substring(colon + 1).toInt();
-    }
-    if(hl.startsWith("authorization:")){
-      int colon = h.indexOf(':');
-      if(colon >= 0) {
-        authHeader = h.substring(colon + 1);
-        authHeader.trim();
-      }
+  String hdr = "HTTP/1.1 200 OK\r\n";
+  hdr += "Content-Type: text/event-stream\r\n";
+  hdr += "Cache-Control: no-cache\r\n";
+  hdr += "Connection: keep-alive\r\n\r\n";
+  hdr += "retry: 2000\n";
+  hdr += "event: state\ndata: ";
+  clientWriteString(client, hdr);
+  clientWriteString(client, state);
+  clientWriteString(client, String("\n\n"));
+  hc.stream = true;
+}
+
+// Delta: seules les parties modifiées, en tableaux complets (fusion simple côté client).
+static void sseTick(HttpConn& hc){
+  SseState& ss = sseFor(hc);
+  const uint32_t now = millis();
+  if(now - ss.lastSendMs < SSE_MIN_INTERVAL_MS) return;
+
+  IoSnapshot snap;
+  ioSnapshotRead(snap);
+  const bool ioChanged = snap.version != ss.last.version;
+  const bool tempsChanged = sseTempsChanged(ss);
+  if(!ioChanged && !tempsChanged && now - ss.lastSendMs < SSE_PING_MS) return;
+
+  JsonDocument doc;
+  if(ioChanged){
+    if(snap.inputs != ss.last.inputs) stateAddInputs(doc, snap);
+    if(snap.relays != ss.last.relays || snap.reserved != ss.last.reserved ||
+       memcmp(snap.overrideRelay, ss.last.overrideRelay, sizeof(snap.overrideRelay)) != 0){
+      stateAddRelays(doc, snap);
     }
-    if(hl.startsWith("content-type:")){
-      int colon = h.indexOf(':');
-      if(colon >= 0) {
-        contentType = h.substring(colon + 1);
-        contentType.trim();
-      }
+    if(snap.pcaOk != ss.last.pcaOk || memcmp(snap.pcaFail, ss.last.pcaFail, sizeof(snap.pcaFail)) != 0){
+      stateAddModules(doc, snap);
     }
-    if(hl.startsWith("x-checksum-sha256:")){
-      int colon = h.indexOf(':');
-      if(colon >= 0) {
-        checksumSha256 = h.substring(colon + 1);
-        checksumSha256.trim();
-      }
+    if(memcmp(snap.shutterMove, ss.last.shutterMove, sizeof(snap.shutterMove)) != 0 ||
+       memcmp(snap.shutterCooldownUntilMs, ss.last.shutterCooldownUntilMs, sizeof(snap.shutterCooldownUntilMs)) != 0){
+      stateAddShutters(doc, snap);
     }
+    ss.last = snap;
   }
-
-  int sp1 = req.indexOf(' ');
-  int sp2 = req.indexOf(' ', sp1+1);
-  if (sp1 <= 0 || sp2 <= sp1) {
-    sendText(client, "bad request\n", "text/plain", 400);
-    delay(1);
-    client.stop();
-    return;
+  if(tempsChanged){
+    stateAddTemps(doc);
+    sseRememberTemps(ss);
   }
-  String method = req.substring(0, sp1);
-  String url = req.substring(sp1+1, sp2);
+  doc["uptime_ms"] = now;
+
+  String json;
+  serializeJson(doc, json);
+  hc.out = "event: delta\ndata: ";
+  hc.out += json;
+  hc.out += "\n\n";
+  ss.lastSendMs = now;
+  hc.outOff = 0;
+  hc.st = HC_SEND;
+  hc.lastIoMs = now;
+}
 
-  String path = url;
-  String query = "";
-  int q = url.indexOf('?');
-  if(q >= 0){ path = url.substring(0,q); query = url.substring(q+1); }
-  const bool authed = checkAuthHeader(authHeader);
+// ===============================================================
+// HTTP router
+// ===============================================================
+static void sendShutterCmdResult(Client& client, bool posted){
+  if(posted) sendText(client, String("{\"ok\":true}"), "application/json");
+  else sendText(client, String("{\"ok\":false,\"error\":\"control busy\"}"), "application/json", 500);
+}
 
-  // -------- routes --------
-  if(method=="GET" && (path=="/" || path=="/index.html")){
-    sendFile(client, "/index.html", "text/html; charset=utf-8");
-  }
-  else if(method=="GET" && (path=="/i18n_en.json" || path=="/i18n_fr.json")){
-    sendFile(client, path.c_str(), "application/json; charset=utf-8");
-  }
-  else if(method=="GET" && path=="/api/state"){
-    sendJsonState(client);
-  }
-  else if(method=="GET" && path=="/api/auth"){
-    if(!authed){ sendAuthRequired(client); }
-    else {
-      String out = String("{\"ok\":true,\"user\":\"") + authCfg.user + "\"}";
-      sendText(client, out, "application/json");
+// Une route = requête complète (en-têtes + corps) -> réponse écrite dans client.
+// client est un HttpResponseWriter, sauf pour l'OTA (rawBody) qui lit le socket en flux.
+typedef void (*HttpRouteFn)(HttpConn& hc, Client& client);
+
+static void routeGetIndex(HttpConn& hc, Client& client){
+  sendFile(hc, client, "/index.html", "text/html; charset=utf-8");
+}
+
+static void routeGetI18n(HttpConn& hc, Client& client){
+  sendFile(hc, client, hc.path, "application/json; charset=utf-8");
+}
+
+static void routeGetState(HttpConn& hc, Client& client){
+  sendJsonState(client);
+}
+
+static void routeGetEvents(HttpConn& hc, Client& client){
+  sseBegin(hc, client);
+}
+
+static void routeGetAuth(HttpConn& hc, Client& client){
+  String out = String("{\"ok\":true,\"user\":\"") + authCfg.user + "\"}";
+  sendText(client, out, "application/json");
+}
+
+static void routeGetRules(HttpConn& hc, Client& client){
+  sendJsonRules(client);
+}
+
+static void routeGetNet(HttpConn& hc, Client& client){
+  sendJsonNetCfg(client);
+}
+
+static void routeGetWifi(HttpConn& hc, Client& client){
+  sendJsonWifiCfg(client);
+}
+
+static void routeGetMqtt(HttpConn& hc, Client& client){
+  sendJsonMqttCfg(client);
+}
+
+static void routeGetBackup(HttpConn& hc, Client& client){
+  sendJsonBackup(client);
+}
+
+static void routeGetTemps(HttpConn& hc, Client& client){
+  JsonDocument doc;
+  doc["parasite"] = tempParasite ? 1 : 0;
+  doc["res_default"] = TEMP_DEFAULT_RES;
+  doc["interval_s_default"] = TEMP_DEFAULT_INTERVAL_S;
+  JsonArray a = doc["sensors"].to<JsonArray>();
+  const uint32_t now = millis();
+  for(uint8_t i=0;i<tempCount;i++){
+    const TempSensorRt& rt = tempRt[i];
+    JsonObject o = a.add<JsonObject>();
+    o["addr"] = tempAddrToString(tempAddr[i]);
+    o["c"] = tempC[i];
+    o["res"] = rt.res;
+    o["interval_s"] = rt.intervalS;
+    o["conv_ms"] = ds18ConvMs(rt.res);
+    o["age_ms"] = rt.lastOkMs ? (now - rt.lastOkMs) : 0;
+    o["crc_err"] = rt.crcErr;
+    o["missed"] = rt.missed;
+  }
+  JsonObject d = doc["dht"].to<JsonObject>();
+  d["present"] = dhtPresent ? 1 : 0;
+  if(!isnan(dhtTempC)) d["c"] = dhtTempC;
+  if(!isnan(dhtHum)) d["h"] = dhtHum;
+  d["ok"] = dhtReadOk;
+  d["crc_err"] = dhtChecksumErr;
+  d["missed"] = dhtMissed;
+  String out; serializeJson(doc, out);
+  sendText(client, out, "application/json");
+}
+
+static void metricsLine(String& out, const char* fmt, ...){
+  char line[160];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+  out += line;
+}
+
+// Format texte Prometheus (histogrammes cumulés, durées en secondes)
+static void routeGetMetrics(HttpConn& hc, Client& client){
+  String out;
+  out.reserve(8192);
+  out += "# HELP espr_stage_seconds Duree des etapes des taches controle/reseau\n"
+         "# TYPE espr_stage_seconds histogram\n";
+  for(uint8_t s=0;s<MS_COUNT;s++){
+    StageStat st;
+    metricStageCopy((MetricStage)s, st, false);
+    const char* name = METRIC_STAGE_NAMES[s];
+    uint32_t cum = 0;
+    for(uint8_t b=0;b<METRIC_BUCKETS;b++){
+      cum += st.bucket[b];
+      metricsLine(out, "espr_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n",
+                  name, METRIC_BUCKET_US[b] / 1e6, (unsigned long)cum);
     }
+    cum += st.bucket[METRIC_BUCKETS];
+    metricsLine(out, "espr_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", name, (unsigned long)cum);
+    metricsLine(out, "espr_stage_seconds_sum{stage=\"%s\"} %.6f\n", name, st.sumUs / 1e6);
+    metricsLine(out, "espr_stage_seconds_count{stage=\"%s\"} %lu\n", name, (unsigned long)cum);
+  }
+  out += "# TYPE espr_stage_min_seconds gauge\n";
+  for(uint8_t s=0;s<MS_COUNT;s++){
+    metricsLine(out, "espr_stage_min_seconds{stage=\"%s\"} %.6f\n", METRIC_STAGE_NAMES[s], stageStats[s].minUs / 1e6);
+  }
+  out += "# TYPE espr_stage_max_seconds gauge\n";
+  for(uint8_t s=0;s<MS_COUNT;s++){
+    metricsLine(out, "espr_stage_max_seconds{stage=\"%s\"} %.6f\n", METRIC_STAGE_NAMES[s], stageStats[s].maxUs / 1e6);
+  }
+
+  static const char* const I2C_OPS[2] = {"read", "write"};
+  out += "# TYPE espr_i2c_ops_total counter\n";
+  for(uint8_t k=0;k<2;k++) metricsLine(out, "espr_i2c_ops_total{op=\"%s\"} %lu\n", I2C_OPS[k], (unsigned long)i2cStats.ops[k]);
+  out += "# TYPE espr_i2c_retries_total counter\n";
+  for(uint8_t k=0;k<2;k++) metricsLine(out, "espr_i2c_retries_total{op=\"%s\"} %lu\n", I2C_OPS[k], (unsigned long)i2cStats.retries[k]);
+  out += "# TYPE espr_i2c_failures_total counter\n";
+  for(uint8_t k=0;k<2;k++) metricsLine(out, "espr_i2c_failures_total{op=\"%s\"} %lu\n", I2C_OPS[k], (unsigned long)i2cStats.failures[k]);
+  out += "# TYPE espr_pca_consecutive_failures gauge\n";
+  for(int m=0;m<PCA_MAX_MODULES;m++) metricsLine(out, "espr_pca_consecutive_failures{module=\"%d\"} %u\n", m, (unsigned)pcaFailCount[m]);
+
+  out += "# TYPE espr_heap_free_bytes gauge\n";
+  metricsLine(out, "espr_heap_free_bytes %lu\n", (unsigned long)ESP.getFreeHeap());
+  out += "# TYPE espr_heap_min_free_bytes gauge\n";
+  metricsLine(out, "espr_heap_min_free_bytes %lu\n", (unsigned long)ESP.getMinFreeHeap());
+  out += "# TYPE espr_heap_largest_block_bytes gauge\n";
+  metricsLine(out, "espr_heap_largest_block_bytes %lu\n", (unsigned long)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+
+  out += "# TYPE espr_ds18b20_errors_total counter\n";
+  for(uint8_t i=0;i<tempCount;i++){
+    const String addr = tempAddrToString(tempAddr[i]);
+    metricsLine(out, "espr_ds18b20_errors_total{addr=\"%s\",kind=\"crc\"} %lu\n", addr.c_str(), (unsigned long)tempRt[i].crcErr);
+    metricsLine(out, "espr_ds18b20_errors_total{addr=\"%s\",kind=\"missed\"} %lu\n", addr.c_str(), (unsigned long)tempRt[i].missed);
+  }
+  out += "# TYPE espr_dht_reads_total counter\n";
+  metricsLine(out, "espr_dht_reads_total{result=\"ok\"} %lu\n", (unsigned long)dhtReadOk);
+  metricsLine(out, "espr_dht_reads_total{result=\"crc\"} %lu\n", (unsigned long)dhtChecksumErr);
+  metricsLine(out, "espr_dht_reads_total{result=\"missed\"} %lu\n", (unsigned long)dhtMissed);
+
+  out += "# TYPE espr_mqtt_bytes_total counter\n";
+  metricsLine(out, "espr_mqtt_bytes_total{transport=\"eth\",dir=\"tx\"} %llu\n", (unsigned long long)mqttTrafficEth.tx);
+  metricsLine(out, "espr_mqtt_bytes_total{transport=\"eth\",dir=\"rx\"} %llu\n", (unsigned long long)mqttTrafficEth.rx);
+  metricsLine(out, "espr_mqtt_bytes_total{transport=\"gsm\",dir=\"tx\"} %llu\n", (unsigned long long)mqttTrafficGsm.tx);
+  metricsLine(out, "espr_mqtt_bytes_total{transport=\"gsm\",dir=\"rx\"} %llu\n", (unsigned long long)mqttTrafficGsm.rx);
+  out += "# TYPE espr_uptime_seconds gauge\n";
+  metricsLine(out, "espr_uptime_seconds %lu\n", (unsigned long)(esp_timer_get_time() / 1000000LL));
+  sendText(client, out, "text/plain; version=0.0.4");
+}
+
+// Valeur d'un paramètre de query (pas de décodage %xx: valeurs simples attendues)
+static bool httpQueryParam(const char* q, const char* key, char* out, size_t cap){
+  const size_t k = strlen(key);
+  while(q && *q){
+    const char* amp = strchr(q, '&');
+    const size_t len = amp ? (size_t)(amp - q) : strlen(q);
+    if(len > k && strncmp(q, key, k) == 0 && q[k] == '='){
+      size_t n = len - k - 1;
+      if(n >= cap) n = cap - 1;
+      memcpy(out, q + k + 1, n);
+      out[n] = '\0';
+      return true;
+    }
+    q = amp ? amp + 1 : nullptr;
   }
-  else if(method=="GET" && path=="/api/rules"){
-    if(!authed) sendAuthRequired(client);
-    else sendJsonRules(client);
-  }
-  else if(method=="GET" && path=="/api/net"){
-    if(!authed) sendAuthRequired(client);
-    else sendJsonNetCfg(client);
-  }
-  else if(method=="GET" && path=="/api/wifi"){
-    if(!authed) sendAuthRequired(client);
-    else sendJsonWifiCfg(client);
-  }
-  else if(method=="GET" && path=="/api/mqtt"){
-    if(!authed) sendAuthRequired(client);
-    else sendJsonMqttCfg(client);
-  }
-  else if(method=="GET" && path=="/api/backup"){
-    if(!authed) sendAuthRequired(client);
-    else sendJsonBackup(client);
-  }
-  else if(method=="PUT" && path=="/api/auth"){
-    if(!authed){ sendAuthRequired(client); }
-    else {
-      String body = readBody(client, contentLen);
-      JsonDocument tmp;
-      auto err = deserializeJson(tmp, body);
-      if(err){
-        sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
-      } else {
-        const char* user = tmp["user"] | "";
-        const char* pass = tmp["pass"] | "";
-        if(String(user).length() == 0 || String(pass).length() == 0){
-          sendText(client, String("{\"ok\":false,\"error\":\"user/pass required\"}"), "application/json", 400);
-        } else {
-          authCfg.user = String(user);
-          authCfg.pass = String(pass);
-          if(!saveAuthCfg()){
-            sendText(client, String("{\"ok\":false,\"error\":\"fs write failed\"}"), "application/json", 500);
-          } else {
-            sendText(client, String("{\"ok\":true}"), "application/json");
-          }
-        }
+  return false;
+}
+
+// ?series=temp0,relays&from=<uptime ms>&to=<uptime ms>, réponse chunked:
+// {"now_ms":..,"temps":[adresses],"points":[["temp0",t_ms,21.44],...]}
+static void routeGetHistory(HttpConn& hc, Client& client){
+  char buf[96];
+  uint16_t mask = (uint16_t)((1u << HS_COUNT) - 1);
+  if(httpQueryParam(hc.query, "series", buf, sizeof(buf)) && buf[0]){
+    mask = 0;
+    for(const char* p = buf; *p; ){
+      const char* comma = strchr(p, ',');
+      const size_t len = comma ? (size_t)(comma - p) : strlen(p);
+      const int sIdx = histSeriesFind(p, len);
+      if(sIdx < 0){
+        sendText(client, String("{\"ok\":false,\"error\":\"unknown series\"}"), "application/json", 400);
+        return;
       }
+      mask |= (uint16_t)(1u << sIdx);
+      p = comma ? comma + 1 : p + len;
     }
   }
-  else if(method=="PUT" && path=="/api/net"){
-    if(!authed){ sendAuthRequired(client); return; }
-    String body = readBody(client, contentLen);
-    JsonDocument tmp;
-    auto err = deserializeJson(tmp, body);
-    if(err){
-      sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
-    } else {
-      const char* mode = tmp["mode"] | "static";
-      bool dhcp = (strcmp(mode, "dhcp") == 0);
-      if(!(dhcp || strcmp(mode, "static")==0)){
-        sendText(client, String("{\"ok\":false,\"error\":\"mode must be dhcp|static\"}"), "application/json", 400);
-      } else {
-        if(!dhcp){
-          IPAddress ip, gw, sn, dns;
-          bool ok = true;
-          const char* ipStr = tmp["ip"] | "";
-          const char* gwStr = tmp["gw"] | "";
-          const char* snStr = tmp["sn"] | "";
-          const char* dnsStr = tmp["dns"] | "";
-          ok &= parseIp(String(ipStr), ip);
-          ok &= parseIp(String(gwStr), gw);
-          ok &= parseIp(String(snStr), sn);
-          ok &= parseIp(String(dnsStr), dns);
-          if(!ok){
-            sendText(client, String("{\"ok\":false,\"error\":\"invalid ip fields\"}"), "application/json", 400);
-            client.stop();
-            return;
-          }
-          netCfg.ip = ip;
-          netCfg.gw = gw;
-          netCfg.sn = sn;
-          netCfg.dns = dns;
-        }
-        netCfg.dhcp = dhcp;
-        if(!saveNetCfg()){
-          sendText(client, String("{\"ok\":false,\"error\":\"fs write failed\"}"), "application/json", 500);
-        } else {
-          sendText(client, String("{\"ok\":true,\"applied\":true}"), "application/json");
-          applyNetCfg();
-        }
+  const uint64_t nowMs = (uint64_t)esp_timer_get_time() / 1000;
+  uint64_t fromMs = 0, toMs = nowMs;
+  if(httpQueryParam(hc.query, "from", buf, sizeof(buf))) fromMs = strtoull(buf, nullptr, 10);
+  if(httpQueryParam(hc.query, "to", buf, sizeof(buf))) toMs = strtoull(buf, nullptr, 10);
+
+  String hdr = "HTTP/1.1 200 OK\r\n";
+  hdr += "Content-Type: application/json\r\n";
+  hdr += "Cache-Control: no-cache\r\n";
+  hdr += "Transfer-Encoding: chunked\r\n";
+  httpAddConnectionHeader(hdr);
+  hdr += "\r\n";
+  String head = "{\"now_ms\":" + String((unsigned long long)nowMs) + ",\"temps\":[";
+  for(uint8_t i=0;i<tempCount;i++){
+    if(i) head += ",";
+    head += "\"" + tempAddrToString(tempAddr[i]) + "\"";
+  }
+  head += "],\"points\":[";
+  snprintf(buf, sizeof(buf), "%x\r\n", head.length());
+  hdr += buf;
+  hdr += head;
+  hdr += "\r\n";
+  clientWriteString(client, hdr);
+
+  hc.hist = true;
+  hc.histFirst = true;
+  hc.histMask = mask;
+  hc.histSeq = 0;
+  hc.histFromDs = (uint32_t)(fromMs / 100);
+  hc.histToDs = (uint32_t)min<uint64_t>(toMs / 100, 0xFFFFFFFFull);
+}
+
+// {"sensors":[{"addr":"28FF...","res":11,"interval_s":30}]}: mise à jour par adresse;
+// un réglage égal aux valeurs par défaut est retiré.
+static void routePutTemps(HttpConn& hc, Client& client){
+  JsonDocument tmp;
+  if(deserializeJson(tmp, hc.body) || !tmp["sensors"].is<JsonArray>()){
+    sendText(client, String("{\"ok\":false,\"error\":\"sensors[] required\"}"), "application/json", 400);
+    return;
+  }
+  TempSensorCfg next[TEMP_MAX_SENSORS];
+  uint8_t nextCount = tempCfgCount;
+  memcpy(next, tempCfg, sizeof(next));
+  for(JsonVariant v : tmp["sensors"].as<JsonArray>()){
+    DeviceAddress addr;
+    const uint8_t res = v["res"] | TEMP_DEFAULT_RES;
+    const uint16_t interval = v["interval_s"] | TEMP_DEFAULT_INTERVAL_S;
+    if(!tempAddrFromString(v["addr"] | "", addr)){
+      sendText(client, String("{\"ok\":false,\"error\":\"bad addr\"}"), "application/json", 400);
+      return;
+    }
+    if(res < 9 || res > 12 || interval < 1 || interval > 3600){
+      sendText(client, String("{\"ok\":false,\"error\":\"res 9..12, interval_s 1..3600\"}"), "application/json", 400);
+      return;
+    }
+    int idx = -1;
+    for(uint8_t i=0;i<nextCount;i++) if(memcmp(next[i].addr, addr, sizeof(DeviceAddress)) == 0) idx = i;
+    if(res == TEMP_DEFAULT_RES && interval == TEMP_DEFAULT_INTERVAL_S){
+      if(idx >= 0) next[idx] = next[--nextCount];
+      continue;
+    }
+    if(idx < 0){
+      if(nextCount >= TEMP_MAX_SENSORS){
+        sendText(client, String("{\"ok\":false,\"error\":\"too many sensors\"}"), "application/json", 400);
+        return;
       }
+      idx = nextCount++;
+      memcpy(next[idx].addr, addr, sizeof(DeviceAddress));
     }
+    next[idx].res = res;
+    next[idx].intervalS = interval;
+  }
+  TempSensorCfg prev[TEMP_MAX_SENSORS];
+  const uint8_t prevCount = tempCfgCount;
+  memcpy(prev, tempCfg, sizeof(prev));
+  memcpy(tempCfg, next, sizeof(tempCfg));
+  tempCfgCount = nextCount;
+  if(!saveConfigStore()){
+    memcpy(tempCfg, prev, sizeof(tempCfg));
+    tempCfgCount = prevCount;
+    sendText(client, String("{\"ok\":false,\"error\":\"fs write failed\"}"), "application/json", 500);
+    return;
   }
-  else if(method=="PUT" && path=="/api/wifi"){
-    if(!authed){ sendAuthRequired(client); return; }
-    String body = readBody(client, contentLen);
-    JsonDocument tmp;
-    auto err = deserializeJson(tmp, body);
-    if(err){
-      sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
+  tempApplyCfg();
+  sendText(client, String("{\"ok\":true,\"applied\":true}"), "application/json");
+}
+
+static void routePutAuth(HttpConn& hc, Client& client){
+  const String& body = hc.body;
+  JsonDocument tmp;
+  auto err = deserializeJson(tmp, body);
+  if(err){
+    sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
+  } else {
+    const char* user = tmp["user"] | "";
+    const char* pass = tmp["pass"] | "";
+    if(String(user).length() == 0 || String(pass).length() == 0){
+      sendText(client, String("{\"ok\":false,\"error\":\"user/pass required\"}"), "application/json", 400);
     } else {
-      String errMsg;
-      bool restarting = false;
-      if(!applyWifiFromJson(tmp.as<JsonObject>(), errMsg, restarting)){
-        sendText(client, String("{\"ok\":false,\"error\":\"") + errMsg + "\"}", "application/json", 400);
+      authCfg.user = String(user);
+      authCfg.pass = String(pass);
+      if(!saveConfigStore()){
+        sendText(client, String("{\"ok\":false,\"error\":\"fs write failed\"}"), "application/json", 500);
       } else {
-        String out = String("{\"ok\":true,\"applied\":true,\"restarting\":") + (restarting ? "true" : "false") + "}";
-        sendText(client, out, "application/json");
+        sendText(client, String("{\"ok\":true}"), "application/json");
       }
     }
   }
-  else if(method=="PUT" && path=="/api/mqtt"){
-    if(!authed){ sendAuthRequired(client); return; }
-    String body = readBody(client, contentLen);
-    JsonDocument tmp;
-    auto err = deserializeJson(tmp, body);
-    if(err){
-      sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
+}
+
+static void routePutNet(HttpConn& hc, Client& client){
+  const String& body = hc.body;
+  JsonDocument tmp;
+  auto err = deserializeJson(tmp, body);
+  if(err){
+    sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
+  } else {
+    const char* mode = tmp["mode"] | "static";
+    bool dhcp = (strcmp(mode, "dhcp") == 0);
+    if(!(dhcp || strcmp(mode, "static")==0)){
+      sendText(client, String("{\"ok\":false,\"error\":\"mode must be dhcp|static\"}"), "application/json", 400);
     } else {
-      String errMsg;
-      if(!applyMqttFromJson(tmp.as<JsonObject>(), errMsg)){
-        sendText(client, String("{\"ok\":false,\"error\":\"") + errMsg + "\"}", "application/json", 400);
+      if(!dhcp){
+        IPAddress ip, gw, sn, dns;
+        bool ok = true;
+        const char* ipStr = tmp["ip"] | "";
+        const char* gwStr = tmp["gw"] | "";
+        const char* snStr = tmp["sn"] | "";
+        const char* dnsStr = tmp["dns"] | "";
+        ok &= parseIp(String(ipStr), ip);
+        ok &= parseIp(String(gwStr), gw);
+        ok &= parseIp(String(snStr), sn);
+        ok &= parseIp(String(dnsStr), dns);
+        if(!ok){
+          sendText(client, String("{\"ok\":false,\"error\":\"invalid ip fields\"}"), "application/json", 400);
+          return;
+        }
+        netCfg.ip = ip;
+        netCfg.gw = gw;
+        netCfg.sn = sn;
+        netCfg.dns = dns;
+      }
+      netCfg.dhcp = dhcp;
+      if(!saveConfigStore()){
+        sendText(client, String("{\"ok\":false,\"error\":\"fs write failed\"}"), "application/json", 500);
       } else {
         sendText(client, String("{\"ok\":true,\"applied\":true}"), "application/json");
+        applyNetCfg();
       }
     }
   }
-  else if(method=="POST" && path=="/api/ota"){
-    if(!authed){ sendAuthRequired(client); return; }
-    if(contentLen <= 0 || contentType.indexOf("application/octet-stream") < 0){
-      sendText(client, String("{\"ok\":false,\"error\":\"octet-stream required\"}"), "application/json", 400);
-      client.stop();
-      return;
+}
+
+static void routePutWifi(HttpConn& hc, Client& client){
+  const String& body = hc.body;
+  JsonDocument tmp;
+  auto err = deserializeJson(tmp, body);
+  if(err){
+    sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
+  } else {
+    String errMsg;
+    bool restarting = false;
+    if(!applyWifiFromJson(tmp.as<JsonObject>(), errMsg, restarting)){
+      sendText(client, String("{\"ok\":false,\"error\":\"") + errMsg + "\"}", "application/json", 400);
+    } else {
+      String out = String("{\"ok\":true,\"applied\":true,\"restarting\":") + (restarting ? "true" : "false") + "}";
+      sendText(client, out, "application/json");
     }
+  }
+}
+
+static void routePutMqtt(HttpConn& hc, Client& client){
+  const String& body = hc.body;
+  JsonDocument tmp;
+  auto err = deserializeJson(tmp, body);
+  if(err){
+    sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
+  } else {
     String errMsg;
-    if(!handleOtaStream(client, contentLen, false, checksumSha256, errMsg)){
+    if(!applyMqttFromJson(tmp.as<JsonObject>(), errMsg)){
       sendText(client, String("{\"ok\":false,\"error\":\"") + errMsg + "\"}", "application/json", 400);
     } else {
-      sendText(client, String("{\"ok\":true,\"reboot\":true}"), "application/json");
-      delay(200);
-      ESP.restart();
+      sendText(client, String("{\"ok\":true,\"applied\":true}"), "application/json");
     }
   }
-  else if(method=="POST" && path=="/api/otafs"){
-    if(!authed){ sendAuthRequired(client); return; }
-    if(contentLen <= 0 || contentType.indexOf("application/octet-stream") < 0){
-      sendText(client, String("{\"ok\":false,\"error\":\"octet-stream required\"}"), "application/json", 400);
-      client.stop();
-      return;
-    }
-    String errMsg;
-    if(!handleOtaStream(client, contentLen, true, checksumSha256, errMsg)){
-      sendText(client, String("{\"ok\":false,\"error\":\"") + errMsg + "\"}", "application/json", 400);
-    } else {
-      sendText(client, String("{\"ok\":true,\"reboot\":true}"), "application/json");
-      delay(200);
-      ESP.restart();
-    }
-  }
-  else if(method=="PUT" && path=="/api/backup"){
-    if(!authed){ sendAuthRequired(client); return; }
-    String body = readBody(client, contentLen);
-    JsonDocument tmp;
-    auto err = deserializeJson(tmp, body);
-    if(err){
-      sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
+}
+
+static void routePostOta(HttpConn& hc, Client& client){
+  if(hc.contentLen <= 0 || strstr(hc.contentType, "application/octet-stream") == nullptr){
+    sendText(client, String("{\"ok\":false,\"error\":\"octet-stream required\"}"), "application/json", 400);
+    client.stop();
+    return;
+  }
+  String errMsg;
+  if(!handleOtaStream(client, hc.contentLen, false, hc.checksumSha256, errMsg)){
+    sendText(client, String("{\"ok\":false,\"error\":\"") + errMsg + "\"}", "application/json", 400);
+  } else {
+    sendText(client, String("{\"ok\":true,\"reboot\":true}"), "application/json");
+    cfgFlushTick(true);
+    delay(200);
+    ESP.restart();
+  }
+}
+
+static void routePostOtafs(HttpConn& hc, Client& client){
+  if(hc.contentLen <= 0 || strstr(hc.contentType, "application/octet-stream") == nullptr){
+    sendText(client, String("{\"ok\":false,\"error\":\"octet-stream required\"}"), "application/json", 400);
+    client.stop();
+    return;
+  }
+  String errMsg;
+  if(!handleOtaStream(client, hc.contentLen, true, hc.checksumSha256, errMsg)){
+    sendText(client, String("{\"ok\":false,\"error\":\"") + errMsg + "\"}", "application/json", 400);
+  } else {
+    sendText(client, String("{\"ok\":true,\"reboot\":true}"), "application/json");
+    delay(200);
+    ESP.restart();
+  }
+}
+
+static void routePutBackup(HttpConn& hc, Client& client){
+  const String& body = hc.body;
+  JsonDocument tmp;
+  auto err = deserializeJson(tmp, body);
+  if(err){
+    sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
+  } else {
+    if(!tmp["rules"].is<JsonObject>() || !tmp["net"].is<JsonObject>() || !tmp["mqtt"].is<JsonObject>()){
+      sendText(client, String("{\"ok\":false,\"error\":\"backup must contain rules, net, mqtt\"}"), "application/json", 400);
     } else {
-      if(!tmp["rules"].is<JsonObject>() || !tmp["net"].is<JsonObject>() || !tmp["mqtt"].is<JsonObject>()){
-        sendText(client, String("{\"ok\":false,\"error\":\"backup must contain rules, net, mqtt\"}"), "application/json", 400);
+      String msg, errMsg;
+      JsonDocument rulesTmp;
+      rulesTmp.set(tmp["rules"]);
+      NetConfig netNext;
+      MqttConfig mqttNext;
+      if(!validateRulesDocNoSideEffects(rulesTmp, msg)){
+        JsonDocument e;
+        e["ok"]=false; e["error"]=msg;
+        String out; serializeJson(e,out);
+        sendText(client, out, "application/json", 400);
+      } else if(!parseNetFromJson(tmp["net"].as<JsonObject>(), netNext, errMsg)){
+        sendText(client, String("{\"ok\":false,\"error\":\"") + errMsg + "\"}", "application/json", 400);
+      } else if(!parseMqttFromJson(tmp["mqtt"].as<JsonObject>(), mqttNext, errMsg)){
+        sendText(client, String("{\"ok\":false,\"error\":\"") + errMsg + "\"}", "application/json", 400);
       } else {
-        String msg, errMsg;
-        JsonDocument rulesTmp;
-        rulesTmp.set(tmp["rules"]);
-        NetConfig netNext;
-        MqttConfig mqttNext;
-        if(!validateRulesDocNoSideEffects(rulesTmp, msg)){
-          JsonDocument e;
-          e["ok"]=false; e["error"]=msg;
-          String out; serializeJson(e,out);
-          sendText(client, out, "application/json", 400);
-        } else if(!parseNetFromJson(tmp["net"].as<JsonObject>(), netNext, errMsg)){
-          sendText(client, String("{\"ok\":false,\"error\":\"") + errMsg + "\"}", "application/json", 400);
-        } else if(!parseMqttFromJson(tmp["mqtt"].as<JsonObject>(), mqttNext, errMsg)){
-          sendText(client, String("{\"ok\":false,\"error\":\"") + errMsg + "\"}", "application/json", 400);
-        } else {
-          // Snapshot current state for rollback in case one FS write fails.
-          JsonDocument rulesPrev;
-          rulesPrev.set(rulesDoc);
-          NetConfig netPrev = netCfg;
-          MqttConfig mqttPrev = mqttCfg;
+        // Snapshot current state for rollback in case one FS write fails.
+        JsonDocument rulesPrev;
+        rulesPrev.set(rulesDoc);
+        NetConfig netPrev = netCfg;
+        MqttConfig mqttPrev = mqttCfg;
 
-          bool ok = true;
-          String commitErr;
+        bool ok = true;
+        String commitErr;
 
-          rulesDoc.clear();
-          rulesDoc.set(rulesTmp);
-          rebuildRuntimeFromRules();
-          if(!saveRulesToFS(rulesDoc)){
-            ok = false;
-            commitErr = "rules fs write failed";
-          }
+        rulesDoc.clear();
+        rulesDoc.set(rulesTmp);
+        rebuildRuntimeFromRules();
+        if(!saveRulesToFS(rulesDoc)){
+          ok = false;
+          commitErr = "rules fs write failed";
+        }
 
-          if(ok){
-            netCfg = netNext;
-            if(!saveNetCfg()){
-              ok = false;
-              commitErr = "net fs write failed";
-            } else {
-              applyNetCfg();
-            }
+        if(ok){
+          netCfg = netNext;
+          if(!saveConfigStore()){
+            ok = false;
+            commitErr = "net fs write failed";
+          } else {
+            applyNetCfg();
           }
+        }
 
-          if(ok){
-            mqttCfg = mqttNext;
-            if(!saveMqttCfg()){
-              ok = false;
-              commitErr = "mqtt fs write failed";
-            } else {
-              mqttOnConfigApplied();
-            }
+        if(ok){
+          mqttCfg = mqttNext;
+          if(!saveConfigStore()){
+            ok = false;
+            commitErr = "mqtt fs write failed";
+          } else {
+            mqttOnConfigApplied();
           }
+        }
 
-          if(!ok){
-            // Rollback all configs to keep backup restore coherent.
-            rulesDoc.clear();
-            rulesDoc.set(rulesPrev);
-            saveRulesToFS(rulesDoc);
-            rebuildRuntimeFromRules();
+        if(!ok){
+          // Rollback all configs to keep backup restore coherent.
+          rulesDoc.clear();
+          rulesDoc.set(rulesPrev);
+          saveRulesToFS(rulesDoc);
+          rebuildRuntimeFromRules();
 
-            netCfg = netPrev;
-            saveNetCfg();
-            applyNetCfg();
+          netCfg = netPrev;
+          saveConfigStore();
+          applyNetCfg();
 
-            mqttCfg = mqttPrev;
-            saveMqttCfg();
-            mqttOnConfigApplied();
+          mqttCfg = mqttPrev;
+          saveConfigStore();
+          mqttOnConfigApplied();
 
-            sendText(client, String("{\"ok\":false,\"error\":\"") + commitErr + "\"}", "application/json", 500);
-          } else {
-            sendText(client, String("{\"ok\":true,\"applied\":true,\"reboot\":true}"), "application/json");
-            delay(200);
-            ESP.restart();
-          }
+          sendText(client, String("{\"ok\":false,\"error\":\"") + commitErr + "\"}", "application/json", 500);
+        } else {
+          sendText(client, String("{\"ok\":true,\"applied\":true,\"reboot\":true}"), "application/json");
+          hc.rebootAfterSend = true;
         }
       }
     }
   }
-  else if(method=="PUT" && path=="/api/rules"){
-    if(!authed){ sendAuthRequired(client); return; }
-    String body = readBody(client, contentLen);
+}
+
+static void routePutRules(HttpConn& hc, Client& client){
+  const String& body = hc.body;
 
-    JsonDocument tmp;
-    auto err = deserializeJson(tmp, body);
-    if(err){
-      sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
+  JsonDocument tmp;
+  auto err = deserializeJson(tmp, body);
+  if(err){
+    sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
+  } else {
+    String msg;
+    if(!validateRulesDocNoSideEffects(tmp, msg)){
+      JsonDocument e;
+      e["ok"]=false; e["error"]=msg;
+      String out; serializeJson(e,out);
+      sendText(client, out, "application/json", 400);
     } else {
-      String msg;
-      if(!validateRulesDocNoSideEffects(tmp, msg)){
-        JsonDocument e;
-        e["ok"]=false; e["error"]=msg;
-        String out; serializeJson(e,out);
-        sendText(client, out, "application/json", 400);
-      } else {
-        // appliquer + sauver
-        rulesDoc.clear();
-        rulesDoc.set(tmp);
-        rebuildRuntimeFromRules();
+      // appliquer + sauver
+      rulesDoc.clear();
+      rulesDoc.set(tmp);
+      rebuildRuntimeFromRules();
 
-        if(!saveRulesToFS(rulesDoc)){
-          sendText(client, String("{\"ok\":false,\"error\":\"fs write failed\"}"), "application/json", 500);
-        } else {
-          sendText(client, String("{\"ok\":true,\"applied\":true}"), "application/json");
-        }
+      if(!saveRulesToFS(rulesDoc)){
+        sendText(client, String("{\"ok\":false,\"error\":\"fs write failed\"}"), "application/json", 500);
+      } else {
+        sendText(client, String("{\"ok\":true,\"applied\":true}"), "application/json");
       }
     }
   }
-  else if(method=="POST" && path=="/api/override"){
-    if(!authed){ sendAuthRequired(client); return; }
-    // Strict protection: refuse override on reserved relays
-    String body = readBody(client, contentLen);
-    JsonDocument doc;
-    auto err = deserializeJson(doc, body);
-    if(err){
-      sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
+}
+
+static void routePostOverride(HttpConn& hc, Client& client){
+  // Strict protection: refuse override on reserved relays
+  const String& body = hc.body;
+  JsonDocument doc;
+  auto err = deserializeJson(doc, body);
+  if(err){
+    sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
+  } else {
+    int r = doc["relay"] | 1; // 1..totalRelays
+    const char* mode = doc["mode"] | "AUTO";
+    if(r < 1 || r > totalRelays){
+      sendText(client, String("{\"ok\":false,\"error\":\"relay out of range\"}"), "application/json", 400);
     } else {
-      int r = doc["relay"] | 1; // 1..totalRelays
-      const char* mode = doc["mode"] | "AUTO";
-      if(r < 1 || r > totalRelays){
-        sendText(client, String("{\"ok\":false,\"error\":\"relay out of range\"}"), "application/json", 400);
+      int idx = r-1;
+      if(reservedByShutter[idx]){
+        sendText(client, String("{\"ok\":false,\"error\":\"relay reserved by shutter\"}"), "application/json", 400);
       } else {
-        int idx = r-1;
-        if(reservedByShutter[idx]){
-          sendText(client, String("{\"ok\":false,\"error\":\"relay reserved by shutter\"}"), "application/json", 400);
+        int8_t v;
+        if(strcmp(mode,"AUTO")==0) v = -1;
+        else if(strcmp(mode,"FORCE_ON")==0) v = 1;
+        else if(strcmp(mode,"FORCE_OFF")==0) v = 0;
+        else {
+          sendText(client, String("{\"ok\":false,\"error\":\"mode must be AUTO|FORCE_ON|FORCE_OFF\"}"), "application/json", 400);
+          return;
+        }
+        if(!controlPost(CC_OVERRIDE, (uint8_t)idx, v)){
+          sendText(client, String("{\"ok\":false,\"error\":\"control busy\"}"), "application/json", 500);
         } else {
-          if(strcmp(mode,"AUTO")==0) overrideRelay[idx] = -1;
-          else if(strcmp(mode,"FORCE_ON")==0) overrideRelay[idx] = 1;
-          else if(strcmp(mode,"FORCE_OFF")==0) overrideRelay[idx] = 0;
-          else {
-            sendText(client, String("{\"ok\":false,\"error\":\"mode must be AUTO|FORCE_ON|FORCE_OFF\"}"), "application/json", 400);
-            client.stop();
-            return;
-          }
           sendText(client, String("{\"ok\":true}"), "application/json");
         }
       }
     }
   }
-  else if(method=="POST" && path=="/api/shutter"){
-    if(!authed){ sendAuthRequired(client); return; }
-    // Commande volet: { "id":1|2, "cmd":"UP|DOWN|STOP|AUTO" }
-    String body = readBody(client, contentLen);
-    JsonDocument doc;
-    auto err = deserializeJson(doc, body);
-    if(err){
-      sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
+}
+
+static void routePostShutter(HttpConn& hc, Client& client){
+  // Commande volet: { "id":1|2, "cmd":"UP|DOWN|STOP|AUTO" }
+  const String& body = hc.body;
+  JsonDocument doc;
+  auto err = deserializeJson(doc, body);
+  if(err){
+    sendText(client, String("{\"ok\":false,\"error\":\"bad json\"}"), "application/json", 400);
+  } else {
+    const char* cmd = doc["cmd"] | "STOP";
+    int sid = doc["id"] | 1;
+    if(sid < 1 || sid > shuttersLimit()){
+      sendText(client, String("{\"ok\":false,\"error\":\"id out of range\"}"), "application/json", 400);
+    } else if(!shCfg[sid-1].enabled){
+      sendText(client, String("{\"ok\":false,\"error\":\"no shutter configured\"}"), "application/json", 400);
+    } else if(strcmp(cmd,"UP")==0){
+      sendShutterCmdResult(client, controlPost(CC_SHUTTER, (uint8_t)(sid-1), MC_UP));
+    } else if(strcmp(cmd,"DOWN")==0){
+      sendShutterCmdResult(client, controlPost(CC_SHUTTER, (uint8_t)(sid-1), MC_DOWN));
+    } else if(strcmp(cmd,"STOP")==0){
+      sendShutterCmdResult(client, controlPost(CC_SHUTTER, (uint8_t)(sid-1), MC_STOP));
+    } else if(strcmp(cmd,"AUTO")==0){
+      // option: rendre la main aux boutons (désactive le manuel)
+      sendShutterCmdResult(client, controlPost(CC_SHUTTER, (uint8_t)(sid-1), MC_NONE));
     } else {
-      const char* cmd = doc["cmd"] | "STOP";
-      int sid = doc["id"] | 1;
-      if(sid < 1 || sid > shuttersLimit()){
-        sendText(client, String("{\"ok\":false,\"error\":\"id out of range\"}"), "application/json", 400);
-      } else if(!shCfg[sid-1].enabled){
-        sendText(client, String("{\"ok\":false,\"error\":\"no shutter configured\"}"), "application/json", 400);
-      } else if(strcmp(cmd,"UP")==0){
-        shRt[sid-1].manual = MC_UP;
-        sendText(client, String("{\"ok\":true}"), "application/json");
-      } else if(strcmp(cmd,"DOWN")==0){
-        shRt[sid-1].manual = MC_DOWN;
-        sendText(client, String("{\"ok\":true}"), "application/json");
-      } else if(strcmp(cmd,"STOP")==0){
-        shRt[sid-1].manual = MC_STOP;
-        sendText(client, String("{\"ok\":true}"), "application/json");
-      } else if(strcmp(cmd,"AUTO")==0){
-        // option: rendre la main aux boutons (désactive le manuel)
-        shRt[sid-1].manual = MC_NONE;
-        sendText(client, String("{\"ok\":true}"), "application/json");
-      } else {
-        sendText(client, String("{\"ok\":false,\"error\":\"cmd must be UP|DOWN|STOP|AUTO\"}"), "application/json", 400);
-      }
+      sendText(client, String("{\"ok\":false,\"error\":\"cmd must be UP|DOWN|STOP|AUTO\"}"), "application/json", 400);
     }
   }
-  else if(method=="GET" && fromWifi && wifiApOn && (
-      path=="/generate_204" || path=="/gen_204" ||
-      path=="/hotspot-detect.html" || path=="/success.txt" ||
-      path=="/ncsi.txt" || path=="/connecttest.txt"
-    )){
+}
+
+struct HttpRoute {
+  const char* method;
+  const char* path;
+  bool auth;    // Basic auth requise
+  bool rawBody; // corps non bufferisé: le handler le lit sur le socket
+  HttpRouteFn fn;
+};
+
+static const HttpRoute HTTP_ROUTES[] = {
+  {"GET", "/", false, false, routeGetIndex},
+  {"GET", "/index.html", false, false, routeGetIndex},
+  {"GET", "/i18n_en.json", false, false, routeGetI18n},
+  {"GET", "/i18n_fr.json", false, false, routeGetI18n},
+  {"GET", "/api/state", false, false, routeGetState},
+  {"GET", "/api/events", false, false, routeGetEvents},
+  {"GET", "/api/auth", true, false, routeGetAuth},
+  {"GET", "/api/rules", true, false, routeGetRules},
+  {"GET", "/api/net", true, false, routeGetNet},
+  {"GET", "/api/wifi", true, false, routeGetWifi},
+  {"GET", "/api/mqtt", true, false, routeGetMqtt},
+  {"GET", "/api/backup", true, false, routeGetBackup},
+  {"GET", "/api/temps", true, false, routeGetTemps},
+  {"GET", "/api/metrics", true, false, routeGetMetrics},
+  {"GET", "/api/history", true, false, routeGetHistory},
+  {"PUT", "/api/auth", true, false, routePutAuth},
+  {"PUT", "/api/net", true, false, routePutNet},
+  {"PUT", "/api/wifi", true, false, routePutWifi},
+  {"PUT", "/api/mqtt", true, false, routePutMqtt},
+  {"POST", "/api/ota", true, true, routePostOta},
+  {"POST", "/api/otafs", true, true, routePostOtafs},
+  {"PUT", "/api/backup", true, false, routePutBackup},
+  {"PUT", "/api/temps", true, false, routePutTemps},
+  {"PUT", "/api/rules", true, false, routePutRules},
+  {"POST", "/api/override", true, false, routePostOverride},
+  {"POST", "/api/shutter", true, false, routePostShutter},
+};
+
+static const HttpRoute* httpFindRoute(const char* method, const char* path){
+  for(const HttpRoute& r : HTTP_ROUTES){
+    if(strcmp(r.path, path) == 0 && strcmp(r.method, method) == 0) return &r;
+  }
+  return nullptr;
+}
+
+// Sondes "captive portal" des OS (Android, iOS/macOS, Windows, Firefox)
+static bool isCaptiveProbePath(const char* path){
+  static const char* const probes[] = {
+    "/generate_204", "/gen_204", "/hotspot-detect.html", "/success.txt", "/ncsi.txt", "/connecttest.txt"
+  };
+  for(const char* p : probes) if(strcmp(path, p) == 0) return true;
+  return false;
+}
+
+static void handleHttpClient(HttpConn& hc, Client& client){
+  const HttpRoute* r = httpFindRoute(hc.method, hc.path);
+  if(r){
+    if(r->auth && !checkAuthHeader(hc.authHeader)) sendAuthRequired(client);
+    else r->fn(hc, client);
+    return;
+  }
+
+  // AP WiFi: toute page inconnue (et les sondes des OS) renvoie vers l'UI
+  const bool isGet = strcmp(hc.method, "GET") == 0;
+  if(isGet && hc.fromWifi && wifiApOn && (isCaptiveProbePath(hc.path) || strncmp(hc.path, "/api", 4) != 0)){
+    httpKeepAliveReply = false; // pas de Content-Length: fin de réponse = fermeture
     client.println("HTTP/1.1 302 Found");
     client.print("Location: http://"); client.print(WiFi.softAPIP().toString()); client.println("/");
     client.println("Cache-Control: no-cache");
     client.println("Connection: close");
     client.println();
+  } else {
+    sendText(client, "not found\n", "text/plain", 404);
+  }
+}
+
+// Prépare la lecture de la requête suivante (même connexion).
+static void httpRequestReset(HttpConn& hc){
+  if(hc.file) hc.file.close();
+  hc.reqLen = 0;
+  hc.lineStart = 0;
+  hc.gotRequestLine = false;
+  hc.method = "";
+  hc.path = "";
+  hc.query = "";
+  hc.authHeader = "";
+  hc.contentType = "";
+  hc.checksumSha256 = "";
+  hc.ifNoneMatch = "";
+  hc.acceptGzip = false;
+  hc.contentLen = 0;
+  hc.body = String();
+  hc.out = String();
+  hc.outOff = 0;
+  hc.fileLen = 0;
+  hc.fileOff = 0;
+  hc.rebootAfterSend = false;
+  hc.stream = false;
+  hc.hist = false;
+  hc.keepAlive = false;
+}
+
+static void httpConnReset(HttpConn& hc){
+  httpRequestReset(hc);
+  hc.st = HC_FREE;
+  hc.requests = 0;
+}
+
+static void httpConnClose(HttpConn& hc){
+  hc.client().stop();
+  const bool reboot = hc.rebootAfterSend;
+  httpConnReset(hc);
+  if(reboot){
+    cfgFlushTick(true);
+    delay(200);
+    ESP.restart();
+  }
+}
+
+static void httpStartSend(HttpConn& hc){
+  hc.outOff = 0;
+  hc.st = HC_SEND;
+  hc.lastIoMs = millis();
+}
+
+static void httpDispatch(HttpConn& hc){
+  HttpResponseWriter w(hc.out);
+  httpKeepAliveReply = hc.keepAlive && (uint8_t)(hc.requests + 1) < HTTP_KEEPALIVE_MAX_REQ;
+  handleHttpClient(hc, w);
+  hc.keepAlive = httpKeepAliveReply && !hc.rebootAfterSend && !hc.stream;
+  httpKeepAliveReply = false;
+  hc.requests++;
+  hc.body = String();
+  httpStartSend(hc);
+}
+
+// "GET /path?query HTTP/1.1": découpée sur place (espaces et '?' remplacés par '\0')
+static void httpParseRequestLine(HttpConn& hc, char* req){
+  char* sp1 = strchr(req, ' ');
+  char* sp2 = sp1 ? strchr(sp1 + 1, ' ') : nullptr;
+  if (!sp1 || sp1 == req || !sp2 || sp2 == sp1 + 1) {
+    HttpResponseWriter w(hc.out);
+    sendText(w, "bad request\n", "text/plain", 400);
+    httpStartSend(hc);
+    return;
+  }
+  *sp1 = '\0';
+  *sp2 = '\0';
+  hc.method = req;
+  // HTTP/1.1: persistante par défaut; HTTP/1.0: seulement si demandé
+  hc.keepAlive = strcmp(sp2 + 1, "HTTP/1.1") == 0;
+  char* url = sp1 + 1;
+  char* q = strchr(url, '?');
+  if(q){ *q = '\0'; hc.query = q + 1; }
+  hc.path = url;
+  hc.gotRequestLine = true;
+}
+
+// Recherche insensible à la casse d'un jeton dans une valeur d'en-tête
+static bool httpHasToken(const char* value, const char* token){
+  const size_t n = strlen(token);
+  for(; *value; value++) if(strncasecmp(value, token, n) == 0) return true;
+  return false;
+}
+
+static void httpParseHeader(HttpConn& hc, char* h){
+  char* colon = strchr(h, ':');
+  if(!colon) return;
+  *colon = '\0';
+  char* value = colon + 1;
+  while(*value == ' ' || *value == '\t') value++;
+  char* end = value + strlen(value);
+  while(end > value && (end[-1] == ' ' || end[-1] == '\t')) *--end = '\0';
+  if(strcasecmp(h, "content-length") == 0) hc.contentLen = atoi(value);
+  else if(strcasecmp(h, "authorization") == 0) hc.authHeader = value;
+  else if(strcasecmp(h, "content-type") == 0) hc.contentType = value;
+  else if(strcasecmp(h, "x-checksum-sha256") == 0) hc.checksumSha256 = value;
+  else if(strcasecmp(h, "if-none-match") == 0) hc.ifNoneMatch = value;
+  else if(strcasecmp(h, "connection") == 0){
+    if(httpHasToken(value, "close")) hc.keepAlive = false;
+    else if(httpHasToken(value, "keep-alive")) hc.keepAlive = true;
+  }
+  else if(strcasecmp(h, "accept-encoding") == 0) hc.acceptGzip = httpHasToken(value, "gzip");
+}
+
+static void httpHeadersDone(HttpConn& hc){
+  const HttpRoute* r = httpFindRoute(hc.method, hc.path);
+  if(r && r->rawBody){
+    // flux binaire de plusieurs Mo: traité directement sur le socket (reboot ensuite)
+    hc.keepAlive = false;
+    handleHttpClient(hc, hc.client());
+    httpStartSend(hc);
+    return;
+  }
+  if(hc.contentLen > HTTP_MAX_BODY){
+    hc.keepAlive = false; // corps non lu: la connexion n'est plus réutilisable
+    HttpResponseWriter w(hc.out);
+    sendText(w, String("{\"ok\":false,\"error\":\"body too large\"}"), "application/json", 400);
+    httpStartSend(hc);
+    return;
   }
-  else{
-    if(fromWifi && wifiApOn && method=="GET" && !path.startsWith("/api") && path != "/i18n_en.json" && path != "/i18n_fr.json"){
-      client.println("HTTP/1.1 302 Found");
-      client.print("Location: http://"); client.print(WiFi.softAPIP().toString()); client.println("/");
-      client.println("Cache-Control: no-cache");
-      client.println("Connection: close");
-      client.println();
+  if(hc.contentLen > 0){
+    hc.body.reserve(hc.contentLen);
+    hc.st = HC_BODY;
+    return;
+  }
+  httpDispatch(hc);
+}
+
+static void httpHeadersTooLong(HttpConn& hc){
+  hc.keepAlive = false;
+  HttpResponseWriter w(hc.out);
+  sendText(w, "bad request\n", "text/plain", 400);
+  httpStartSend(hc);
+}
+
+static void httpReadHeaders(HttpConn& hc){
+  Client& c = hc.client();
+  int budget = HTTP_REQ_BUF;
+  while(budget-- > 0 && c.available()){
+    char ch = (char)c.read();
+    hc.lastIoMs = millis();
+    if(ch == '\r') continue;
+    // reqLen peut atteindre HTTP_REQ_BUF après une ligne pleine (reqLen++ du terminateur)
+    if(hc.reqLen >= HTTP_REQ_BUF - 1){
+      httpHeadersTooLong(hc);
+      return;
+    }
+    if(ch != '\n'){
+      hc.reqBuf[hc.reqLen++] = ch;
+      continue;
+    }
+    // fin de ligne: on la termine et la suivante commence juste après
+    hc.reqBuf[hc.reqLen] = '\0';
+    char* line = hc.reqBuf + hc.lineStart;
+    const bool empty = hc.reqLen == hc.lineStart;
+    if(!hc.gotRequestLine){
+      if(empty) continue; // CRLF parasite avant la requête
+      hc.reqLen++;
+      hc.lineStart = hc.reqLen;
+      httpParseRequestLine(hc, line);
+    } else if(empty){
+      httpHeadersDone(hc);
+      return;
     } else {
-      sendText(client, "not found\n", "text/plain", 404);
+      hc.reqLen++;
+      hc.lineStart = hc.reqLen;
+      httpParseHeader(hc, line);
     }
+    if(hc.st != HC_HEADERS) return;
   }
+}
 
-  delay(5);
-  client.stop();
+static void httpReadBody(HttpConn& hc){
+  Client& c = hc.client();
+  uint8_t buf[256];
+  while((int)hc.body.length() < hc.contentLen && c.available()){
+    size_t want = (size_t)(hc.contentLen - (int)hc.body.length());
+    if(want > sizeof(buf)) want = sizeof(buf);
+    int n = c.read(buf, want);
+    if(n <= 0) break;
+    hc.body.concat((const char*)buf, (unsigned)n);
+    hc.lastIoMs = millis();
+  }
+  if((int)hc.body.length() >= hc.contentLen) httpDispatch(hc);
 }
 
-static void handleHttp(){
-  EthernetClient ethClient = server.available();
-  if(ethClient) {
-    handleHttpClient(ethClient, false);
+// Un bloc au plus par appel: chaque connexion avance sans bloquer les autres.
+static void httpWriteSome(HttpConn& hc){
+  Client& c = hc.client();
+  const uint32_t now = millis();
+  size_t room = HTTP_TX_CHUNK;
+  if(!hc.fromWifi){
+    int a = hc.eth.availableForWrite();
+    if(a <= 0) room = 0;
+    else if((size_t)a < room) room = (size_t)a;
+  }
+
+  const uint8_t* data = nullptr;
+  size_t len = 0;
+  if(hc.outOff < hc.out.length()){
+    data = (const uint8_t*)hc.out.c_str() + hc.outOff;
+    len = hc.out.length() - hc.outOff;
+  } else if(hc.file){
+    if(hc.fileOff >= hc.fileLen){
+      int n = hc.file.read(hc.fileBuf, sizeof(hc.fileBuf));
+      if(n <= 0){
+        hc.file.close();
+        return;
+      }
+      hc.fileLen = (uint16_t)n;
+      hc.fileOff = 0;
+    }
+    data = hc.fileBuf + hc.fileOff;
+    len = hc.fileLen - hc.fileOff;
+  } else if(hc.hist){
+    histFill(hc);
+    return;
+  } else {
+    hc.lastIoMs = now;
+    if(hc.stream) hc.st = HC_STREAM;
+    else if(hc.keepAlive){
+      // requête suivante (éventuellement déjà reçue: pipelining)
+      httpRequestReset(hc);
+      hc.st = HC_HEADERS;
+    }
+    else hc.st = HC_CLOSING;
+    return;
+  }
+
+  if(len > room) len = room;
+  int w = (len > 0) ? c.write(data, len) : 0;
+  if(w > 0){
+    hc.lastIoMs = now;
+    if(hc.outOff < hc.out.length()){
+      hc.outOff += (size_t)w;
+      if(hc.outOff >= hc.out.length()){ hc.out = String(); hc.outOff = 0; }
+    } else {
+      hc.fileOff += (uint16_t)w;
+    }
+  } else if(now - hc.lastIoMs > HTTP_SEND_TIMEOUT_MS){
+    httpConnClose(hc);
+  }
+}
+
+static void httpPoll(HttpConn& hc){
+  if(hc.st == HC_FREE) return;
+  Client& c = hc.client();
+  const uint32_t now = millis();
+  switch(hc.st){
+    case HC_HEADERS:
+    case HC_BODY:
+      if(!c.connected() && !c.available()){ httpConnClose(hc); return; }
+      if(hc.st == HC_HEADERS) httpReadHeaders(hc);
+      else httpReadBody(hc);
+      if(hc.st == HC_HEADERS || hc.st == HC_BODY){
+        const bool idleBetween = hc.st == HC_HEADERS && hc.requests > 0 && !hc.gotRequestLine && hc.reqLen == 0;
+        if(now - hc.lastIoMs > (idleBetween ? HTTP_KEEPALIVE_IDLE_MS : HTTP_IDLE_TIMEOUT_MS)) httpConnClose(hc);
+      }
+      break;
+    case HC_SEND:
+      if(!c.connected()){ httpConnClose(hc); return; }
+      httpWriteSome(hc);
+      break;
+    case HC_CLOSING:
+      while(c.available()) c.read();
+      if(!c.connected() || now - hc.lastIoMs > HTTP_CLOSE_WAIT_MS) httpConnClose(hc);
+      break;
+    case HC_STREAM:
+      if(!c.connected()){ httpConnClose(hc); return; }
+      while(c.available()) c.read();
+      sseTick(hc);
+      break;
+    default:
+      break;
+  }
+}
+
+static HttpConn* httpFreeSlot(){
+  for(uint8_t i=0;i<HTTP_MAX_CONN;i++){
+    if(httpConns[i].st == HC_FREE) return &httpConns[i];
+  }
+  return nullptr;
+}
+
+static void httpOpen(HttpConn& hc, bool fromWifi){
+  httpConnReset(hc);
+  hc.fromWifi = fromWifi;
+  hc.st = HC_HEADERS;
+  hc.lastIoMs = millis();
+}
+
+// Connexion keep-alive inactive la plus ancienne (libérable pour un nouveau client).
+static HttpConn* httpIdleKeepAlive(){
+  HttpConn* best = nullptr;
+  for(uint8_t i=0;i<HTTP_MAX_CONN;i++){
+    HttpConn& hc = httpConns[i];
+    if(hc.st != HC_HEADERS || hc.requests == 0 || hc.gotRequestLine || hc.reqLen > 0) continue;
+    if(!best || (int32_t)(hc.lastIoMs - best->lastIoMs) < 0) best = &hc;
   }
+  return best;
+}
+
+static HttpConn* httpSlotForNewClient(){
+  HttpConn* hc = httpFreeSlot();
+  if(hc) return hc;
+  hc = httpIdleKeepAlive();
+  if(hc) httpConnClose(*hc);
+  return hc;
+}
 
+// Sans slot libre ni keep-alive inactive, la connexion reste en attente côté W5500/lwIP.
+static void httpAccept(){
+  if(!httpFreeSlot() && !httpIdleKeepAlive()) return;
+  HttpConn* hc = nullptr;
+  EthernetClient ethClient = server.accept();
+  if(ethClient){
+    hc = httpSlotForNewClient();
+    httpOpen(*hc, false);
+    hc->eth = ethClient;
+    hc->eth.setConnectionTimeout(100); // borne le stop() bloquant de la lib Ethernet
+    if(!httpFreeSlot() && !httpIdleKeepAlive()) return;
+  }
   if(wifiApOn){
-    wifiDns.processNextRequest();
     WiFiClient wifiClient = wifiServer.available();
-    if(wifiClient) {
-      handleHttpClient(wifiClient, true);
+    if(wifiClient){
+      hc = httpSlotForNewClient();
+      httpOpen(*hc, true);
+      hc->wifi = wifiClient;
     }
   }
 }
 
+static void handleHttp(){
+  if(wifiApOn) wifiDns.processNextRequest();
+  httpAccept();
+  for(uint8_t i=0;i<HTTP_MAX_CONN;i++) httpPoll(httpConns[i]);
+}
+
 // ===============================================================
 // Setup / Loop
 // ===============================================================
+// Tâche réseau (cœur 0): HTTP, MQTT/GSM, WiFi/BLE, capteurs lents.
+// Peut bloquer sans retarder la tâche contrôle.
+static void netStep() {
+  const int64_t tStep = metricStart();
+  // Serve HTTP first to keep UI/API responsive even if other tasks slow down.
+  int64_t t = metricStart();
+  handleHttp();
+  metricStop(MS_HTTP, t);
+
+  // GSM bring-up advances one short AT exchange at a time.
+  t = metricStart();
+  gsmStep();
+  metricStop(MS_GSM, t);
+
+  // Commands received here are queued and applied by the control task.
+  t = metricStart();
+  mqttLoop();
+  metricStop(MS_MQTT, t);
+
+  updateWifiState();
+  heartbeatTick();
+  bleTick();
+  cfgFlushTick();
+
+  // DS18B20: one short bus transaction per pass at most
+  t = metricStart();
+  tempTick();
+  // DHT22: edges captured by ISR, decoded here
+  dhtTick();
+  histTick();
+  metricStop(MS_SENSORS, t);
+  metricStop(MS_NET, tStep);
+
+  // 1Hz log
+  /*
+  static uint32_t t0 = 0;
+  if(millis() - t0 > 1000){
+    t0 = millis();
+    logConnectivityTransitions();
+    String e, r, res;
+    for(int i=0;i<totalInputs;i++) e += String(inputs[i] ? 1 : 0);
+    for(int i=0;i<totalRelays;i++) r += String(relays[i] ? 1 : 0);
+    for(int i=0;i<totalRelays;i++) res += String(reservedByShutter[i] ? 1 : 0);
+    Serial.printf("[STATE] E=%s  R=%s  RES=%s\n",
+      e.c_str(), r.c_str(), res.c_str()
+    );
+  }
+  */
+
+  delay(2);
+}
+
+static void netTask(void*) {
+  for (;;) netStep();
+}
+
+static void startControlTask() {
+  controlMutex = xSemaphoreCreateMutex();
+  controlQueue = xQueueCreate(CONTROL_QUEUE_LEN, sizeof(ControlCmd));
+  xTaskCreatePinnedToCore(controlTask, "control", 4096, nullptr, CONTROL_TASK_PRIO, nullptr, CONTROL_TASK_CORE);
+  Serial.printf("[TASK] control core=%u period=%lums\n", CONTROL_TASK_CORE, (unsigned long)CONTROL_PERIOD_MS);
+}
+
+static void startNetTask() {
+  xTaskCreatePinnedToCore(netTask, "net", 16384, nullptr, NET_TASK_PRIO, nullptr, NET_TASK_CORE);
+  Serial.printf("[TASK] net core=%u\n", NET_TASK_CORE);
+}
+
 void setup() {
   pinMode(PIN_LED, OUTPUT);
   digitalWrite(PIN_LED, 0);
@@ -4146,7 +7727,7 @@ void setup() {
   }
   logFactoryPinState();
   if(factoryResetHeld()) doFactoryReset();
-  loadAuthCfg();
+  loadConfigStore();
 
   // I2C
   Serial.printf("[I2C] SDA=%d SCL=%d\n", I2C_SDA, I2C_SCL);
@@ -4158,7 +7739,7 @@ void setup() {
   pinMode(PIN_ONEWIRE, INPUT_PULLUP); // fallback pull-up (external 4.7k to 3V3 still recommended)
   delay(5);
   tempSensors.begin();
-  tempSensors.setWaitForConversion(false); // avoid blocking up to ~750ms per request
+  tempParasite = tempSensors.isParasitePowerMode();
   bool busPresent = oneWire.reset();
   Serial.printf("[TEMP] bus reset on GPIO%d: %s\n", PIN_ONEWIRE, busPresent ? "PRESENT" : "NO DEVICE");
   tempCount = scanOneWireTempBus();
@@ -4174,27 +7755,29 @@ void setup() {
       }
     }
   }
-  Serial.printf("[TEMP] sensors=%u on GPIO%d\n", tempCount, PIN_ONEWIRE);
+  tempApplyCfg();
+  Serial.printf("[TEMP] sensors=%u on GPIO%d%s\n", tempCount, PIN_ONEWIRE, tempParasite ? " (parasite)" : "");
   if (tempCount == 0) {
     Serial.println("[TEMP] no DS18B20 detected (check DATA pin, GND, 3V3 and 4.7k pull-up)");
   }
 
   // DHT22
-  dht.begin();
+  dhtBegin();
 
   // PCA9538 (scan 0x70..0x73)
   Serial.printf("[PCA9538] scan 0x%02X..0x%02X\n", PCA_BASE_ADDR, PCA_BASE_ADDR + PCA_MAX_MODULES - 1);
   pcaScanAndInit();
   Serial.printf("[PCA9538] modules found=%u (relays=%u inputs=%u)\n", pcaCount, totalRelays, totalInputs);
+  pcaSetupInterrupts();
 
   // Rules
   loadRulesFromFS();
   rebuildRuntimeFromRules();
 
+  // relais/entrées/volets pilotés dès maintenant, même si le GSM met du temps à s'attacher
+  startControlTask();
+
   // Ethernet
-  loadNetCfg();
-  loadWifiCfg();
-  loadBleCfg();
   buildEthernetMac();
   applyNetCfg();
   ethernetPrintInfo();
@@ -4202,7 +7785,8 @@ void setup() {
   initBle();
 
   // MQTT
-  loadMqttCfg();
+  loadMqttDiscHash();
+  loadGsmUsage();
   Serial.printf("[MQTT] device_id=%s base_effective=%s\n",
                 mqttDeviceId().c_str(),
                 mqttBaseTopic().c_str());
@@ -4215,119 +7799,19 @@ void setup() {
                 mqttCfg.gsmMqttHost.length() ? mqttCfg.gsmMqttHost.c_str() : "-",
                 mqttCfg.gsmMqttPort);
   if (mqttTransportAllowsGsm()) {
-    gsmLastTryMs = 0; // force immediate first attempt
-    if (gsmEnsureData()) {
-      Serial.println("[GSM] startup 1NCE: connected");
-    } else {
-      Serial.println("[GSM] startup 1NCE: failed");
-    }
+    // attache 1NCE en arrière-plan (gsmStep dans la tâche net), le boot n'attend pas le modem
+    Serial.println("[GSM] startup 1NCE: attach in background");
   } else {
     Serial.println("[GSM] startup skipped (transport mode)");
   }
   mqttSetup();
+  startNetTask();
 
   digitalWrite(PIN_LED, 1);
   Serial.println("[BOOT] Ready. Open http://<IP>/");
 }
 
 void loop() {
-  // Serve HTTP first to keep UI/API responsive even if other tasks slow down.
-  handleHttp();
-
-  // Process MQTT early so incoming commands are applied in the same loop cycle.
-  mqttLoop();
-  if (mqttFastCommandPending) {
-    // Fast path: apply command immediately, then continue normal cycle.
-    shutterTick();
-    evalSimpleRules();
-    buildFinalRelays();
-    pcaApplyRelays();
-    mqttFastCommandPending = false;
-  }
-
-  // read inputs early to update module status before serving HTTP
-  pcaReadInputs();
-  debounceInputs();
-
-  // combine physical + virtual inputs for rules/edges
-  for(int i=0;i<totalInputs;i++){
-    combinedInputs[i] = inputs[i] || virtualInputs[i];
-  }
-
-  updateWifiState();
-  heartbeatTick();
-  bleTick();
-
-  // tick shutter BEFORE computing simple rules, so it can use prevInputs if needed
-  shutterTick();
-
-  // compute simple rules (for all relays)
-  evalSimpleRules();
-
-  // build final outputs with ownership rules:
-  // simple -> shutter overwrites reserved -> overrides (non-reserved only) -> final safety
-  buildFinalRelays();
-
-  // apply outputs
-  pcaApplyRelays();
-
-  // Temperature polling
-  if(millis() - lastTempReadMs > 5000){
-    lastTempReadMs = millis();
-    if(tempCount > 0){
-      tempSensors.requestTemperatures();
-      for(uint8_t i=0;i<tempCount;i++){
-        float c = tempSensors.getTempC(tempAddr[i]);
-        tempC[i] = c;
-      }
-    }
-    // DHT reads can block when sensor is absent; once not detected, probe only occasionally.
-    const uint32_t nowMs = millis();
-    const bool shouldProbeDht = dhtPresent || !dhtCheckDone || nowMs >= dhtNextProbeMs;
-    if (shouldProbeDht) {
-      float dhtC = dht.readTemperature();
-      float dhtH = dht.readHumidity();
-      if(!isnan(dhtC) || !isnan(dhtH)){
-        if(!dhtPresent) mqttAnnouncedEth = false;
-        if(!dhtPresent) Serial.println("[DHT] detected");
-        dhtPresent = true;
-        if(!isnan(dhtC)) dhtTempC = dhtC;
-        if(!isnan(dhtH)) dhtHum = dhtH;
-        dhtCheckDone = true;
-        dhtNextProbeMs = nowMs + 5000;
-      } else {
-        if(!dhtCheckDone) {
-          Serial.println("[DHT] not detected");
-          dhtCheckDone = true;
-        }
-        if (!dhtPresent) {
-          dhtNextProbeMs = nowMs + 60000;
-        }
-      }
-    }
-  }
-
-  // update prev inputs for edge-based rules/toggle/pulse
-  for(int k=0;k<totalInputs;k++){
-    prevInputs[k] = inputs[k];
-    prevCombinedInputs[k] = combinedInputs[k];
-  }
-
-  // 1Hz log
-  /*
-  static uint32_t t0 = 0;
-  if(millis() - t0 > 1000){
-    t0 = millis();
-    logConnectivityTransitions();
-    String e, r, res;
-    for(int i=0;i<totalInputs;i++) e += String(inputs[i] ? 1 : 0);
-    for(int i=0;i<totalRelays;i++) r += String(relays[i] ? 1 : 0);
-    for(int i=0;i<totalRelays;i++) res += String(reservedByShutter[i] ? 1 : 0);
-    Serial.printf("[STATE] E=%s  R=%s  RES=%s\n",
-      e.c_str(), r.c_str(), res.c_str()
-    );
-  }
-  */
-
-  delay(2);
+  // tout tourne dans les tâches control/net
+  vTaskDelete(nullptr);
 }
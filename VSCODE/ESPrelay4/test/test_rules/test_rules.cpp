@@ -0,0 +1,221 @@
+// Test natif (pio test -e native): la table compilée (include/rules_compiled.h) donne
+// les mêmes sorties que l'ancien parcours JSON de rulesDoc; le bench affiche le gain.
+// Les délais (applyDelays) sont communs aux deux chemins et ne sont pas rejoués ici.
+#include <unity.h>
+#include <ArduinoJson.h>
+#include <chrono>
+#include <cstdio>
+#include "rules_compiled.h"
+
+static const int N_IO = 16;
+
+// 16 relais, tous les opérateurs, plus les cas limites (entrée hors plage, XOR
+// répété, liste vide, op absente ou inconnue, impulsion au niveau de la règle)
+static const char RULES_JSON[] = R"({"relays":[
+  {"expr":{"op":"FOLLOW","in":1}},
+  {"expr":{"op":"FOLLOW","in":2},"invert":true},
+  {"expr":{"op":"AND","ins":[1,2,3]}},
+  {"expr":{"op":"OR","ins":[4,5,6]}},
+  {"expr":{"op":"XOR","ins":[7,8,9]}},
+  {"expr":{"op":"TOGGLE_RISE","in":10}},
+  {"expr":{"op":"PULSE_RISE","in":11,"pulseMs":50}},
+  {"expr":{"op":"AND","ins":[12,13,14,15,16]}},
+  {"expr":{"op":"OR","ins":[1,16]},"invert":true},
+  {"expr":{"op":"XOR","ins":[3,3,4]}},
+  {"expr":{"op":"AND","ins":[2,17]}},
+  {"expr":{"op":"FOLLOW","in":20}},
+  {"expr":{"op":"NONE"}},
+  {"expr":{"in":5}},
+  {"expr":{"op":"PULSE_RISE","in":12},"pulseMs":30},
+  {"expr":{"op":"OR","ins":[]},"invert":true}
+]})";
+
+// Ancien évaluateur (avant la table compilée), état passé en membres
+struct JsonWalker {
+  bool cur[N_IO] = {};
+  bool prev[N_IO] = {};
+  bool toggle[N_IO] = {};
+  uint32_t pulseUntil[N_IO] = {};
+  uint32_t now = 0;
+
+  bool getInputN(int n) {
+    if(n < 1 || n > N_IO) return false;
+    return cur[n-1];
+  }
+
+  bool evalExprSimple(int relayIndex, JsonObject expr, uint32_t rulePulseMs) {
+    const char* op = expr["op"] | "FOLLOW";
+    if(strcmp(op, "NONE")==0) return false;
+    if(strcmp(op, "FOLLOW")==0){
+      int in = expr["in"] | 1;
+      return getInputN(in);
+    }
+    if(strcmp(op, "AND")==0 || strcmp(op,"OR")==0 || strcmp(op,"XOR")==0){
+      JsonArray ins = expr["ins"].as<JsonArray>();
+      if(!ins || ins.size()==0) return false;
+      bool acc = (strcmp(op,"AND")==0) ? true : false;
+      bool x = false;
+      for(JsonVariant v : ins){
+        int in = (int)v;
+        bool b = getInputN(in);
+        if(strcmp(op,"AND")==0) acc &= b;
+        else if(strcmp(op,"OR")==0) acc |= b;
+        else x ^= b;
+      }
+      return (strcmp(op,"XOR")==0) ? x : acc;
+    }
+    if(strcmp(op,"TOGGLE_RISE")==0){
+      int in = expr["in"] | 1;
+      bool thisRise = false;
+      if(in>=1 && in<=N_IO) thisRise = (cur[in-1] && !prev[in-1]);
+      if(thisRise) toggle[relayIndex] = !toggle[relayIndex];
+      return toggle[relayIndex];
+    }
+    if(strcmp(op,"PULSE_RISE")==0){
+      int in = expr["in"] | 1;
+      uint32_t pulseMs = expr["pulseMs"] | rulePulseMs;
+      if(pulseMs == 0) pulseMs = 1;
+      bool thisRise = false;
+      if(in>=1 && in<=N_IO) thisRise = (cur[in-1] && !prev[in-1]);
+      if(thisRise) pulseUntil[relayIndex] = now + pulseMs;
+      return (now < pulseUntil[relayIndex]);
+    }
+    return false;
+  }
+
+  void eval(JsonArray rel, bool* out) {
+    for(int i=0;i<N_IO;i++){
+      bool desired = false;
+      if(rel && i < (int)rel.size()){
+        JsonObject r = rel[i].as<JsonObject>();
+        JsonObject expr = r["expr"].as<JsonObject>();
+        uint32_t pulseMs = r["pulseMs"] | 200;
+        desired = evalExprSimple(i, expr, pulseMs);
+        bool inv = r["invert"] | false;
+        if(inv) desired = !desired;
+      }
+      out[i] = desired;
+    }
+  }
+};
+
+// Chemin actuel: même boucle que evalSimpleRules, sur la table compilée
+struct CompiledEval {
+  CompiledRule rules[N_IO];
+  int count = 0;
+  bool toggle[N_IO] = {};
+  uint32_t pulseUntil[N_IO] = {};
+
+  void build(JsonArray rel) {
+    count = (int)rel.size() < N_IO ? (int)rel.size() : N_IO;
+    for(int i=0;i<count;i++) compileRule(rel[i].as<JsonObject>(), rules[i], N_IO);
+  }
+
+  void eval(uint16_t cur, uint16_t prev, uint32_t now, bool* out) {
+    const uint16_t rise = cur & (uint16_t)~prev;
+    for(int i=0;i<N_IO;i++){
+      bool desired = false;
+      if(i < count){
+        desired = ruleEvalExpr(rules[i], cur, rise, now, toggle[i], pulseUntil[i]);
+        if(rules[i].invert) desired = !desired;
+      }
+      out[i] = desired;
+    }
+  }
+};
+
+static JsonDocument doc;
+
+// Suite d'entrées pseudo-aléatoire reproductible: 1 à 3 bits changent par cycle
+static uint16_t nextInputs(uint16_t cur, uint32_t &seed) {
+  seed = seed * 1664525u + 1013904223u;
+  cur ^= (uint16_t)(1u << ((seed >> 8) % N_IO));
+  if(seed & 0x10000u) cur ^= (uint16_t)(1u << ((seed >> 20) % N_IO));
+  if(seed & 0x20000u) cur ^= (uint16_t)(1u << ((seed >> 24) % N_IO));
+  return cur;
+}
+
+static void setBools(bool* dst, uint16_t mask) {
+  for(int i=0;i<N_IO;i++) dst[i] = (mask >> i) & 1u;
+}
+
+void setUp() {}
+void tearDown() {}
+
+static void test_compiled_matches_json_walker() {
+  JsonArray rel = doc["relays"].as<JsonArray>();
+  TEST_ASSERT_EQUAL(N_IO, (int)rel.size());
+  JsonWalker ref;
+  CompiledEval cmp;
+  cmp.build(rel);
+
+  uint32_t seed = 12345;
+  uint16_t cur = 0, prev = 0;
+  bool a[N_IO], b[N_IO];
+  for(int step=0; step<20000; step++){
+    prev = cur;
+    cur = nextInputs(cur, seed);
+    const uint32_t now = (uint32_t)step; // 1 ms par cycle: les fins d'impulsion tombent pile
+    setBools(ref.prev, prev);
+    setBools(ref.cur, cur);
+    ref.now = now;
+    ref.eval(rel, a);
+    cmp.eval(cur, prev, now, b);
+    for(int i=0;i<N_IO;i++){
+      if(a[i] != b[i]){
+        char msg[64];
+        snprintf(msg, sizeof(msg), "step %d relay %d", step, i + 1);
+        TEST_FAIL_MESSAGE(msg);
+      }
+    }
+  }
+}
+
+static void test_bench_compiled_vs_json() {
+  using Clock = std::chrono::steady_clock;
+  const int ROUNDS = 200000;
+  JsonArray rel = doc["relays"].as<JsonArray>();
+  JsonWalker ref;
+  CompiledEval cmp;
+  cmp.build(rel);
+  bool out[N_IO];
+
+  uint32_t seed = 99, sumJson = 0, sumCmp = 0;
+  uint16_t cur = 0, prev = 0;
+  const Clock::time_point t0 = Clock::now();
+  for(int k=0;k<ROUNDS;k++){
+    prev = cur;
+    cur = nextInputs(cur, seed);
+    setBools(ref.prev, prev);
+    setBools(ref.cur, cur);
+    ref.now = (uint32_t)k;
+    ref.eval(rel, out);
+    for(int i=0;i<N_IO;i++) sumJson += out[i] ? (uint32_t)(i + 1) : 0;
+  }
+  const Clock::time_point t1 = Clock::now();
+  seed = 99; cur = 0;
+  for(int k=0;k<ROUNDS;k++){
+    prev = cur;
+    cur = nextInputs(cur, seed);
+    cmp.eval(cur, prev, (uint32_t)k, out);
+    for(int i=0;i<N_IO;i++) sumCmp += out[i] ? (uint32_t)(i + 1) : 0;
+  }
+  const Clock::time_point t2 = Clock::now();
+
+  const double nsJson = std::chrono::duration<double, std::nano>(t1 - t0).count() / ROUNDS;
+  const double nsCmp = std::chrono::duration<double, std::nano>(t2 - t1).count() / ROUNDS;
+  char msg[96];
+  snprintf(msg, sizeof(msg), "16 relais: JSON %.0f ns/cycle, compilé %.0f ns/cycle (x%.1f)",
+           nsJson, nsCmp, nsCmp > 0 ? nsJson / nsCmp : 0.0);
+  TEST_MESSAGE(msg);
+  // temps affichés seulement: une assertion sur l'horloge serait instable en CI
+  TEST_ASSERT_EQUAL_UINT32(sumJson, sumCmp);
+}
+
+int main(int, char**) {
+  deserializeJson(doc, RULES_JSON);
+  UNITY_BEGIN();
+  RUN_TEST(test_compiled_matches_json_walker);
+  RUN_TEST(test_bench_compiled_vs_json);
+  return UNITY_END();
+}